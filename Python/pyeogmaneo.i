@@ -18,6 +18,8 @@
 
 %{
 #include "ComputeSystem.h"
+#include "WeightMatrix.h"
+#include "QuantizedMatrix.h"
 #include "Layer.h"
 #include "Hierarchy.h"
 #ifdef BUILD_PREENCODERS
@@ -48,10 +50,9 @@
 %template(Std2DVecf) std::vector<std::vector<float> >;
 %template(StdVecb) std::vector<bool>;
 
-%ignore eogmaneo::LayerForwardWorkItem;
-%ignore eogmaneo::LayerBackwardWorkItem;
-
 %include "ComputeSystem.h"
+%include "WeightMatrix.h"
+%include "QuantizedMatrix.h"
 %include "Layer.h"
 %include "Hierarchy.h"
 #ifdef BUILD_PREENCODERS
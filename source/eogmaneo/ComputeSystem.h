@@ -23,15 +23,59 @@ namespace eogmaneo {
 		ThreadPool _pool;
 		std::mt19937 _rng;
 
+		// Per-worker scratch memory, indexed by the thread index passed to work items
+		std::vector<std::vector<float>> _scratch;
+
+		// Grow every worker's scratch buffer to at least size floats (no-op once large enough)
+		void reserveScratch(size_t size) {
+			for (size_t i = 0; i < _scratch.size(); i++) {
+				if (_scratch[i].size() < size)
+					_scratch[i].resize(size);
+			}
+		}
+
+		float* getScratch(size_t threadIndex) {
+			return _scratch[threadIndex].data();
+		}
+
+		// Per-worker index scratch memory, same rules as the float scratch
+		std::vector<std::vector<int>> _indexScratch;
+
+		void reserveIndexScratch(size_t size) {
+			for (size_t i = 0; i < _indexScratch.size(); i++) {
+				if (_indexScratch[i].size() < size)
+					_indexScratch[i].resize(size);
+			}
+		}
+
+		int* getIndexScratch(size_t threadIndex) {
+			return _indexScratch[threadIndex].data();
+		}
+
 	public:
 		/*!
 		\brief Initialize the system.
 		\param numWorkers number of thread pool worker threads.
 		\param seed global random number generator seed. Defaults to 1234.
+		\param mode thread pool scheduling mode. Defaults to a single shared queue.
 		*/
-        ComputeSystem(size_t numWorkers, unsigned long seed = 1234) {
-			_pool.create(numWorkers);
+        ComputeSystem(size_t numWorkers, unsigned long seed = 1234, SchedulingMode mode = _sharedQueue) {
+			_pool.create(numWorkers, mode);
 			_rng.seed(seed);
+
+			// At least one, parallel for runs on the caller with thread index 0 when there are no workers
+			_scratch.resize(numWorkers > 0 ? numWorkers : 1);
+			_indexScratch.resize(_scratch.size());
+		}
+
+		/*!
+		\brief Set how worker threads wait for work and how the caller waits for workers.
+		Spinning trades CPU time for lower wake-up latency, useful for small hierarchies stepped at a high rate.
+		\param policy _block (default), _spin or _spinThenBlock.
+		\param spinMicroseconds busy wait budget before sleeping with _spinThenBlock.
+		*/
+		void setWaitPolicy(WaitPolicy policy, int spinMicroseconds = 50) {
+			_pool.setWaitPolicy(policy, spinMicroseconds);
 		}
 		
 		friend class Layer;
@@ -9,20 +9,43 @@
 #include "Hierarchy.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <fstream>
 #include <iostream>
+#include <random>
 #include <assert.h>
 
 using namespace eogmaneo;
 
+namespace {
+    // Random, so checkpoints of different runs never chain by accident
+    uint64_t newCheckpointId() {
+        std::random_device device;
+
+        uint64_t id = (static_cast<uint64_t>(device()) << 32) ^ device() ^ static_cast<uint64_t>(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+
+        return id == 0 ? 1 : id;
+    }
+}
+
 void Hierarchy::create(const std::vector<std::pair<int, int> > &inputSizes, const std::vector<int> &inputColumnSizes, const std::vector<bool> &predictInputs, const std::vector<LayerDesc> &layerDescs, unsigned long seed) {
-    std::mt19937 rng(seed);
+    create(nullptr, inputSizes, inputColumnSizes, predictInputs, layerDescs, seed);
+}
+
+void Hierarchy::create(ComputeSystem &cs, const std::vector<std::pair<int, int> > &inputSizes, const std::vector<int> &inputColumnSizes, const std::vector<bool> &predictInputs, const std::vector<LayerDesc> &layerDescs, unsigned long seed) {
+    create(&cs, inputSizes, inputColumnSizes, predictInputs, layerDescs, seed);
+}
+
+void Hierarchy::create(ComputeSystem* cs, const std::vector<std::pair<int, int> > &inputSizes, const std::vector<int> &inputColumnSizes, const std::vector<bool> &predictInputs, const std::vector<LayerDesc> &layerDescs, unsigned long seed) {
+    _checkpointId = 0;
 
     _layers.resize(layerDescs.size());
 
     _ticks.resize(layerDescs.size(), 0);
 
     _histories.resize(layerDescs.size());
+    _historyStarts.assign(layerDescs.size(), 0);
     
     _ticksPerUpdate.resize(layerDescs.size());
 
@@ -35,7 +58,9 @@ void Hierarchy::create(const std::vector<std::pair<int, int> > &inputSizes, cons
         _ticksPerUpdate[l] = l == 0 ? 1 : layerDescs[l]._ticksPerUpdate; // First layer always 1
 
     for (int l = 0; l < layerDescs.size(); l++) {
-        _histories[l].resize(l == 0 ? _inputSizes.size() * layerDescs[l]._temporalHorizon : layerDescs[l]._temporalHorizon);
+        int numHistorySlots = layerDescs[l]._temporalHorizon + _ticksPerUpdate[l];
+
+        _histories[l].resize(l == 0 ? _inputSizes.size() * numHistorySlots : numHistorySlots);
 
         std::vector<VisibleLayerDesc> visibleLayerDescs;
 
@@ -56,7 +81,7 @@ void Hierarchy::create(const std::vector<std::pair<int, int> > &inputSizes, cons
             }
 			
 			for (int v = 0; v < _histories[l].size(); v++) {
-				int in = v / layerDescs[l]._temporalHorizon;
+				int in = v / numHistorySlots;
 				
 				_histories[l][v].resize(std::get<0>(inputSizes[in]) * std::get<1>(inputSizes[in]), 0);	
 			}
@@ -77,48 +102,92 @@ void Hierarchy::create(const std::vector<std::pair<int, int> > &inputSizes, cons
 				_histories[l][v].resize(layerDescs[l - 1]._width * layerDescs[l - 1]._height, 0);
         }
 		
-        _layers[l].create(layerDescs[l]._width, layerDescs[l]._height, layerDescs[l]._columnSize, visibleLayerDescs, seed + l + 1);
+        _layers[l].create(cs, layerDescs[l]._width, layerDescs[l]._height, layerDescs[l]._columnSize, visibleLayerDescs, seed + l + 1, layerDescs[l]._weightLayout);
     }
 }
 
+Hierarchy::Hierarchy(const Hierarchy &other) {
+    *this = other;
+}
+
+Hierarchy &Hierarchy::operator=(const Hierarchy &other) {
+    if (this == &other)
+        return *this;
+
+    _layers = other._layers;
+    _histories = other._histories;
+    _historyStarts = other._historyStarts;
+    _updates = other._updates;
+    _ticks = other._ticks;
+    _ticksPerUpdate = other._ticksPerUpdate;
+    _inputTemporalHorizon = other._inputTemporalHorizon;
+    _inputSizes = other._inputSizes;
+    _mapping = other._mapping;
+    _checkpointId = other._checkpointId;
+
+    // Copied layers still read the other hierarchy's histories
+    for (int l = 0; l < _layers.size(); l++)
+        _layers[l].remapInputViews(other._histories[l], _histories[l]);
+
+    return *this;
+}
+
 void Hierarchy::step(ComputeSystem &cs, const std::vector<std::vector<int>> &inputs, bool learn, const std::vector<int> &topFeedBack) {
     assert(inputs.size() == _inputSizes.size());
 
-    _ticks[0] = 0;
+    // Mapped weights are read-only, learning works on private copies
+    if (learn && _mapping != nullptr) {
+        for (int l = 0; l < _layers.size(); l++)
+            _layers[l].makeWeightsPrivate();
 
-    // Add to first history   
-    {
-        int temporalHorizon = _histories.front().size() / inputs.size();
+        _mapping.reset();
+    }
 
-        for (int t = temporalHorizon - 1; t > 0; t--) {
-            for (int in = 0; in < inputs.size(); in++)
-                _histories.front()[t + temporalHorizon * in] = _histories.front()[(t - 1) + temporalHorizon * in];     
-        }
+    // Size every layer's buffers now, also those of layers that first update a few steps later
+    int numHistoryViews = 0;
 
-        for (int in = 0; in < inputs.size(); in++)
-            _histories.front()[0 + temporalHorizon * in] = inputs[in];
+    for (int l = 0; l < _layers.size(); l++) {
+        _layers[l].reserveBuffers(cs);
+
+        numHistoryViews = std::max(numHistoryViews, getNumHistoryInputs(l) * getTemporalHorizon(l));
     }
 
-    std::vector<int> updates(_layers.size(), false);
+    _historyViews.reserve(numHistoryViews);
+
+    _ticks[0] = 0;
+
+    // Add to first history, only the newest entry is written
+    advanceHistory(0);
+
+    for (int in = 0; in < inputs.size(); in++)
+        getHistory(0, in, 0) = inputs[in];
+
+    std::fill(_updates.begin(), _updates.end(), false);
 
     for (int l = 0; l < _layers.size(); l++) {
         if (l == 0 || _ticks[l] >= _ticksPerUpdate[l]) {
             _ticks[l] = 0;
 
-            updates[l] = true;
+            _updates[l] = true;
             
-            _layers[l].forward(cs, _histories[l], learn);
+            // Layers read their history in place
+            int temporalHorizon = getTemporalHorizon(l);
+
+            _historyViews.resize(getNumHistoryInputs(l) * temporalHorizon);
+
+            for (int in = 0; in < getNumHistoryInputs(l); in++)
+                for (int t = 0; t < temporalHorizon; t++)
+                    _historyViews[in * temporalHorizon + t] = getHistory(l, in, t).data();
+
+            _layers[l].forward(cs, _historyViews, learn);
 
             // Add to next layer's history
             if (l < _layers.size() - 1) {
                 int lNext = l + 1;
 
-                int temporalHorizon = _histories[lNext].size();
-
-                for (int t = temporalHorizon - 1; t > 0; t--)
-                    _histories[lNext][t] = _histories[lNext][t - 1];
+                advanceHistory(lNext);
 
-                _histories[lNext].front() = _layers[l].getHiddenStates();
+                getHistory(lNext, 0, 0) = _layers[l].getHiddenStates();
 
                 _ticks[lNext]++;
             }
@@ -127,59 +196,339 @@ void Hierarchy::step(ComputeSystem &cs, const std::vector<std::vector<int>> &inp
 
     // Backward
     for (int l = _layers.size() - 1; l >= 0; l--) {
-        if (updates[l]) {
-            std::vector<int> feedBack;
-
-            if (l < _layers.size() - 1)
-                feedBack = _layers[l + 1].getPredictions(_ticksPerUpdate[l + 1] - 1 - _ticks[l + 1]);
-            else
-                feedBack = topFeedBack;
+        if (_updates[l]) {
+            const std::vector<int> &feedBack = l < _layers.size() - 1 ? _layers[l + 1].getPredictions(_ticksPerUpdate[l + 1] - 1 - _ticks[l + 1]) : topFeedBack;
 
             _layers[l].backward(cs, feedBack, learn);
         }
     }
+}
 
-    _updates = updates;
+bool Hierarchy::save(const std::string &fileName) {
+    return writeCheckpoint(fileName, false, nullptr);
 }
 
-void Hierarchy::save(const std::string &fileName) {
-    std::ofstream os(fileName, std::ios::binary);
+bool Hierarchy::save(ComputeSystem &cs, const std::string &fileName) {
+    return writeCheckpoint(fileName, false, &cs);
+}
 
-    int numLayers = _layers.size();
+bool Hierarchy::saveDelta(const std::string &fileName) {
+    // Nothing to apply to
+    if (_checkpointId == 0)
+        return false;
 
-    os.write(reinterpret_cast<char*>(&numLayers), sizeof(int));
-    os.write(reinterpret_cast<char*>(&_inputTemporalHorizon), sizeof(int));
+    return writeCheckpoint(fileName, true, nullptr);
+}
 
-    int numInputs = _inputSizes.size();
+bool Hierarchy::writeCheckpoint(const std::string &fileName, bool delta, ComputeSystem* cs) {
+    // Quantized weights are not stored
+    if (isFrozen())
+        return false;
 
-    os.write(reinterpret_cast<char*>(&numInputs), sizeof(int));
-    os.write(reinterpret_cast<char*>(_inputSizes.data()), _inputSizes.size() * sizeof(std::pair<int, int>));
-    
-    // Write additional per-layer data
-    os.write(reinterpret_cast<char*>(_ticks.data()), _ticks.size() * sizeof(int));
-    os.write(reinterpret_cast<char*>(_ticksPerUpdate.data()), _ticksPerUpdate.size() * sizeof(int));
-    os.write(reinterpret_cast<char*>(_updates.data()), _updates.size() * sizeof(int));
+    ModelWriter writer;
+
+    // Section data is referenced until written
+    std::vector<ModelBuffer> buffers;
+    std::vector<std::vector<ModelBuffer> > layerBuffers;
+
+    uint64_t id = newCheckpointId();
+
+    writeSections(writer, buffers, layerBuffers, id, delta);
+
+    if (cs == nullptr) {
+        if (!writer.write(fileName))
+            return false;
+    }
+    else {
+        // Sections go to their own offsets, so they can be written in any order
+        std::atomic<bool> success(writer.beginWrite(fileName));
+
+        if (success)
+            cs->_pool.parallelFor(0, static_cast<int>(writer.getNumSections()), 1, [&writer, &success](int s, size_t threadIndex) {
+                if (success && !writer.writeSection(s))
+                    success = false;
+            });
+
+        if (!writer.endWrite(success))
+            return false;
+    }
+
+    startCheckpoint(id);
+
+    return true;
+}
+
+void Hierarchy::freeze(WeightPrecision precision) {
+    for (int l = 0; l < _layers.size(); l++)
+        _layers[l].freeze(precision);
+
+    // Nothing reads the mapped weights anymore
+    if (precision != _precisionFloat)
+        _mapping.reset();
+}
+
+void Hierarchy::startCheckpoint(uint64_t id) {
+    _checkpointId = id;
+
+    for (int l = 0; l < _layers.size(); l++)
+        _layers[l].initDirtyRows();
+}
+
+std::shared_future<bool> Hierarchy::saveAsync(const std::string &fileName, bool delta) {
+    if ((delta && _checkpointId == 0) || isFrozen()) {
+        std::promise<bool> failed;
+
+        failed.set_value(false);
+
+        return failed.get_future().share();
+    }
+
+    // The writer's snapshot is reused, so it must be written first
+    if (_checkpoint.valid())
+        _checkpoint.wait();
+
+    if (_checkpointWriter == nullptr)
+        _checkpointWriter = std::make_shared<ModelWriter>();
+
+    _checkpointWriter->clear();
+
+    uint64_t id = newCheckpointId();
+
+    {
+        std::vector<ModelBuffer> buffers;
+        std::vector<std::vector<ModelBuffer> > layerBuffers;
+
+        writeSections(*_checkpointWriter, buffers, layerBuffers, id, delta);
+
+        _checkpointWriter->snapshot();
+    }
+
+    // Later deltas apply to this checkpoint, even before it is written
+    startCheckpoint(id);
+
+    std::shared_ptr<ModelWriter> writer = _checkpointWriter;
+
+    _checkpoint = std::async(std::launch::async, [writer, fileName]() {
+        return writer->write(fileName);
+    }).share();
+
+    return _checkpoint;
+}
+
+void Hierarchy::writeSections(ModelWriter &writer, std::vector<ModelBuffer> &buffers, std::vector<std::vector<ModelBuffer> > &layerBuffers, uint64_t id, bool delta) const {
+    buffers.resize(2 + _layers.size());
+    layerBuffers.resize(_layers.size());
+
+    ModelBuffer &checkpoint = buffers[0];
+
+    checkpoint.putUInt64(id);
+    checkpoint.putUInt64(delta ? _checkpointId : 0);
+
+    writer.addSection(_sectionCheckpoint, 0, 0, checkpoint.getBytes().data(), checkpoint.getBytes().size());
+
+    ModelBuffer &hierarchy = buffers[1];
+
+    hierarchy.putInt(_layers.size());
+    hierarchy.putInt(_inputTemporalHorizon);
+    hierarchy.putInt(_inputSizes.size());
+
+    for (int in = 0; in < _inputSizes.size(); in++) {
+        hierarchy.putInt(std::get<0>(_inputSizes[in]));
+        hierarchy.putInt(std::get<1>(_inputSizes[in]));
+    }
+
+    hierarchy.putInts(_ticks.data(), _ticks.size());
+    hierarchy.putInts(_ticksPerUpdate.data(), _ticksPerUpdate.size());
+    hierarchy.putInts(_updates.data(), _updates.size());
+
+    writer.addSection(_sectionHierarchy, 0, 0, hierarchy.getBytes().data(), hierarchy.getBytes().size());
 
     for (int l = 0; l < _layers.size(); l++) {
-        int temporalHorizon = l == 0 ? _histories[l].size() / _inputSizes.size() : _histories[l].size();
-    
-        os.write(reinterpret_cast<char*>(&temporalHorizon), sizeof(int));
+        int temporalHorizon = getTemporalHorizon(l);
+
+        ModelBuffer &history = buffers[2 + l];
 
-        // History
-        for (int v = 0; v < _histories[l].size(); v++)
-            os.write(reinterpret_cast<char*>(_histories[l][v].data()), _histories[l][v].size() * sizeof(int));
+        history.putInt(temporalHorizon);
 
-        // Write layer
-        _layers[l].writeToStream(os);
+        // History, newest entry first
+        for (int in = 0; in < getNumHistoryInputs(l); in++)
+            for (int t = 0; t < temporalHorizon; t++) {
+                const std::vector<int> &entry = getHistory(l, in, t);
+
+                history.putInts(entry.data(), entry.size());
+            }
+
+        writer.addSection(_sectionHistory, l, 0, history.getBytes().data(), history.getBytes().size());
+
+        _layers[l].writeSections(writer, l, layerBuffers[l], delta);
     }
 }
 
+bool Hierarchy::readSections(ModelReader &reader, ComputeSystem* cs) {
+    // A delta is no model by itself
+    uint64_t parentId;
+
+    if (!reader.getCheckpoint(_checkpointId, parentId))
+        _checkpointId = 0;
+    else if (parentId != 0)
+        return false;
+
+    size_t size;
+
+    const char* section = reader.getSection(_sectionHierarchy, 0, 0, size);
+
+    if (section == nullptr)
+        return false;
+
+    ModelParser parser(section, size);
+
+    const int maxSize = 1 << 16;
+
+    _layers.resize(parser.getCount(maxSize));
+
+    _inputTemporalHorizon = parser.getCount(maxSize);
+
+    _inputSizes.resize(parser.getCount(maxSize));
+
+    for (int in = 0; in < _inputSizes.size(); in++) {
+        std::get<0>(_inputSizes[in]) = parser.getCount(maxSize);
+        std::get<1>(_inputSizes[in]) = parser.getCount(maxSize);
+    }
+
+    _ticks.resize(_layers.size());
+    _ticksPerUpdate.resize(_layers.size());
+    _updates.resize(_layers.size());
+
+    parser.getInts(_ticks.data(), _ticks.size());
+    parser.getInts(_ticksPerUpdate.data(), _ticksPerUpdate.size());
+    parser.getInts(_updates.data(), _updates.size());
+
+    if (!parser.good() || _layers.empty())
+        return false;
+
+    _histories.resize(_layers.size());
+    _historyStarts.assign(_layers.size(), 0);
+
+    for (int l = 0; l < _layers.size(); l++) {
+        section = reader.getSection(_sectionHistory, l, 0, size);
+
+        if (section == nullptr || _ticksPerUpdate[l] < 1 || _ticksPerUpdate[l] > maxSize)
+            return false;
+
+        ModelParser historyParser(section, size);
+
+        int temporalHorizon = historyParser.getCount(maxSize);
+
+        // History, the ring starts at slot 0 and its extra slots are zero
+        int numHistorySlots = temporalHorizon + _ticksPerUpdate[l];
+
+        _histories[l].resize(l == 0 ? _inputSizes.size() * numHistorySlots : numHistorySlots);
+
+        for (int v = 0; v < _histories[l].size(); v++) {
+            int in = v / numHistorySlots;
+            int t = v % numHistorySlots;
+
+            if (l == 0)
+                _histories[l][v].assign(std::get<0>(_inputSizes[in]) * std::get<1>(_inputSizes[in]), 0);
+            else
+                _histories[l][v].assign(_layers[l - 1].getHiddenWidth() * _layers[l - 1].getHiddenHeight(), 0);
+
+            if (t < temporalHorizon)
+                historyParser.getInts(_histories[l][v].data(), _histories[l][v].size());
+        }
+
+        if (!historyParser.good() || !_layers[l].readSections(reader, l))
+            return false;
+    }
+
+    // Weights not held by the reader, each straight into its matrix
+    std::atomic<bool> success(true);
+
+    if (cs == nullptr) {
+        for (size_t r = 0; success && r < reader.getNumRequests(); r++)
+            success = reader.readRequest(r);
+    }
+    else
+        cs->_pool.parallelFor(0, static_cast<int>(reader.getNumRequests()), 1, [&reader, &success](int r, size_t threadIndex) {
+            if (success && !reader.readRequest(r))
+                success = false;
+        });
+
+    if (!success)
+        return false;
+
+    for (int l = 0; l < _layers.size(); l++)
+        _layers[l].initWinnerWeights();
+
+    return true;
+}
+
 bool Hierarchy::load(const std::string &fileName) {
+    return load(fileName, nullptr);
+}
+
+bool Hierarchy::load(ComputeSystem &cs, const std::string &fileName) {
+    return load(fileName, &cs);
+}
+
+bool Hierarchy::load(const std::string &fileName, ComputeSystem* cs) {
+    if (!ModelReader::isModelFile(fileName))
+        return loadLegacy(fileName);
+
+    ModelReader reader;
+
+    if (!reader.open(fileName))
+        return false;
+
+    // Loaded aside, so a bad file leaves this hierarchy as it was
+    Hierarchy loaded;
+
+    if (!loaded.readSections(reader, cs))
+        return false;
+
+    *this = std::move(loaded);
+
+    return true;
+}
+
+bool Hierarchy::loadMapped(const std::string &fileName, bool checkWeights) {
+    ModelReader reader;
+
+    if (!reader.map(fileName, checkWeights))
+        return false;
+
+    Hierarchy loaded;
+
+    if (!loaded.readSections(reader, nullptr))
+        return false;
+
+    // Weights are used in place, so the mapping must live as long as they do
+    if (hostIsLittleEndian())
+        loaded._mapping = reader.getMapping();
+
+    *this = std::move(loaded);
+
+    return true;
+}
+
+bool Hierarchy::loadLegacy(const std::string &fileName) {
     std::ifstream is(fileName, std::ios::binary);
 
     if (!is.is_open())
         return false;
 
+    // Loaded aside like model files, and the whole file must be used, any other layout is rejected
+    Hierarchy loaded;
+
+    if (!loaded.readLegacy(is) || is.peek() != std::char_traits<char>::eof())
+        return false;
+
+    *this = std::move(loaded);
+
+    return true;
+}
+
+bool Hierarchy::readLegacy(std::istream &is) {
     int numLayers;
 
     is.read(reinterpret_cast<char*>(&numLayers), sizeof(int));
@@ -189,15 +538,30 @@ bool Hierarchy::load(const std::string &fileName) {
 
     is.read(reinterpret_cast<char*>(&numInputs), sizeof(int));
 
+    // Not a legacy file either (e.g. a model file with a damaged magic)
+    const int maxSize = 1 << 16;
+
+    if (!is.good() || numLayers < 1 || numLayers > maxSize || _inputTemporalHorizon < 0 || _inputTemporalHorizon > maxSize || numInputs < 1 || numInputs > maxSize)
+        return false;
+
     _inputSizes.resize(numInputs);
 
     is.read(reinterpret_cast<char*>(_inputSizes.data()), _inputSizes.size() * sizeof(std::pair<int, int>));
+
+    if (!is.good())
+        return false;
+
+    for (int in = 0; in < _inputSizes.size(); in++) {
+        if (std::get<0>(_inputSizes[in]) < 0 || std::get<0>(_inputSizes[in]) > maxSize || std::get<1>(_inputSizes[in]) < 0 || std::get<1>(_inputSizes[in]) > maxSize)
+            return false;
+    }
     
     _layers.resize(numLayers);
 
     _ticks.resize(_layers.size());
 
     _histories.resize(_layers.size());
+    _historyStarts.assign(_layers.size(), 0);
     
     _ticksPerUpdate.resize(_layers.size());
 
@@ -212,30 +576,37 @@ bool Hierarchy::load(const std::string &fileName) {
         int temporalHorizon;
 
         is.read(reinterpret_cast<char*>(&temporalHorizon), sizeof(int));
-    
-        // History
-        _histories[l].resize(l == 0 ? _inputSizes.size() * temporalHorizon : temporalHorizon);
 
-        if (l == 0) {
-            for (int v = 0; v < _histories[l].size(); v++) {
-                int in = v / temporalHorizon;
-                    
-                _histories[l][v].resize(std::get<0>(_inputSizes[in]) * std::get<1>(_inputSizes[in]));
-                
-                is.read(reinterpret_cast<char*>(_histories[l][v].data()), _histories[l][v].size() * sizeof(int));
-            }
-        }
-        else {
-            for (int v = 0; v < _histories[l].size(); v++) {
-				_histories[l][v].resize(_layers[l - 1].getHiddenWidth() * _layers[l - 1].getHiddenHeight());
+        if (!is.good() || temporalHorizon < 0 || temporalHorizon > maxSize || _ticksPerUpdate[l] < 1 || _ticksPerUpdate[l] > maxSize)
+            return false;
+
+        // History, the ring starts at slot 0 and its extra slots are zero
+        int numHistorySlots = temporalHorizon + _ticksPerUpdate[l];
+
+        _histories[l].resize(l == 0 ? _inputSizes.size() * numHistorySlots : numHistorySlots);
+
+        for (int v = 0; v < _histories[l].size(); v++) {
+            int in = v / numHistorySlots;
+            int t = v % numHistorySlots;
 
+            int size = l == 0 ? std::get<0>(_inputSizes[in]) * std::get<1>(_inputSizes[in]) : _layers[l - 1].getHiddenWidth() * _layers[l - 1].getHiddenHeight();
+
+            if (!streamHolds(is, { static_cast<uint64_t>(size), sizeof(int) }))
+                return false;
+
+            _histories[l][v].assign(size, 0);
+
+            if (t < temporalHorizon)
                 is.read(reinterpret_cast<char*>(_histories[l][v].data()), _histories[l][v].size() * sizeof(int));
-            }
         }
 
         // Read layer
-        _layers[l].readFromStream(is);
+        if (!_layers[l].readFromStream(is))
+            return false;
     }
 
+    // Legacy files are not checkpoints deltas can apply to
+    _checkpointId = 0;
+
     return true;
 }
\ No newline at end of file
@@ -10,6 +10,8 @@
 
 #include "Layer.h"
 
+#include <future>
+
 namespace eogmaneo {
     /*!
     \brief Parameters for a layer.
@@ -46,13 +48,19 @@ namespace eogmaneo {
         */
 		int _temporalHorizon;
 
+        /*!
+        \brief Memory layout of the layer's feed forward weights.
+        */
+        WeightLayout _weightLayout;
+
         /*!
         \brief Initialize defaults.
         */
 		LayerDesc()
 			: _width(4), _height(4), _columnSize(16),
 			_forwardRadius(2), _backwardRadius(2),
-			_ticksPerUpdate(2), _temporalHorizon(2)
+			_ticksPerUpdate(2), _temporalHorizon(2),
+            _weightLayout(_hiddenCellMajor)
 		{}
 	};
 
@@ -63,8 +71,16 @@ namespace eogmaneo {
     private:
         std::vector<Layer> _layers;
 
+        // Per layer, a ring of temporalHorizon + ticksPerUpdate slots per input (slot in * slots + s), so the
+        // inputs of a layer's previous update are still intact when it reads them in place during the next one
         std::vector<std::vector<std::vector<int> > > _histories;
 
+        // Per layer, ring position of the newest history entry
+        std::vector<int> _historyStarts;
+
+        // Input pointers handed to a layer, reused every step
+        std::vector<const int*> _historyViews;
+
         std::vector<int> _updates;
 
         std::vector<int> _ticks;
@@ -73,7 +89,83 @@ namespace eogmaneo {
         int _inputTemporalHorizon;
         std::vector<std::pair<int, int> > _inputSizes;
 
+        // Model file the weights are views of, see loadMapped(...)
+        std::shared_ptr<const MappedFile> _mapping;
+
+        // Id of the last checkpoint saved or loaded (0 for none), deltas apply to it
+        uint64_t _checkpointId;
+
+        // Writer of the last saveAsync(...) checkpoint (holding its snapshot), and its result
+        std::shared_ptr<ModelWriter> _checkpointWriter;
+        std::shared_future<bool> _checkpoint;
+
+        int getNumHistoryInputs(int l) const {
+            return l == 0 ? _inputSizes.size() : 1;
+        }
+
+        int getNumHistorySlots(int l) const {
+            return _histories[l].size() / getNumHistoryInputs(l);
+        }
+
+        int getTemporalHorizon(int l) const {
+            return getNumHistorySlots(l) - _ticksPerUpdate[l];
+        }
+
+        /*!
+        \brief Get the buffer of a layer's history entry t (0 is the newest) of an input.
+        */
+        std::vector<int> &getHistory(int l, int in, int t) {
+            int numSlots = getNumHistorySlots(l);
+
+            return _histories[l][in * numSlots + (_historyStarts[l] + t) % numSlots];
+        }
+
+        const std::vector<int> &getHistory(int l, int in, int t) const {
+            int numSlots = getNumHistorySlots(l);
+
+            return _histories[l][in * numSlots + (_historyStarts[l] + t) % numSlots];
+        }
+
+        /*!
+        \brief Advance a layer's history by one entry, the oldest slot becomes the newest (to be overwritten).
+        */
+        void advanceHistory(int l) {
+            _historyStarts[l] = (_historyStarts[l] + getNumHistorySlots(l) - 1) % getNumHistorySlots(l);
+        }
+
+        void writeSections(ModelWriter &writer, std::vector<ModelBuffer> &buffers, std::vector<std::vector<ModelBuffer> > &layerBuffers, uint64_t id, bool delta) const;
+        bool writeCheckpoint(const std::string &fileName, bool delta, ComputeSystem* cs);
+        void startCheckpoint(uint64_t id);
+        bool readSections(ModelReader &reader, ComputeSystem* cs);
+        bool load(const std::string &fileName, ComputeSystem* cs);
+        void create(ComputeSystem* cs, const std::vector<std::pair<int, int> > &inputSizes, const std::vector<int> &inputColumnSizes, const std::vector<bool> &predictInputs, const std::vector<LayerDesc> &layerDescs, unsigned long seed);
+        bool loadLegacy(const std::string &fileName);
+        bool readLegacy(std::istream &is);
+
     public:
+        /*!
+        \brief Default constructor, call create(...) or load(...) before use.
+        */
+        Hierarchy()
+        : _checkpointId(0)
+        {}
+
+        //!@{
+        /*!
+        \brief Copying also points the copied layers at the copied histories. A checkpoint being written is not copied.
+        */
+        Hierarchy(const Hierarchy &other);
+        Hierarchy &operator=(const Hierarchy &other);
+        //!@}
+
+        //!@{
+        /*!
+        \brief Moving keeps history buffers in place, so layers stay valid.
+        */
+        Hierarchy(Hierarchy &&other) = default;
+        Hierarchy &operator=(Hierarchy &&other) = default;
+        //!@}
+
         /*!
         \brief Create the hierarchy.
         \param inputSizes vector of input dimension tuples.
@@ -84,25 +176,91 @@ namespace eogmaneo {
         */
         void create(const std::vector<std::pair<int, int> > &inputSizes, const std::vector<int> &inputColumnSizes, const std::vector<bool> &predictInputs, const std::vector<LayerDesc> &layerDescs, unsigned long seed);
 
+        /*!
+        \brief Create the hierarchy like create(...), initializing the weights of each layer in parallel on the compute system's workers. The weights are the same for any number of workers.
+        */
+        void create(ComputeSystem &cs, const std::vector<std::pair<int, int> > &inputSizes, const std::vector<int> &inputColumnSizes, const std::vector<bool> &predictInputs, const std::vector<LayerDesc> &layerDescs, unsigned long seed);
+
         /*!
         \brief Simulation step/tick.
+        Only the first step (and the first after changing a layer's _codeIters or _incremental) allocates, every layer's buffers are sized up front, not when it first updates.
         \param cs compute system to be used.
-        \param inputs vector of SDR vectors in columnar format.
+        \param inputs vector of SDR vectors in columnar format. Columns without an input (dropped sensors, outside a region of interest) are _noInput and skip all work.
         \param learn whether learning should be enabled, defaults to true.
         \param topFeedBack SDR vector in columnar format of top-level feed back state.
         */
         void step(ComputeSystem &cs, const std::vector<std::vector<int> > &inputs, bool learn = true, const std::vector<int> &topFeedBack = {});
 
         /*!
-        \brief Save the hierarchy to a file.
+        \brief Save the hierarchy to a model file (see ModelFile.h). Returns false if the file could not be written or the hierarchy is frozen.
+        Prediction columns and _incremental are run time settings and are not saved.
+        Every save, saveDelta, saveAsync or load is a checkpoint, later deltas hold the changes since.
+        */
+        bool save(const std::string &fileName);
+
+        /*!
+        \brief Save like save(...), writing the sections of all layers and visible layers in parallel on the compute system's workers.
         */
-        void save(const std::string &fileName);
+        bool save(ComputeSystem &cs, const std::string &fileName);
 
         /*!
-        \brief Load the hierarchy from a file.
+        \brief Save a delta checkpoint, all states but only the weight rows learning changed since the last checkpoint.
+        Restore with mergeModelFiles(...) (the last full model then all deltas since) and load(...) the result.
+        Returns false if there is no checkpoint to apply to (after create(...) or loading a legacy file) or the file could not be written.
+        */
+        bool saveDelta(const std::string &fileName);
+
+        /*!
+        \brief Save the hierarchy like save(...), but write the file on a background thread.
+        Only a snapshot of the hierarchy is taken before returning (a copy of the weights into storage reused by the next checkpoint), step(...) can run meanwhile.
+        The file appears (renamed from fileName + ".tmp") once complete. One checkpoint is written at a time, a new one first waits for the last.
+        Destroying the hierarchy waits for the write to finish.
+        If the write fails, later deltas apply to a checkpoint that does not exist, save a full model again.
+        \param delta whether to save a delta checkpoint (see saveDelta(...)).
+        \return a future of what save(...) or saveDelta(...) would return.
+        */
+        std::shared_future<bool> saveAsync(const std::string &fileName, bool delta = false);
+
+        /*!
+        \brief Load the hierarchy from a file, a model file or one in the legacy headerless format.
+        Returns false if the file cannot be read or is corrupt, the hierarchy is then unchanged.
+        A legacy file must hold exactly what the legacy writer wrote, one that is short or has bytes left over is corrupt.
         */
         bool load(const std::string &fileName);
 
+        /*!
+        \brief Load like load(...), reading the weights of all layers and visible layers in parallel on the compute system's workers, straight into place.
+        */
+        bool load(ComputeSystem &cs, const std::string &fileName);
+
+        /*!
+        \brief Load the hierarchy from a model file, mapping it read-only and using its weights in place.
+        Processes mapping the same file share one physical copy of the weights, only states are private. The first step with learning copies the weights.
+        Copies of the hierarchy share the mapping too. Returns false if the file cannot be mapped or is corrupt (leaving the hierarchy unchanged), legacy files are not supported.
+        \param checkWeights whether weight checksums are checked, which reads all weights once. Skip it for near-instant loading when the file is known to be good.
+        */
+        bool loadMapped(const std::string &fileName, bool checkWeights = true);
+
+        /*!
+        \brief Whether the weights are views of a mapped model file (see loadMapped(...)).
+        */
+        bool isMapped() const {
+            return _mapping != nullptr;
+        }
+
+        /*!
+        \brief Freeze all layers for inference at a reduced weight precision (see Layer::freeze), about half (_precisionHalf) or a quarter (_precisionInt8) of the weight memory.
+        step(...) no longer learns and the hierarchy can no longer be saved. Mapped weights are quantized into private memory and the mapping is released.
+        */
+        void freeze(WeightPrecision precision);
+
+        /*!
+        \brief Whether the layers are frozen (see freeze(...)).
+        */
+        bool isFrozen() const {
+            return !_layers.empty() && _layers.front().isFrozen();
+        }
+
         /*!
         \brief Get the number of (hidden) layers.
         */
@@ -112,6 +270,7 @@ namespace eogmaneo {
 
         /*!
         \brief Get the predicted version of the input.
+        Only columns registered with setPredictionColumns(...) or setPredictionRegion(...) (all by default) whose input is not missing are valid, the others are _noInput.
         \param i the index of the input to retrieve.
         */
         const std::vector<int> &getPredictions(int i) const {
@@ -120,6 +279,30 @@ namespace eogmaneo {
             return _layers.front().getPredictions(index);
         }
 
+        /*!
+        \brief Only compute predictions of an input for some of its columns, see Layer::setPredictionColumns.
+        \param i the index of the input, must be predicted.
+        \param columns column indices (x + y * width) whose predictions are read.
+        \param learnOutside whether the other columns keep learning (exact), or learn lazily once they are predicted again (cheaper).
+        */
+        void setPredictionColumns(int i, const std::vector<int> &columns, bool learnOutside = true) {
+            _layers.front().setPredictionColumns(i * _inputTemporalHorizon, columns, learnOutside);
+        }
+
+        /*!
+        \brief Only compute predictions of an input inside a rectangle of columns, see setPredictionColumns.
+        */
+        void setPredictionRegion(int i, int x, int y, int width, int height, bool learnOutside = true) {
+            _layers.front().setPredictionRegion(i * _inputTemporalHorizon, x, y, width, height, learnOutside);
+        }
+
+        /*!
+        \brief Compute predictions of all columns of an input again.
+        */
+        void clearPredictionColumns(int i) {
+            _layers.front().clearPredictionColumns(i * _inputTemporalHorizon);
+        }
+
         /*!
         \brief Whether this layer received on update this timestep.
         */
@@ -144,8 +327,16 @@ namespace eogmaneo {
         /*!
         \brief Get history of a layer's input.
         */
-        const std::vector<std::vector<int> > getHistories(int l) {
-            return _histories[l];
+        std::vector<std::vector<int> > getHistories(int l) const {
+            int temporalHorizon = getTemporalHorizon(l);
+
+            std::vector<std::vector<int> > histories(getNumHistoryInputs(l) * temporalHorizon);
+
+            for (int in = 0; in < getNumHistoryInputs(l); in++)
+                for (int t = 0; t < temporalHorizon; t++)
+                    histories[in * temporalHorizon + t] = getHistory(l, in, t);
+
+            return histories;
         }
 
         /*!
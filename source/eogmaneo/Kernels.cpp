@@ -0,0 +1,346 @@
+// ----------------------------------------------------------------------------
+//  EOgmaNeo
+//  Copyright(c) 2017-2018 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of EOgmaNeo is licensed to you under the terms described
+//  in the EOGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#include "Kernels.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+using namespace eogmaneo;
+
+namespace {
+    void accumulate(float* dst, const float* src, int stride, int n) {
+        for (int i = 0; i < n; i++)
+            dst[i] += src[i * stride];
+    }
+
+    void accumulateScaled(float* dst, const float* src, int stride, float scale, int n) {
+        for (int i = 0; i < n; i++)
+            dst[i] += src[i * stride] * scale;
+    }
+
+    void accumulateNegSquaredDistance(float* dst, const float* src, int stride, float x, int n) {
+        for (int i = 0; i < n; i++) {
+            float d = x - src[i * stride];
+
+            dst[i] += -d * d;
+        }
+    }
+
+    int argMax(const float* x, int n) {
+        int maxIndex = 0;
+
+        for (int i = 1; i < n; i++) {
+            if (x[i] > x[maxIndex])
+                maxIndex = i;
+        }
+
+        return maxIndex;
+    }
+
+    void deltas(float* deltas, const float* activations, int target, float rate, int n) {
+        for (int i = 0; i < n; i++) {
+            float s = 1.0f / (1.0f + std::exp(-activations[i]));
+
+            deltas[i] = ((i == target ? 1.0f : 0.0f) - s) * rate;
+        }
+    }
+
+    void accumulateRows(float* dst, const float* src, const int* offsets, int count, int stride, int n) {
+        for (int k = 0; k < count; k++) {
+            const float* row = src + offsets[k];
+
+            for (int i = 0; i < n; i++)
+                dst[i] += row[i * stride];
+        }
+    }
+
+    // n fixed to size at compile time, so the compiler can unroll the cells
+    template<int size>
+    void accumulateRowsFixed(float* dst, const float* src, const int* offsets, int count, int stride, int) {
+        for (int k = 0; k < count; k++) {
+            const float* row = src + offsets[k];
+
+            for (int i = 0; i < size; i++)
+                dst[i] += row[i * stride];
+        }
+    }
+
+    void accumulateRowsScaled(float* dst, const float* src, const int* offsets, const float* scales, int count, int stride, int n) {
+        for (int k = 0; k < count; k++) {
+            const float* row = src + offsets[k];
+            float scale = scales[k];
+
+            for (int i = 0; i < n; i++)
+                dst[i] += row[i * stride] * scale;
+        }
+    }
+
+    template<int size>
+    void accumulateRowsScaledFixed(float* dst, const float* src, const int* offsets, const float* scales, int count, int stride, int) {
+        for (int k = 0; k < count; k++) {
+            const float* row = src + offsets[k];
+            float scale = scales[k];
+
+            for (int i = 0; i < size; i++)
+                dst[i] += row[i * stride] * scale;
+        }
+    }
+
+    template<bool scaled>
+    void accumulateRowsHalfScaling(float* dst, const uint16_t* src, const int* rows, const float* scales, int count, int rowStride, int n) {
+        for (int k = 0; k < count; k++) {
+            const uint16_t* row = src + static_cast<size_t>(rows[k]) * rowStride;
+
+            for (int i = 0; i < n; i++)
+                dst[i] += scaled ? halfToFloat(row[i]) * scales[k] : halfToFloat(row[i]);
+        }
+    }
+
+    void accumulateRowsHalf(float* dst, const uint16_t* src, const int* rows, const float* scales, int count, int rowStride, int n) {
+        if (scales == nullptr)
+            accumulateRowsHalfScaling<false>(dst, src, rows, scales, count, rowStride, n);
+        else
+            accumulateRowsHalfScaling<true>(dst, src, rows, scales, count, rowStride, n);
+    }
+
+    template<bool scaled>
+    void accumulateRowsInt8Scaling(float* dst, const int8_t* src, const float* steps, const float* bases, const int* rows, const float* scales, int count, int rowStride, int n) {
+        for (int k = 0; k < count; k++) {
+            const int8_t* row = src + static_cast<size_t>(rows[k]) * rowStride;
+
+            for (int i = 0; i < n; i++) {
+                float w = static_cast<float>(row[i]) * steps[i] + bases[i];
+
+                dst[i] += scaled ? w * scales[k] : w;
+            }
+        }
+    }
+
+    void accumulateRowsInt8(float* dst, const int8_t* src, const float* steps, const float* bases, const int* rows, const float* scales, int count, int rowStride, int n) {
+        if (scales == nullptr)
+            accumulateRowsInt8Scaling<false>(dst, src, steps, bases, rows, scales, count, rowStride, n);
+        else
+            accumulateRowsInt8Scaling<true>(dst, src, steps, bases, rows, scales, count, rowStride, n);
+    }
+
+    // Slicing-by-8 tables of the reflected CRC-32C polynomial
+    struct Crc32cTables {
+        uint32_t _table[8][256];
+
+        Crc32cTables() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t crc = i;
+
+                for (int j = 0; j < 8; j++)
+                    crc = (crc >> 1) ^ (0x82f63b78u & (0u - (crc & 1u)));
+
+                _table[0][i] = crc;
+            }
+
+            for (uint32_t i = 0; i < 256; i++) {
+                for (int t = 1; t < 8; t++)
+                    _table[t][i] = (_table[t - 1][i] >> 8) ^ _table[0][_table[t - 1][i] & 0xff];
+            }
+        }
+    };
+
+    const Crc32cTables &getCrc32cTables() {
+        static const Crc32cTables tables;
+
+        return tables;
+    }
+
+    uint32_t crc32c(uint32_t crc, const unsigned char* data, size_t size) {
+        const Crc32cTables &tables = getCrc32cTables();
+
+        // Eight bytes at a time, assembled little-endian so the result does not depend on the host
+        while (size >= 8) {
+            uint32_t low = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24));
+            uint32_t high = data[4] | (data[5] << 8) | (data[6] << 16) | (static_cast<uint32_t>(data[7]) << 24);
+
+            crc = tables._table[7][low & 0xff] ^ tables._table[6][(low >> 8) & 0xff] ^ tables._table[5][(low >> 16) & 0xff] ^ tables._table[4][low >> 24] ^
+                tables._table[3][high & 0xff] ^ tables._table[2][(high >> 8) & 0xff] ^ tables._table[1][(high >> 16) & 0xff] ^ tables._table[0][high >> 24];
+
+            data += 8;
+            size -= 8;
+        }
+
+        for (; size > 0; size--, data++)
+            crc = (crc >> 8) ^ tables._table[0][(crc ^ *data) & 0xff];
+
+        return crc;
+    }
+
+    // Fully unrolling 16 cells measured slower than the loop, so that size takes the generic versions
+    const ColumnKernels scalarColumnKernels[] = {
+        { 32, accumulateRowsFixed<32>, accumulateRowsScaledFixed<32> },
+        { 64, accumulateRowsFixed<64>, accumulateRowsScaledFixed<64> },
+        { 0, accumulateRows, accumulateRowsScaled }
+    };
+
+    const Kernels scalarKernels = {
+        _kernelScalar,
+        "scalar",
+        accumulate,
+        accumulateScaled,
+        accumulateNegSquaredDistance,
+        argMax,
+        deltas,
+        scalarColumnKernels,
+        accumulateRowsHalf,
+        accumulateRowsInt8,
+        crc32c
+    };
+
+    bool cpuSupports(KernelLevel level) {
+        if (level == _kernelScalar)
+            return true;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_cpu_init();
+
+        // Both SIMD levels also use SSE4.2 (CRC-32C), AVX2 F16C (half conversion)
+        if (level == _kernelAVX2)
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c") && __builtin_cpu_supports("sse4.2");
+
+        if (level == _kernelAVX512)
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.2");
+#endif
+
+        return false;
+    }
+
+    const Kernels* selectKernels() {
+        KernelLevel maxLevel = _kernelAVX512;
+
+        const char* env = std::getenv("EOGMANEO_KERNELS");
+
+        if (env != nullptr) {
+            if (std::strcmp(env, "scalar") == 0)
+                maxLevel = _kernelScalar;
+            else if (std::strcmp(env, "avx2") == 0)
+                maxLevel = _kernelAVX2;
+        }
+
+        for (int level = maxLevel; level > _kernelScalar; level--) {
+            const Kernels* pKernels = getKernels(static_cast<KernelLevel>(level));
+
+            if (pKernels != nullptr)
+                return pKernels;
+        }
+
+        return &scalarKernels;
+    }
+
+    std::atomic<const Kernels*> &activeKernels() {
+        static std::atomic<const Kernels*> pActive(selectKernels());
+
+        return pActive;
+    }
+}
+
+uint16_t eogmaneo::floatToHalf(float x) {
+    uint32_t bits;
+
+    std::memcpy(&bits, &x, sizeof(float));
+
+    uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000u);
+
+    uint32_t magnitude = bits & 0x7fffffffu;
+
+    // Infinity and NaN (kept quiet)
+    if (magnitude >= 0x7f800000u)
+        return sign | 0x7c00u | (magnitude > 0x7f800000u ? 0x0200u : 0u);
+
+    // Rounds to 65536 or more
+    if (magnitude >= 0x477ff000u)
+        return sign | 0x7c00u;
+
+    // Normal, rebias the exponent and round the mantissa
+    if (magnitude >= 0x38800000u) {
+        magnitude -= 0x38000000u;
+        magnitude += 0x0fffu + ((magnitude >> 13) & 1u);
+
+        return sign | static_cast<uint16_t>(magnitude >> 13);
+    }
+
+    // Subnormal, in units of 2^-24 (scaling by a power of two is exact)
+    float units = std::fabs(x) * 16777216.0f;
+
+    return sign | static_cast<uint16_t>(std::nearbyint(units));
+}
+
+float eogmaneo::halfToFloat(uint16_t x) {
+    uint32_t sign = static_cast<uint32_t>(x & 0x8000u) << 16;
+    uint32_t exponent = (x >> 10) & 0x1fu;
+    uint32_t mantissa = x & 0x03ffu;
+
+    uint32_t bits;
+
+    if (exponent == 0x1fu)
+        bits = sign | 0x7f800000u | (mantissa << 13);
+    else if (exponent != 0)
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    else {
+        // Zero or subnormal, mantissa * 2^-24 is exact
+        float f = static_cast<float>(mantissa) * (1.0f / 16777216.0f);
+
+        std::memcpy(&bits, &f, sizeof(float));
+
+        bits |= sign;
+    }
+
+    float result;
+
+    std::memcpy(&result, &bits, sizeof(float));
+
+    return result;
+}
+
+const Kernels &eogmaneo::getKernels() {
+    return *activeKernels().load(std::memory_order_relaxed);
+}
+
+const ColumnKernels &eogmaneo::getColumnKernels(const Kernels &kernels, int columnSize) {
+    const ColumnKernels* pColumnKernels = kernels._columnKernels;
+
+    while (pColumnKernels->_columnSize != 0 && pColumnKernels->_columnSize != columnSize)
+        pColumnKernels++;
+
+    return *pColumnKernels;
+}
+
+const Kernels* eogmaneo::getKernels(KernelLevel level) {
+    if (!cpuSupports(level))
+        return nullptr;
+
+    switch (level) {
+    case _kernelScalar:
+        return &scalarKernels;
+    case _kernelAVX2:
+        return getKernelsAVX2();
+    case _kernelAVX512:
+        return getKernelsAVX512();
+    }
+
+    return nullptr;
+}
+
+bool eogmaneo::setKernelLevel(KernelLevel level) {
+    const Kernels* pKernels = getKernels(level);
+
+    if (pKernels == nullptr)
+        return false;
+
+    activeKernels() = pKernels;
+
+    return true;
+}
@@ -0,0 +1,114 @@
+// ----------------------------------------------------------------------------
+//  EOgmaNeo
+//  Copyright(c) 2017-2018 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of EOgmaNeo is licensed to you under the terms described
+//  in the EOGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace eogmaneo {
+    /*!
+    \brief Instruction set a kernel table is written for.
+    */
+    enum KernelLevel {
+        _kernelScalar = 0, // Portable reference version
+        _kernelAVX2 = 1,
+        _kernelAVX512 = 2
+    };
+
+    /*!
+    \brief Kernels accumulating many weight rows into one column of cells, specialized for a column size.
+    With the size known at compile time the accumulators stay in registers across all rows, as independent chains.
+    */
+    struct ColumnKernels {
+        // Column size these are specialized for, 0 for the generic versions taking any n
+        int _columnSize;
+
+        // dst[i] += src[offsets[k] + i * stride] for k = 0 .. count - 1, in that order
+        void (*_accumulateRows)(float* dst, const float* src, const int* offsets, int count, int stride, int n);
+
+        // dst[i] += src[offsets[k] + i * stride] * scales[k] for k = 0 .. count - 1, in that order
+        void (*_accumulateRowsScaled)(float* dst, const float* src, const int* offsets, const float* scales, int count, int stride, int n);
+    };
+
+    /*!
+    \brief Inner loops shared by the layer and the encoders.
+    Every variant produces bit-identical results to the scalar reference (same operation order, no fused multiply-add).
+    */
+    struct Kernels {
+        KernelLevel _level;
+
+        const char* _name;
+
+        // dst[i] += src[i * stride]
+        void (*_accumulate)(float* dst, const float* src, int stride, int n);
+
+        // dst[i] += src[i * stride] * scale
+        void (*_accumulateScaled)(float* dst, const float* src, int stride, float scale, int n);
+
+        // dst[i] -= (x - src[i * stride])^2
+        void (*_accumulateNegSquaredDistance)(float* dst, const float* src, int stride, float x, int n);
+
+        // Index of the first largest element
+        int (*_argMax)(const float* x, int n);
+
+        // deltas[i] = ((i == target ? 1 : 0) - sigmoid(activations[i])) * rate
+        void (*_deltas)(float* deltas, const float* activations, int target, float rate, int n);
+
+        // Specialized column kernels, ended by the generic ones (_columnSize 0)
+        const ColumnKernels* _columnKernels;
+
+        // dst[i] += w(rows[k], i) * scales[k] (just w without scales) for k = 0 .. count - 1, in that order.
+        // Weights are halves, w(r, i) = src[r * rowStride + i]
+        void (*_accumulateRowsHalf)(float* dst, const uint16_t* src, const int* rows, const float* scales, int count, int rowStride, int n);
+
+        // Same with bytes, w(r, i) = src[r * rowStride + i] * steps[i] + bases[i]
+        void (*_accumulateRowsInt8)(float* dst, const int8_t* src, const float* steps, const float* bases, const int* rows, const float* scales, int count, int rowStride, int n);
+
+        // CRC-32C register after adding size bytes to it (no pre or post inversion)
+        uint32_t (*_crc32c)(uint32_t crc, const unsigned char* data, size_t size);
+    };
+
+    //!@{
+    /*!
+    \brief Convert between floats and IEEE half precision floats, rounding to nearest even. Halves convert back exactly, subnormals included.
+    */
+    uint16_t floatToHalf(float x);
+    float halfToFloat(uint16_t x);
+    //!@}
+
+    /*!
+    \brief Get the kernels in use, by default the best ones this CPU supports.
+    The EOGMANEO_KERNELS environment variable (scalar, avx2 or avx512) can lower the initial choice.
+    */
+    const Kernels &getKernels();
+
+    /*!
+    \brief Get the column kernels of a table for a column size, the generic ones if there is no specialization.
+    */
+    const ColumnKernels &getColumnKernels(const Kernels &kernels, int columnSize);
+
+    /*!
+    \brief Get the kernels for a level, nullptr if they were not compiled in or this CPU does not support them.
+    */
+    const Kernels* getKernels(KernelLevel level);
+
+    /*!
+    \brief Switch the kernels in use. Returns false (and changes nothing) if the level is not available.
+    Not thread safe with respect to running steps.
+    */
+    bool setKernelLevel(KernelLevel level);
+
+    //!@{
+    /*!
+    \brief Per instruction set tables, nullptr when the compiler was not given the matching flags.
+    */
+    const Kernels* getKernelsAVX2();
+    const Kernels* getKernelsAVX512();
+    //!@}
+}
@@ -0,0 +1,412 @@
+// ----------------------------------------------------------------------------
+//  EOgmaNeo
+//  Copyright(c) 2017-2018 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of EOgmaNeo is licensed to you under the terms described
+//  in the EOGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Built with AVX2 and F16C enabled (see CMakeLists.txt), only called after a CPU check
+
+#include "Kernels.h"
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+
+using namespace eogmaneo;
+
+namespace {
+    // Offsets of 8 consecutive elements of a strided run
+    __m256i strideOffsets(int stride) {
+        return _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+    }
+
+    __m256 load(const float* src, int stride, __m256i offsets) {
+        return stride == 1 ? _mm256_loadu_ps(src) : _mm256_i32gather_ps(src, offsets, 4);
+    }
+
+    void accumulate(float* dst, const float* src, int stride, int n) {
+        __m256i offsets = strideOffsets(stride);
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+            _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), load(src + static_cast<std::ptrdiff_t>(i) * stride, stride, offsets)));
+
+        for (; i < n; i++)
+            dst[i] += src[i * stride];
+    }
+
+    void accumulateScaled(float* dst, const float* src, int stride, float scale, int n) {
+        __m256i offsets = strideOffsets(stride);
+        __m256 scales = _mm256_set1_ps(scale);
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8) {
+            __m256 products = _mm256_mul_ps(load(src + static_cast<std::ptrdiff_t>(i) * stride, stride, offsets), scales);
+
+            _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), products));
+        }
+
+        for (; i < n; i++)
+            dst[i] += src[i * stride] * scale;
+    }
+
+    void accumulateNegSquaredDistance(float* dst, const float* src, int stride, float x, int n) {
+        __m256i offsets = strideOffsets(stride);
+        __m256 xs = _mm256_set1_ps(x);
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8) {
+            __m256 d = _mm256_sub_ps(xs, load(src + static_cast<std::ptrdiff_t>(i) * stride, stride, offsets));
+
+            _mm256_storeu_ps(dst + i, _mm256_sub_ps(_mm256_loadu_ps(dst + i), _mm256_mul_ps(d, d)));
+        }
+
+        for (; i < n; i++) {
+            float d = x - src[i * stride];
+
+            dst[i] += -d * d;
+        }
+    }
+
+    int argMaxScalar(const float* x, int n) {
+        int maxIndex = 0;
+
+        for (int i = 1; i < n; i++) {
+            if (x[i] > x[maxIndex])
+                maxIndex = i;
+        }
+
+        return maxIndex;
+    }
+
+    int argMax(const float* x, int n) {
+        if (n < 8)
+            return argMaxScalar(x, n);
+
+        __m256 maxValues = _mm256_loadu_ps(x);
+        __m256 unordered = _mm256_cmp_ps(maxValues, maxValues, _CMP_UNORD_Q);
+
+        int i = 8;
+
+        for (; i + 8 <= n; i += 8) {
+            __m256 values = _mm256_loadu_ps(x + i);
+
+            maxValues = _mm256_max_ps(maxValues, values);
+            unordered = _mm256_or_ps(unordered, _mm256_cmp_ps(values, values, _CMP_UNORD_Q));
+        }
+
+        // NaNs order differently in max_ps, leave them to the scalar scan
+        if (_mm256_movemask_ps(unordered) != 0)
+            return argMaxScalar(x, n);
+
+        __m128 m = _mm_max_ps(_mm256_castps256_ps128(maxValues), _mm256_extractf128_ps(maxValues, 1));
+
+        m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+        m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+
+        float maxValue = _mm_cvtss_f32(m);
+
+        for (int j = i; j < n; j++) {
+            if (x[j] != x[j])
+                return argMaxScalar(x, n);
+
+            maxValue = std::max(maxValue, x[j]);
+        }
+
+        // First element equal to the maximum, which is what the scalar scan returns
+        __m256 maxValues8 = _mm256_set1_ps(maxValue);
+
+        for (int j = 0; j + 8 <= i; j += 8) {
+            int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(x + j), maxValues8, _CMP_EQ_OQ));
+
+            if (mask != 0) {
+                int k = 0;
+
+                while ((mask & (1u << k)) == 0)
+                    k++;
+
+                return j + k;
+            }
+        }
+
+        for (int j = i; j < n; j++) {
+            if (x[j] == maxValue)
+                return j;
+        }
+
+        return 0;
+    }
+
+    void deltas(float* deltas, const float* activations, int target, float rate, int n) {
+        __m256 ones = _mm256_set1_ps(1.0f);
+        __m256 rates = _mm256_set1_ps(rate);
+        __m256i targets = _mm256_set1_epi32(target);
+
+        alignas(32) float exps[8];
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8) {
+            // Same expf as the scalar version, so results do not depend on the host
+            for (int j = 0; j < 8; j++)
+                exps[j] = std::exp(-activations[i + j]);
+
+            __m256 s = _mm256_div_ps(ones, _mm256_add_ps(ones, _mm256_load_ps(exps)));
+
+            __m256i indices = _mm256_add_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(i));
+            __m256 t = _mm256_and_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(indices, targets)), ones);
+
+            _mm256_storeu_ps(deltas + i, _mm256_mul_ps(_mm256_sub_ps(t, s), rates));
+        }
+
+        for (; i < n; i++) {
+            float s = 1.0f / (1.0f + std::exp(-activations[i]));
+
+            deltas[i] = ((i == target ? 1.0f : 0.0f) - s) * rate;
+        }
+    }
+
+    // Sum the rows into blocks * 8 consecutive cells, kept in registers until all rows are added
+    template<int blocks>
+    void accumulateRowBlocks(float* dst, const float* src, const int* offsets, int count, int stride, __m256i strided) {
+        __m256 sums[blocks];
+
+        for (int b = 0; b < blocks; b++)
+            sums[b] = _mm256_loadu_ps(dst + b * 8);
+
+        for (int k = 0; k < count; k++) {
+            const float* row = src + offsets[k];
+
+            for (int b = 0; b < blocks; b++)
+                sums[b] = _mm256_add_ps(sums[b], load(row + static_cast<std::ptrdiff_t>(b * 8) * stride, stride, strided));
+        }
+
+        for (int b = 0; b < blocks; b++)
+            _mm256_storeu_ps(dst + b * 8, sums[b]);
+    }
+
+    template<int blocks>
+    void accumulateRowBlocksScaled(float* dst, const float* src, const int* offsets, const float* scales, int count, int stride, __m256i strided) {
+        __m256 sums[blocks];
+
+        for (int b = 0; b < blocks; b++)
+            sums[b] = _mm256_loadu_ps(dst + b * 8);
+
+        for (int k = 0; k < count; k++) {
+            const float* row = src + offsets[k];
+            __m256 scale = _mm256_set1_ps(scales[k]);
+
+            for (int b = 0; b < blocks; b++)
+                sums[b] = _mm256_add_ps(sums[b], _mm256_mul_ps(load(row + static_cast<std::ptrdiff_t>(b * 8) * stride, stride, strided), scale));
+        }
+
+        for (int b = 0; b < blocks; b++)
+            _mm256_storeu_ps(dst + b * 8, sums[b]);
+    }
+
+    // Any n
+    void accumulateRows(float* dst, const float* src, const int* offsets, int count, int stride, int n) {
+        __m256i strided = strideOffsets(stride);
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+            accumulateRowBlocks<1>(dst + i, src + static_cast<std::ptrdiff_t>(i) * stride, offsets, count, stride, strided);
+
+        for (; i < n; i++) {
+            for (int k = 0; k < count; k++)
+                dst[i] += src[offsets[k] + i * stride];
+        }
+    }
+
+    // n fixed to size (a multiple of 8) at compile time
+    template<int size>
+    void accumulateRowsFixed(float* dst, const float* src, const int* offsets, int count, int stride, int) {
+        accumulateRowBlocks<size / 8>(dst, src, offsets, count, stride, strideOffsets(stride));
+    }
+
+    // Any n
+    void accumulateRowsScaled(float* dst, const float* src, const int* offsets, const float* scales, int count, int stride, int n) {
+        __m256i strided = strideOffsets(stride);
+
+        int i = 0;
+
+        for (; i + 8 <= n; i += 8)
+            accumulateRowBlocksScaled<1>(dst + i, src + static_cast<std::ptrdiff_t>(i) * stride, offsets, scales, count, stride, strided);
+
+        for (; i < n; i++) {
+            for (int k = 0; k < count; k++)
+                dst[i] += src[offsets[k] + i * stride] * scales[k];
+        }
+    }
+
+    // n fixed to size (a multiple of 8) at compile time
+    template<int size>
+    void accumulateRowsScaledFixed(float* dst, const float* src, const int* offsets, const float* scales, int count, int stride, int) {
+        accumulateRowBlocksScaled<size / 8>(dst, src, offsets, scales, count, stride, strideOffsets(stride));
+    }
+
+    // Sum the rows of halves into blocks * 8 consecutive cells, kept in registers until all rows are added
+    template<int blocks, bool scaled>
+    void accumulateHalfBlocks(float* dst, const uint16_t* src, const int* rows, const float* scales, int count, int rowStride) {
+        __m256 sums[blocks];
+
+        for (int b = 0; b < blocks; b++)
+            sums[b] = _mm256_loadu_ps(dst + b * 8);
+
+        for (int k = 0; k < count; k++) {
+            const uint16_t* row = src + static_cast<std::ptrdiff_t>(rows[k]) * rowStride;
+
+            for (int b = 0; b < blocks; b++) {
+                __m256 w = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + b * 8)));
+
+                sums[b] = _mm256_add_ps(sums[b], scaled ? _mm256_mul_ps(w, _mm256_set1_ps(scales[k])) : w);
+            }
+        }
+
+        for (int b = 0; b < blocks; b++)
+            _mm256_storeu_ps(dst + b * 8, sums[b]);
+    }
+
+    template<bool scaled>
+    void accumulateRowsHalfScaling(float* dst, const uint16_t* src, const int* rows, const float* scales, int count, int rowStride, int n) {
+        int i = 0;
+
+        for (; i + 32 <= n; i += 32)
+            accumulateHalfBlocks<4, scaled>(dst + i, src + i, rows, scales, count, rowStride);
+
+        for (; i + 8 <= n; i += 8)
+            accumulateHalfBlocks<1, scaled>(dst + i, src + i, rows, scales, count, rowStride);
+
+        for (; i < n; i++) {
+            for (int k = 0; k < count; k++) {
+                float w = halfToFloat(src[static_cast<std::ptrdiff_t>(rows[k]) * rowStride + i]);
+
+                dst[i] += scaled ? w * scales[k] : w;
+            }
+        }
+    }
+
+    void accumulateRowsHalf(float* dst, const uint16_t* src, const int* rows, const float* scales, int count, int rowStride, int n) {
+        if (scales == nullptr)
+            accumulateRowsHalfScaling<false>(dst, src, rows, scales, count, rowStride, n);
+        else
+            accumulateRowsHalfScaling<true>(dst, src, rows, scales, count, rowStride, n);
+    }
+
+    // Same for bytes, the steps and bases of the cells stay in registers too
+    template<int blocks, bool scaled>
+    void accumulateInt8Blocks(float* dst, const int8_t* src, const float* steps, const float* bases, const int* rows, const float* scales, int count, int rowStride) {
+        __m256 sums[blocks];
+        __m256 blockSteps[blocks];
+        __m256 blockBases[blocks];
+
+        for (int b = 0; b < blocks; b++) {
+            sums[b] = _mm256_loadu_ps(dst + b * 8);
+            blockSteps[b] = _mm256_loadu_ps(steps + b * 8);
+            blockBases[b] = _mm256_loadu_ps(bases + b * 8);
+        }
+
+        for (int k = 0; k < count; k++) {
+            const int8_t* row = src + static_cast<std::ptrdiff_t>(rows[k]) * rowStride;
+
+            for (int b = 0; b < blocks; b++) {
+                __m256 w = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(row + b * 8)))), blockSteps[b]), blockBases[b]);
+
+                sums[b] = _mm256_add_ps(sums[b], scaled ? _mm256_mul_ps(w, _mm256_set1_ps(scales[k])) : w);
+            }
+        }
+
+        for (int b = 0; b < blocks; b++)
+            _mm256_storeu_ps(dst + b * 8, sums[b]);
+    }
+
+    template<bool scaled>
+    void accumulateRowsInt8Scaling(float* dst, const int8_t* src, const float* steps, const float* bases, const int* rows, const float* scales, int count, int rowStride, int n) {
+        int i = 0;
+
+        for (; i + 32 <= n; i += 32)
+            accumulateInt8Blocks<4, scaled>(dst + i, src + i, steps + i, bases + i, rows, scales, count, rowStride);
+
+        for (; i + 8 <= n; i += 8)
+            accumulateInt8Blocks<1, scaled>(dst + i, src + i, steps + i, bases + i, rows, scales, count, rowStride);
+
+        for (; i < n; i++) {
+            for (int k = 0; k < count; k++) {
+                float w = static_cast<float>(src[static_cast<std::ptrdiff_t>(rows[k]) * rowStride + i]) * steps[i] + bases[i];
+
+                dst[i] += scaled ? w * scales[k] : w;
+            }
+        }
+    }
+
+    void accumulateRowsInt8(float* dst, const int8_t* src, const float* steps, const float* bases, const int* rows, const float* scales, int count, int rowStride, int n) {
+        if (scales == nullptr)
+            accumulateRowsInt8Scaling<false>(dst, src, steps, bases, rows, scales, count, rowStride, n);
+        else
+            accumulateRowsInt8Scaling<true>(dst, src, steps, bases, rows, scales, count, rowStride, n);
+    }
+
+    const ColumnKernels avx2ColumnKernels[] = {
+        { 16, accumulateRowsFixed<16>, accumulateRowsScaledFixed<16> },
+        { 32, accumulateRowsFixed<32>, accumulateRowsScaledFixed<32> },
+        { 64, accumulateRowsFixed<64>, accumulateRowsScaledFixed<64> },
+        { 0, accumulateRows, accumulateRowsScaled }
+    };
+
+    // SSE4.2 crc32 instruction, which computes CRC-32C
+    uint32_t crc32c(uint32_t crc, const unsigned char* data, size_t size) {
+        uint64_t crc64 = crc;
+
+        for (; size >= 8; size -= 8, data += 8) {
+            uint64_t word;
+
+            std::memcpy(&word, data, 8);
+
+            crc64 = _mm_crc32_u64(crc64, word);
+        }
+
+        crc = static_cast<uint32_t>(crc64);
+
+        for (; size > 0; size--, data++)
+            crc = _mm_crc32_u8(crc, *data);
+
+        return crc;
+    }
+
+    const Kernels avx2Kernels = {
+        _kernelAVX2,
+        "avx2",
+        accumulate,
+        accumulateScaled,
+        accumulateNegSquaredDistance,
+        argMax,
+        deltas,
+        avx2ColumnKernels,
+        accumulateRowsHalf,
+        accumulateRowsInt8,
+        crc32c
+    };
+}
+
+const Kernels* eogmaneo::getKernelsAVX2() {
+    return &avx2Kernels;
+}
+
+#else
+
+const eogmaneo::Kernels* eogmaneo::getKernelsAVX2() {
+    return nullptr;
+}
+
+#endif
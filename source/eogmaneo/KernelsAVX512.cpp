@@ -0,0 +1,407 @@
+// ----------------------------------------------------------------------------
+//  EOgmaNeo
+//  Copyright(c) 2017-2018 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of EOgmaNeo is licensed to you under the terms described
+//  in the EOGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Built with AVX-512F enabled (see CMakeLists.txt), only called after a CPU check
+
+#include "Kernels.h"
+
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+
+using namespace eogmaneo;
+
+namespace {
+    // Offsets of 16 consecutive elements of a strided run
+    __m512i strideOffsets(int stride) {
+        return _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(stride));
+    }
+
+    __m512 load(const float* src, int stride, __m512i offsets) {
+        return stride == 1 ? _mm512_loadu_ps(src) : _mm512_i32gather_ps(offsets, src, 4);
+    }
+
+    void accumulate(float* dst, const float* src, int stride, int n) {
+        __m512i offsets = strideOffsets(stride);
+
+        int i = 0;
+
+        for (; i + 16 <= n; i += 16)
+            _mm512_storeu_ps(dst + i, _mm512_add_ps(_mm512_loadu_ps(dst + i), load(src + static_cast<std::ptrdiff_t>(i) * stride, stride, offsets)));
+
+        for (; i < n; i++)
+            dst[i] += src[i * stride];
+    }
+
+    void accumulateScaled(float* dst, const float* src, int stride, float scale, int n) {
+        __m512i offsets = strideOffsets(stride);
+        __m512 scales = _mm512_set1_ps(scale);
+
+        int i = 0;
+
+        for (; i + 16 <= n; i += 16) {
+            __m512 products = _mm512_mul_ps(load(src + static_cast<std::ptrdiff_t>(i) * stride, stride, offsets), scales);
+
+            _mm512_storeu_ps(dst + i, _mm512_add_ps(_mm512_loadu_ps(dst + i), products));
+        }
+
+        for (; i < n; i++)
+            dst[i] += src[i * stride] * scale;
+    }
+
+    void accumulateNegSquaredDistance(float* dst, const float* src, int stride, float x, int n) {
+        __m512i offsets = strideOffsets(stride);
+        __m512 xs = _mm512_set1_ps(x);
+
+        int i = 0;
+
+        for (; i + 16 <= n; i += 16) {
+            __m512 d = _mm512_sub_ps(xs, load(src + static_cast<std::ptrdiff_t>(i) * stride, stride, offsets));
+
+            _mm512_storeu_ps(dst + i, _mm512_sub_ps(_mm512_loadu_ps(dst + i), _mm512_mul_ps(d, d)));
+        }
+
+        for (; i < n; i++) {
+            float d = x - src[i * stride];
+
+            dst[i] += -d * d;
+        }
+    }
+
+    int argMaxScalar(const float* x, int n) {
+        int maxIndex = 0;
+
+        for (int i = 1; i < n; i++) {
+            if (x[i] > x[maxIndex])
+                maxIndex = i;
+        }
+
+        return maxIndex;
+    }
+
+    int argMax(const float* x, int n) {
+        if (n < 16)
+            return argMaxScalar(x, n);
+
+        __m512 maxValues = _mm512_loadu_ps(x);
+        __mmask16 unordered = _mm512_cmp_ps_mask(maxValues, maxValues, _CMP_UNORD_Q);
+
+        int i = 16;
+
+        for (; i + 16 <= n; i += 16) {
+            __m512 values = _mm512_loadu_ps(x + i);
+
+            maxValues = _mm512_max_ps(maxValues, values);
+            unordered |= _mm512_cmp_ps_mask(values, values, _CMP_UNORD_Q);
+        }
+
+        // NaNs order differently in max_ps, leave them to the scalar scan
+        if (unordered != 0)
+            return argMaxScalar(x, n);
+
+        float maxValue = _mm512_reduce_max_ps(maxValues);
+
+        for (int j = i; j < n; j++) {
+            if (x[j] != x[j])
+                return argMaxScalar(x, n);
+
+            maxValue = std::max(maxValue, x[j]);
+        }
+
+        // First element equal to the maximum, which is what the scalar scan returns
+        __m512 maxValues16 = _mm512_set1_ps(maxValue);
+
+        for (int j = 0; j + 16 <= i; j += 16) {
+            unsigned int mask = _mm512_cmp_ps_mask(_mm512_loadu_ps(x + j), maxValues16, _CMP_EQ_OQ);
+
+            if (mask != 0) {
+                int k = 0;
+
+                while ((mask & (1u << k)) == 0)
+                    k++;
+
+                return j + k;
+            }
+        }
+
+        for (int j = i; j < n; j++) {
+            if (x[j] == maxValue)
+                return j;
+        }
+
+        return 0;
+    }
+
+    void deltas(float* deltas, const float* activations, int target, float rate, int n) {
+        __m512 ones = _mm512_set1_ps(1.0f);
+        __m512 rates = _mm512_set1_ps(rate);
+        __m512i targets = _mm512_set1_epi32(target);
+
+        alignas(64) float exps[16];
+
+        int i = 0;
+
+        for (; i + 16 <= n; i += 16) {
+            // Same expf as the scalar version, so results do not depend on the host
+            for (int j = 0; j < 16; j++)
+                exps[j] = std::exp(-activations[i + j]);
+
+            __m512 s = _mm512_div_ps(ones, _mm512_add_ps(ones, _mm512_load_ps(exps)));
+
+            __m512i indices = _mm512_add_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(i));
+            __m512 t = _mm512_maskz_mov_ps(_mm512_cmpeq_epi32_mask(indices, targets), ones);
+
+            _mm512_storeu_ps(deltas + i, _mm512_mul_ps(_mm512_sub_ps(t, s), rates));
+        }
+
+        for (; i < n; i++) {
+            float s = 1.0f / (1.0f + std::exp(-activations[i]));
+
+            deltas[i] = ((i == target ? 1.0f : 0.0f) - s) * rate;
+        }
+    }
+
+    // Sum the rows into blocks * 16 consecutive cells, kept in registers until all rows are added
+    template<int blocks>
+    void accumulateRowBlocks(float* dst, const float* src, const int* offsets, int count, int stride, __m512i strided) {
+        __m512 sums[blocks];
+
+        for (int b = 0; b < blocks; b++)
+            sums[b] = _mm512_loadu_ps(dst + b * 16);
+
+        for (int k = 0; k < count; k++) {
+            const float* row = src + offsets[k];
+
+            for (int b = 0; b < blocks; b++)
+                sums[b] = _mm512_add_ps(sums[b], load(row + static_cast<std::ptrdiff_t>(b * 16) * stride, stride, strided));
+        }
+
+        for (int b = 0; b < blocks; b++)
+            _mm512_storeu_ps(dst + b * 16, sums[b]);
+    }
+
+    template<int blocks>
+    void accumulateRowBlocksScaled(float* dst, const float* src, const int* offsets, const float* scales, int count, int stride, __m512i strided) {
+        __m512 sums[blocks];
+
+        for (int b = 0; b < blocks; b++)
+            sums[b] = _mm512_loadu_ps(dst + b * 16);
+
+        for (int k = 0; k < count; k++) {
+            const float* row = src + offsets[k];
+            __m512 scale = _mm512_set1_ps(scales[k]);
+
+            for (int b = 0; b < blocks; b++)
+                sums[b] = _mm512_add_ps(sums[b], _mm512_mul_ps(load(row + static_cast<std::ptrdiff_t>(b * 16) * stride, stride, strided), scale));
+        }
+
+        for (int b = 0; b < blocks; b++)
+            _mm512_storeu_ps(dst + b * 16, sums[b]);
+    }
+
+    // Any n
+    void accumulateRows(float* dst, const float* src, const int* offsets, int count, int stride, int n) {
+        __m512i strided = strideOffsets(stride);
+
+        int i = 0;
+
+        for (; i + 16 <= n; i += 16)
+            accumulateRowBlocks<1>(dst + i, src + static_cast<std::ptrdiff_t>(i) * stride, offsets, count, stride, strided);
+
+        for (; i < n; i++) {
+            for (int k = 0; k < count; k++)
+                dst[i] += src[offsets[k] + i * stride];
+        }
+    }
+
+    // n fixed to size (a multiple of 16) at compile time
+    template<int size>
+    void accumulateRowsFixed(float* dst, const float* src, const int* offsets, int count, int stride, int) {
+        accumulateRowBlocks<size / 16>(dst, src, offsets, count, stride, strideOffsets(stride));
+    }
+
+    // Any n
+    void accumulateRowsScaled(float* dst, const float* src, const int* offsets, const float* scales, int count, int stride, int n) {
+        __m512i strided = strideOffsets(stride);
+
+        int i = 0;
+
+        for (; i + 16 <= n; i += 16)
+            accumulateRowBlocksScaled<1>(dst + i, src + static_cast<std::ptrdiff_t>(i) * stride, offsets, scales, count, stride, strided);
+
+        for (; i < n; i++) {
+            for (int k = 0; k < count; k++)
+                dst[i] += src[offsets[k] + i * stride] * scales[k];
+        }
+    }
+
+    // n fixed to size (a multiple of 16) at compile time
+    template<int size>
+    void accumulateRowsScaledFixed(float* dst, const float* src, const int* offsets, const float* scales, int count, int stride, int) {
+        accumulateRowBlocksScaled<size / 16>(dst, src, offsets, scales, count, stride, strideOffsets(stride));
+    }
+
+    // Sum the rows of halves into blocks * 16 consecutive cells, kept in registers until all rows are added
+    template<int blocks, bool scaled>
+    void accumulateHalfBlocks(float* dst, const uint16_t* src, const int* rows, const float* scales, int count, int rowStride) {
+        __m512 sums[blocks];
+
+        for (int b = 0; b < blocks; b++)
+            sums[b] = _mm512_loadu_ps(dst + b * 16);
+
+        for (int k = 0; k < count; k++) {
+            const uint16_t* row = src + static_cast<std::ptrdiff_t>(rows[k]) * rowStride;
+
+            for (int b = 0; b < blocks; b++) {
+                __m512 w = _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + b * 16)));
+
+                sums[b] = _mm512_add_ps(sums[b], scaled ? _mm512_mul_ps(w, _mm512_set1_ps(scales[k])) : w);
+            }
+        }
+
+        for (int b = 0; b < blocks; b++)
+            _mm512_storeu_ps(dst + b * 16, sums[b]);
+    }
+
+    template<bool scaled>
+    void accumulateRowsHalfScaling(float* dst, const uint16_t* src, const int* rows, const float* scales, int count, int rowStride, int n) {
+        int i = 0;
+
+        for (; i + 64 <= n; i += 64)
+            accumulateHalfBlocks<4, scaled>(dst + i, src + i, rows, scales, count, rowStride);
+
+        for (; i + 16 <= n; i += 16)
+            accumulateHalfBlocks<1, scaled>(dst + i, src + i, rows, scales, count, rowStride);
+
+        for (; i < n; i++) {
+            for (int k = 0; k < count; k++) {
+                float w = halfToFloat(src[static_cast<std::ptrdiff_t>(rows[k]) * rowStride + i]);
+
+                dst[i] += scaled ? w * scales[k] : w;
+            }
+        }
+    }
+
+    void accumulateRowsHalf(float* dst, const uint16_t* src, const int* rows, const float* scales, int count, int rowStride, int n) {
+        if (scales == nullptr)
+            accumulateRowsHalfScaling<false>(dst, src, rows, scales, count, rowStride, n);
+        else
+            accumulateRowsHalfScaling<true>(dst, src, rows, scales, count, rowStride, n);
+    }
+
+    // Same for bytes, the steps and bases of the cells stay in registers too
+    template<int blocks, bool scaled>
+    void accumulateInt8Blocks(float* dst, const int8_t* src, const float* steps, const float* bases, const int* rows, const float* scales, int count, int rowStride) {
+        __m512 sums[blocks];
+        __m512 blockSteps[blocks];
+        __m512 blockBases[blocks];
+
+        for (int b = 0; b < blocks; b++) {
+            sums[b] = _mm512_loadu_ps(dst + b * 16);
+            blockSteps[b] = _mm512_loadu_ps(steps + b * 16);
+            blockBases[b] = _mm512_loadu_ps(bases + b * 16);
+        }
+
+        for (int k = 0; k < count; k++) {
+            const int8_t* row = src + static_cast<std::ptrdiff_t>(rows[k]) * rowStride;
+
+            for (int b = 0; b < blocks; b++) {
+                __m512 w = _mm512_add_ps(_mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + b * 16)))), blockSteps[b]), blockBases[b]);
+
+                sums[b] = _mm512_add_ps(sums[b], scaled ? _mm512_mul_ps(w, _mm512_set1_ps(scales[k])) : w);
+            }
+        }
+
+        for (int b = 0; b < blocks; b++)
+            _mm512_storeu_ps(dst + b * 16, sums[b]);
+    }
+
+    template<bool scaled>
+    void accumulateRowsInt8Scaling(float* dst, const int8_t* src, const float* steps, const float* bases, const int* rows, const float* scales, int count, int rowStride, int n) {
+        int i = 0;
+
+        for (; i + 64 <= n; i += 64)
+            accumulateInt8Blocks<4, scaled>(dst + i, src + i, steps + i, bases + i, rows, scales, count, rowStride);
+
+        for (; i + 16 <= n; i += 16)
+            accumulateInt8Blocks<1, scaled>(dst + i, src + i, steps + i, bases + i, rows, scales, count, rowStride);
+
+        for (; i < n; i++) {
+            for (int k = 0; k < count; k++) {
+                float w = static_cast<float>(src[static_cast<std::ptrdiff_t>(rows[k]) * rowStride + i]) * steps[i] + bases[i];
+
+                dst[i] += scaled ? w * scales[k] : w;
+            }
+        }
+    }
+
+    void accumulateRowsInt8(float* dst, const int8_t* src, const float* steps, const float* bases, const int* rows, const float* scales, int count, int rowStride, int n) {
+        if (scales == nullptr)
+            accumulateRowsInt8Scaling<false>(dst, src, steps, bases, rows, scales, count, rowStride, n);
+        else
+            accumulateRowsInt8Scaling<true>(dst, src, steps, bases, rows, scales, count, rowStride, n);
+    }
+
+    // 16 cells are a single block in the generic versions already
+    const ColumnKernels avx512ColumnKernels[] = {
+        { 32, accumulateRowsFixed<32>, accumulateRowsScaledFixed<32> },
+        { 64, accumulateRowsFixed<64>, accumulateRowsScaledFixed<64> },
+        { 0, accumulateRows, accumulateRowsScaled }
+    };
+
+    // SSE4.2 crc32 instruction, which computes CRC-32C
+    uint32_t crc32c(uint32_t crc, const unsigned char* data, size_t size) {
+        uint64_t crc64 = crc;
+
+        for (; size >= 8; size -= 8, data += 8) {
+            uint64_t word;
+
+            std::memcpy(&word, data, 8);
+
+            crc64 = _mm_crc32_u64(crc64, word);
+        }
+
+        crc = static_cast<uint32_t>(crc64);
+
+        for (; size > 0; size--, data++)
+            crc = _mm_crc32_u8(crc, *data);
+
+        return crc;
+    }
+
+    const Kernels avx512Kernels = {
+        _kernelAVX512,
+        "avx512",
+        accumulate,
+        accumulateScaled,
+        accumulateNegSquaredDistance,
+        argMax,
+        deltas,
+        avx512ColumnKernels,
+        accumulateRowsHalf,
+        accumulateRowsInt8,
+        crc32c
+    };
+}
+
+const Kernels* eogmaneo::getKernelsAVX512() {
+    return &avx512Kernels;
+}
+
+#else
+
+const eogmaneo::Kernels* eogmaneo::getKernelsAVX512() {
+    return nullptr;
+}
+
+#endif
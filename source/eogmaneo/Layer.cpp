@@ -8,7 +8,11 @@
 
 #include "Layer.h"
 
+#include "Kernels.h"
+#include "Random.h"
+
 #include <algorithm>
+#include <cstring>
 #include <thread>
 #include <future>
 #include <iostream>
@@ -21,557 +25,1587 @@ float eogmaneo::sigmoid(float x) {
     return 1.0f / (1.0f + std::exp(-x));
 }
 
-void LayerForwardWorkItem::run(size_t threadIndex) {
-	_pLayer->columnForward(_ci);
-}
+bool eogmaneo::streamHolds(std::istream &is, std::initializer_list<uint64_t> dims) {
+    std::streampos pos = is.tellg();
 
-void LayerBackwardWorkItem::run(size_t threadIndex) {
-	_pLayer->columnBackward(_ci, _v);
-}
+    if (!is.seekg(0, std::ios::end))
+        return false;
 
-void Layer::columnForward(int ci) {
-    int hiddenColumnX = ci % _hiddenWidth;
-    int hiddenColumnY = ci / _hiddenWidth;
+    std::streamoff remaining = is.tellg() - pos;
 
-    int hiddenStatePrev = _hiddenStatesPrev[ci];
+    is.seekg(pos);
 
-    int hiddenCellIndexPrev = ci + hiddenStatePrev * _hiddenWidth * _hiddenHeight;
+    // Divided down rather than multiplied up, so no product overflows
+    uint64_t left = remaining > 0 ? static_cast<uint64_t>(remaining) : 0;
 
-    std::vector<float> columnActivations(_columnSize, 0.0f);
+    for (uint64_t dim : dims) {
+        if (dim == 0)
+            return true;
 
-    // Activate feed forward
-    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
-        float toInputX = static_cast<float>(_visibleLayerDescs[v]._width) / static_cast<float>(_hiddenWidth);
-        float toInputY = static_cast<float>(_visibleLayerDescs[v]._height) / static_cast<float>(_hiddenHeight);
+        left /= dim;
+    }
 
-        int visibleCenterX = hiddenColumnX * toInputX + 0.5f;
-        int visibleCenterY = hiddenColumnY * toInputY + 0.5f;
+    return left >= 1;
+}
 
-        int forwardRadius = _visibleLayerDescs[v]._forwardRadius;
+namespace {
+    // Weight streams of Layer::create, part of the Philox counter
+    enum InitStream {
+        _initFeedForward = 0, _initFeedBack = 1
+    };
 
-        int forwardDiam = forwardRadius * 2 + 1;
+    // Set count weights (stride apart) to base + uniform(-0.001, 0.001), from the stream of a row of a visible layer
+    void initWeightRow(float* weights, int count, int stride, float base, const uint32_t key[2], InitStream stream, int v, int row) {
+        uint32_t counter[4] = { 0, static_cast<uint32_t>(row), static_cast<uint32_t>(v), static_cast<uint32_t>(stream) };
+        uint32_t random[4];
 
-        int forwardSize = forwardDiam * forwardDiam;
+        for (int j = 0; j < count; j++) {
+            // Four weights per counter value
+            if (j % 4 == 0) {
+                counter[0] = static_cast<uint32_t>(j / 4);
 
-        int lowerVisibleX = visibleCenterX - forwardRadius;
-        int lowerVisibleY = visibleCenterY - forwardRadius;
+                philox4x32(counter, key, random);
+            }
 
-        for (int dcx = -forwardRadius; dcx <= forwardRadius; dcx++)
-            for (int dcy = -forwardRadius; dcy <= forwardRadius; dcy++) {
-                int cx = visibleCenterX + dcx;
-                int cy = visibleCenterY + dcy;
+            weights[j * stride] = base + (uniformFloat(random[j % 4]) * 2.0f - 1.0f) * 0.001f;
+        }
+    }
 
-                if (cx >= 0 && cx < _visibleLayerDescs[v]._width && cy >= 0 && cy < _visibleLayerDescs[v]._height) {
-                    int visibleColumnIndex = cx + cy * _visibleLayerDescs[v]._width;
+    // Exact comparison for the incremental caches, tells -0 from 0 and matches NaNs
+    bool sameBits(float a, float b) {
+        return std::memcmp(&a, &b, sizeof(float)) == 0;
+    }
 
-                    int inputIndex = _inputs[v][visibleColumnIndex];
-                    int inputIndexPrev = _inputsPrev[v][visibleColumnIndex];
+    // Load a weight section into a matrix of numRows rows of rowSize, in place when the file is mapped, else once the reader runs its requests
+    bool readWeights(ModelReader &reader, uint32_t type, int l, int v, int numRows, int rowSize, WeightMatrix &weights) {
+        if (reader.getMapping() != nullptr && hostIsLittleEndian()) {
+            size_t size;
 
-                    if (_codeIter == 0 && _learn && !_reconsActLearn.empty()) {
-                        // Input cells
-                        for (int c = 0; c < _visibleLayerDescs[v]._columnSize; c++) {
-                            int wi = (cx - lowerVisibleX) + (cy - lowerVisibleY) * forwardDiam + c * forwardSize;
+            const char* section = reader.getSection(type, l, v, size);
 
-                            int visibleCellIndex = visibleColumnIndex + c * _visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height;
+            return section != nullptr && weights.createView(reinterpret_cast<const float*>(section), size, numRows, rowSize);
+        }
 
-                            float recon = _reconsActLearn[v][visibleCellIndex] / std::max(1.0f, _reconCountsActLearn[v][visibleCellIndex]);
+        weights.create(numRows, rowSize);
 
-                            float target = c == inputIndexPrev ? 1.0f : 0.0f;
+        return reader.requestFloatSection(type, l, v, weights.getRow(0), weights.getMemorySize() / sizeof(float));
+    }
 
-                            _feedForwardWeights[v][hiddenCellIndexPrev][wi] = std::max(0.0f, _feedForwardWeights[v][hiddenCellIndexPrev][wi] + _alpha * std::min(0.0f, target - recon));
-                        }
-                    }
+    // Append the dirty rows of a matrix as a delta section (see ModelSectionType), a flag per rowsPerFlag rows
+    void putDirtyRows(ModelBuffer &buffer, const WeightMatrix &weights, const std::vector<char> &dirty, int rowsPerFlag) {
+        std::vector<std::pair<int, int>> runs;
 
-                    // Output cells
-                    if (_codeIter == 0) {
-                        int wi = (cx - lowerVisibleX) + (cy - lowerVisibleY) * forwardDiam + inputIndex * forwardSize;
+        for (int i = 0; i < dirty.size(); i++) {
+            if (!dirty[i])
+                continue;
 
-                        for (int c = 0; c < _columnSize; c++) {
-                            int hiddenCellIndex = ci + c * _hiddenWidth * _hiddenHeight;
-                            
-                            columnActivations[c] += _feedForwardWeights[v][hiddenCellIndex][wi];
-                        }
-                    }
-                    else {
-                        int wi = (cx - lowerVisibleX) + (cy - lowerVisibleY) * forwardDiam + inputIndex * forwardSize;
+            if (!runs.empty() && runs.back().first + runs.back().second == i * rowsPerFlag)
+                runs.back().second += rowsPerFlag;
+            else
+                runs.push_back(std::make_pair(i * rowsPerFlag, rowsPerFlag));
+        }
 
-                        int visibleCellIndex = visibleColumnIndex + inputIndex * _visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height;
+        buffer.putInt(weights.getRowStride() * sizeof(float));
+        buffer.putInt(runs.size());
 
-                        float recon = _reconsActLearn[v][visibleCellIndex] / std::max(1.0f, _reconCountsActLearn[v][visibleCellIndex]);
+        for (int r = 0; r < runs.size(); r++) {
+            buffer.putInt(runs[r].first);
+            buffer.putInt(runs[r].second);
+        }
 
-                        for (int c = 0; c < _columnSize; c++) {
-                            int hiddenCellIndex = ci + c * _hiddenWidth * _hiddenHeight;
-                            
-                            columnActivations[c] += _feedForwardWeights[v][hiddenCellIndex][wi] * std::max(0.0f, 1.0f - recon);
-                        }
-                    }
-                }
-            }
+        for (int r = 0; r < runs.size(); r++)
+            buffer.putFloats(weights.getRow(runs[r].first), static_cast<size_t>(runs[r].second) * weights.getRowStride());
     }
+}
 
-	// Find max element
-	int maxCellIndex = 0;
-    float maxValue = -99999.0f;
+bool Layer::columnLearn(int ci) {
+    int hiddenColumnX = ci % _hiddenWidth;
+    int hiddenColumnY = ci / _hiddenWidth;
+
+    int hiddenStatePrev = _hiddenStatesPrev[ci];
 
-	for (int c = 0; c < _columnSize; c++) {
-        int hiddenCellIndex = ci + c * _hiddenWidth * _hiddenHeight;
+    bool weightsChanged = false;
 
-        if (_codeIter == 0)
-            _hiddenActivations[hiddenCellIndex] = columnActivations[c];
-        else
-            _hiddenActivations[hiddenCellIndex] += columnActivations[c];
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        bool rowChanged = false;
 
-		if (_hiddenActivations[hiddenCellIndex] > maxValue) {
-            maxValue = _hiddenActivations[hiddenCellIndex];
-			maxCellIndex = c;
-        }
-	}
+        // Clipped forward field
+        const FieldRange &rangeX = _forwardRangesX[v][hiddenColumnX];
+        const FieldRange &rangeY = _forwardRangesY[v][hiddenColumnY];
 
-    _hiddenStates[ci] = maxCellIndex;
+        int forwardDiam = _visibleLayerDescs[v]._forwardRadius * 2 + 1;
 
-    int hiddenCellIndex = ci + maxCellIndex * _hiddenWidth * _hiddenHeight;
+        int forwardSize = forwardDiam * forwardDiam;
 
-    // Reconstruct
-    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
-        float toInputX = static_cast<float>(_visibleLayerDescs[v]._width) / static_cast<float>(_hiddenWidth);
-        float toInputY = static_cast<float>(_visibleLayerDescs[v]._height) / static_cast<float>(_hiddenHeight);
+        int lowerVisibleX = rangeX._origin;
+        int lowerVisibleY = rangeY._origin;
 
-        int visibleCenterX = hiddenColumnX * toInputX + 0.5f;
-        int visibleCenterY = hiddenColumnY * toInputY + 0.5f;
+        float* columnWeights = getForwardColumn(v, ci);
 
-        int forwardRadius = _visibleLayerDescs[v]._forwardRadius;
+        const int* inputsPrev = getInputViewPrev(v);
 
-        int forwardDiam = forwardRadius * 2 + 1;
+        const std::vector<float> &recons = _recons[(_reconIters - 1) * _visibleLayerDescs.size() + v];
 
-        int forwardSize = forwardDiam * forwardDiam;
+        int cellStride = getForwardCellStride(v);
+        int weightStride = getForwardWeightStride();
 
-        int lowerVisibleX = visibleCenterX - forwardRadius;
-        int lowerVisibleY = visibleCenterY - forwardRadius;
+        for (int cx = rangeX._lower; cx <= rangeX._upper; cx++)
+            for (int cy = rangeY._lower; cy <= rangeY._upper; cy++) {
+                int visibleColumnIndex = cx + cy * _visibleLayerDescs[v]._width;
 
-        for (int dcx = -forwardRadius; dcx <= forwardRadius; dcx++)
-            for (int dcy = -forwardRadius; dcy <= forwardRadius; dcy++) {
-                int cx = visibleCenterX + dcx;
-                int cy = visibleCenterY + dcy;
+                int inputIndexPrev = inputsPrev[visibleColumnIndex];
 
-                if (cx >= 0 && cx < _visibleLayerDescs[v]._width && cy >= 0 && cy < _visibleLayerDescs[v]._height) {
-                    int visibleColumnIndex = cx + cy * _visibleLayerDescs[v]._width;
+                // Nothing to learn from a missing input
+                if (inputIndexPrev == _noInput)
+                    continue;
 
-                    // Input cells
-                    for (int c = 0; c < _visibleLayerDescs[v]._columnSize; c++) {
-                        int wi = (cx - lowerVisibleX) + (cy - lowerVisibleY) * forwardDiam + c * forwardSize;
+                // Input cells
+                for (int c = 0; c < _visibleLayerDescs[v]._columnSize; c++) {
+                    int wi = (cx - lowerVisibleX) + (cy - lowerVisibleY) * forwardDiam + c * forwardSize;
 
-                        int visibleCellIndex = visibleColumnIndex + c * _visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height;
+                    int visibleCellIndex = visibleColumnIndex + c * _visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height;
 
-                        _recons[v][visibleCellIndex] += _feedForwardWeights[v][hiddenCellIndex][wi];
-                        _reconCounts[v][visibleCellIndex] += 1.0f;
-                    }
+                    float recon = recons[visibleCellIndex] / std::max(1.0f, _reconCounts[v][visibleColumnIndex]);
+
+                    float target = c == inputIndexPrev ? 1.0f : 0.0f;
+
+                    float &weight = columnWeights[hiddenStatePrev * cellStride + wi * weightStride];
+
+                    float weightNew = std::max(0.0f, weight + _alpha * std::min(0.0f, target - recon));
+
+                    if (!sameBits(weightNew, weight))
+                        rowChanged = true;
+
+                    weight = weightNew;
                 }
             }
+
+        if (rowChanged) {
+            _forwardRowsDirty[v][_weightLayout == _hiddenCellMajor ? ci * _columnSize + hiddenStatePrev : ci] = true;
+
+            weightsChanged = true;
+        }
     }
+
+    return weightsChanged;
 }
 
-void Layer::columnBackward(int ci, int v) {
-    int visibleWidth = _visibleLayerDescs[v]._width;
-    int visibleHeight = _visibleLayerDescs[v]._height;
+bool Layer::columnFieldChanged(int ci, const std::vector<std::vector<char>> &changed) const {
+    int hiddenColumnX = ci % _hiddenWidth;
+    int hiddenColumnY = ci / _hiddenWidth;
 
-    int visibleColumnX = ci % visibleWidth;
-    int visibleColumnY = ci / visibleWidth;
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        const FieldRange &rangeX = _forwardRangesX[v][hiddenColumnX];
+        const FieldRange &rangeY = _forwardRangesY[v][hiddenColumnY];
 
-    int visibleColumnSize = _visibleLayerDescs[v]._columnSize;
+        for (int cy = rangeY._lower; cy <= rangeY._upper; cy++)
+            for (int cx = rangeX._lower; cx <= rangeX._upper; cx++) {
+                if (changed[v][cx + cy * _visibleLayerDescs[v]._width])
+                    return true;
+            }
+    }
 
-    // Extract input views
-    std::vector<float> columnActivations(visibleColumnSize, 0.0f);
-    std::vector<float> columnActivationsPrev(visibleColumnSize, 0.0f);
+    return false;
+}
 
-    int backwardRadius = _visibleLayerDescs[v]._backwardRadius;
+void Layer::columnPackWinner(int ci) {
+    // Pack the winner's strided weights, so reconstruction reads them contiguously
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        float* winnerWeights = _winnerWeights[v].getRow(ci);
 
-    int backwardDiam = backwardRadius * 2 + 1;
-    int backwardSize = backwardDiam * backwardDiam;
-    int backwardVecSize = backwardSize * _columnSize;
+        if (isFrozen()) {
+            for (int j = 0; j < _winnerWeights[v].getRowSize(); j++)
+                winnerWeights[j] = _quantizedForwardWeights[v].get(ci, j, _hiddenStates[ci]);
 
-    float toInputX = static_cast<float>(_hiddenWidth) / static_cast<float>(visibleWidth);
-    float toInputY = static_cast<float>(_hiddenHeight) / static_cast<float>(visibleHeight);
+            continue;
+        }
 
-    int hiddenCenterX = visibleColumnX * toInputX + 0.5f;
-    int hiddenCenterY = visibleColumnY * toInputY + 0.5f;
+        const float* weights = getForwardColumn(v, ci) + _hiddenStates[ci];
 
-    int lowerHiddenX = hiddenCenterX - backwardRadius;
-    int lowerHiddenY = hiddenCenterY - backwardRadius;
+        for (int j = 0; j < _winnerWeights[v].getRowSize(); j++)
+            winnerWeights[j] = weights[j * _columnSize];
+    }
+}
 
-    for (int dcx = -backwardRadius; dcx <= backwardRadius; dcx++)
-        for (int dcy = -backwardRadius; dcy <= backwardRadius; dcy++) {
-            int cx = hiddenCenterX + dcx;
-            int cy = hiddenCenterY + dcy;
+void Layer::columnForward(int ci, float* scratch, int* indexScratch) {
+    int hiddenColumnX = ci % _hiddenWidth;
+    int hiddenColumnY = ci / _hiddenWidth;
 
-            if (cx >= 0 && cx < _hiddenWidth && cy >= 0 && cy < _hiddenHeight) {
-                int hiddenColumnIndex = cx + cy * _hiddenWidth;
+    int numHiddenColumns = _hiddenWidth * _hiddenHeight;
 
-                if (!_feedBack.empty() && !_feedBackPrev.empty()) {
-                    int feedBackIndex = _feedBack[hiddenColumnIndex];
-                    int feedBackIndexPrev = _feedBackPrev[hiddenColumnIndex];
+    // Whether the caches of the last pass can stand in for results whose inputs did not change
+    bool reuse = _incremental && _incrementalValid;
 
-                    // Output cells
-                    int wiCur = (cx - lowerHiddenX) + (cy - lowerHiddenY) * backwardDiam + feedBackIndex * backwardSize;
-                    int wiPrev = (cx - lowerHiddenX) + (cy - lowerHiddenY) * backwardDiam + feedBackIndexPrev * backwardSize;
+    if (_codeIter == 0) {
+        // Learning always runs (its inputs change nearly every step), weights it changes invalidate the cached results
+        bool weightsChanged = _learn && _reconIters > 0 && columnLearn(ci);
 
-                    for (int c = 0; c < visibleColumnSize; c++) {
-                        int visibleCellIndex = ci + c * visibleWidth * visibleHeight;
-                            
-                        columnActivations[c] += _feedBackWeights[v][visibleCellIndex][wiCur];
-                        columnActivationsPrev[c] += _feedBackWeights[v][visibleCellIndex][wiPrev];
-                    }
-                }
+        if (_incremental)
+            _columnsDirty[ci] = (weightsChanged ? _columnWeightsChanged : 0) | (!reuse || columnFieldChanged(ci, _inputsChanged) ? _columnFieldChanged : 0);
+    }
 
-                int hiddenIndex = _hiddenStates[hiddenColumnIndex];
-                int hiddenIndexPrev = _hiddenStatesPrev[hiddenColumnIndex];
-                
-                int wiCur = (cx - lowerHiddenX) + (cy - lowerHiddenY) * backwardDiam + hiddenIndex * backwardSize;
-                int wiPrev = (cx - lowerHiddenX) + (cy - lowerHiddenY) * backwardDiam + hiddenIndexPrev * backwardSize;
+    if (reuse && _columnsDirty[ci] == 0 && (_codeIter == 0 || (!_columnsChanged[ci] && !columnFieldChanged(ci, _reconsChanged)))) {
+        // Nothing this code iteration reads changed, take the last pass' results
+        for (int c = 0; c < _columnSize; c++) {
+            int hiddenCellIndex = ci + c * numHiddenColumns;
 
-                // Output cells
-                for (int c = 0; c < visibleColumnSize; c++) {
-                    int visibleCellIndex = ci + c * visibleWidth * visibleHeight;
-        
-                    columnActivations[c] += _feedBackWeights[v][visibleCellIndex][wiCur + backwardVecSize];
-                    columnActivationsPrev[c] += _feedBackWeights[v][visibleCellIndex][wiPrev + backwardVecSize];
-                }
-            }
+            _hiddenActivations[hiddenCellIndex] = _iterActivations[_codeIter][hiddenCellIndex];
         }
 
-    int inputIndex = _inputs[v][ci];
+        int hiddenState = _iterStates[_codeIter][ci];
 
-    std::vector<float> deltas(visibleColumnSize, 0.0f);
-    deltas[inputIndex] = 1.0f;
+        // The packed winner is the one of the previous code iteration
+        bool repack = packsWinners() && hiddenState != _hiddenStates[ci];
 
-    int predIndex = 0;
+        _hiddenStates[ci] = hiddenState;
 
-    for (int c = 0; c < visibleColumnSize; c++) {
-        float s = sigmoid(columnActivationsPrev[c]);
-        deltas[c] -= s;
-        deltas[c] *= _beta;
+        _columnsChanged[ci] = false;
 
-        if (columnActivations[c] > columnActivations[predIndex])
-            predIndex = c;
+        if (repack)
+            columnPackWinner(ci);
+
+        return;
     }
- 
-    _predictions[v][ci] = predIndex;
 
-    if (_learn) {
-        for (int dcx = -backwardRadius; dcx <= backwardRadius; dcx++)
-            for (int dcy = -backwardRadius; dcy <= backwardRadius; dcy++) {
-                int cx = hiddenCenterX + dcx;
-                int cy = hiddenCenterY + dcy;
+    float* columnActivations = scratch;
 
-                if (cx >= 0 && cx < _hiddenWidth && cy >= 0 && cy < _hiddenHeight) {
-                    int hiddenColumnIndex = cx + cy * _hiddenWidth;
+    std::fill(columnActivations, columnActivations + _columnSize, 0.0f);
 
-                    if (!_feedBackPrev.empty()) {
-                        int feedBackIndexPrev = _feedBackPrev[hiddenColumnIndex];
+    const Kernels &kernels = getKernels();
+    const ColumnKernels &columnKernels = getColumnKernels(kernels, _columnSize);
 
-                        int wiPrev = (cx - lowerHiddenX) + (cy - lowerHiddenY) * backwardDiam + feedBackIndexPrev * backwardSize;
+    // Weight row offsets of the active inputs (and their scales past the first code iteration), in field order
+    int* rowOffsets = indexScratch;
+    float* rowScales = scratch + _columnSize;
 
-                        // Output cells
-                        for (int c = 0; c < visibleColumnSize; c++) {
-                            int visibleCellIndex = ci + c * visibleWidth * visibleHeight;
+    // Activate feed forward
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        // Clipped forward field
+        const FieldRange &rangeX = _forwardRangesX[v][hiddenColumnX];
+        const FieldRange &rangeY = _forwardRangesY[v][hiddenColumnY];
 
-                            _feedBackWeights[v][visibleCellIndex][wiPrev] += deltas[c];
-                        }
-                    }
+        int forwardDiam = _visibleLayerDescs[v]._forwardRadius * 2 + 1;
 
-                    int hiddenIndexPrev = _hiddenStatesPrev[hiddenColumnIndex];
-                    
-                    int wiPrev = (cx - lowerHiddenX) + (cy - lowerHiddenY) * backwardDiam + hiddenIndexPrev * backwardSize;
+        int forwardSize = forwardDiam * forwardDiam;
 
-                    // Output cells
-                    for (int c = 0; c < visibleColumnSize; c++) {
-                        int visibleCellIndex = ci + c * visibleWidth * visibleHeight;
+        int lowerVisibleX = rangeX._origin;
+        int lowerVisibleY = rangeY._origin;
 
-                        _feedBackWeights[v][visibleCellIndex][wiPrev + backwardVecSize] += deltas[c];
-                    }
-                }
-            }
-    }
-}
+        const int* inputs = getInputView(v);
 
-void Layer::create(int hiddenWidth, int hiddenHeight, int columnSize, const std::vector<VisibleLayerDesc> &visibleLayerDescs, unsigned long seed) {
-    std::mt19937 rng(seed);
+        // Quantized blocks have a row per weight index
+        int weightStride = isFrozen() ? 1 : getForwardWeightStride();
 
-    _hiddenWidth = hiddenWidth;
-    _hiddenHeight = hiddenHeight;
-    _columnSize = columnSize;
+        int count = 0;
 
-    _visibleLayerDescs = visibleLayerDescs;
+        for (int cx = rangeX._lower; cx <= rangeX._upper; cx++)
+            for (int cy = rangeY._lower; cy <= rangeY._upper; cy++) {
+                int visibleColumnIndex = cx + cy * _visibleLayerDescs[v]._width;
 
-    _feedForwardWeights.resize(_visibleLayerDescs.size());
-    _feedBackWeights.resize(_visibleLayerDescs.size());
+                int inputIndex = inputs[visibleColumnIndex];
 
-    _inputs.resize(_visibleLayerDescs.size());
+                // Missing inputs contribute nothing
+                if (inputIndex == _noInput)
+                    continue;
 
-    _hiddenStates.resize(_hiddenWidth * _hiddenHeight, 0);
+                int wi = (cx - lowerVisibleX) + (cy - lowerVisibleY) * forwardDiam + inputIndex * forwardSize;
 
-    _hiddenActivations.resize(_hiddenWidth * _hiddenHeight * _columnSize, 0.0f);
+                rowOffsets[count] = wi * weightStride;
 
-    std::uniform_real_distribution<float> initWeightDist(-0.001f, 0.001f);
+                if (_codeIter != 0) {
+                    int visibleCellIndex = visibleColumnIndex + inputIndex * _visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height;
 
-    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
-        _inputs[v].resize(_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height, 0);
+                    float recon = _recons[(_codeIter - 1) * _visibleLayerDescs.size() + v][visibleCellIndex] / std::max(1.0f, _reconCounts[v][visibleColumnIndex]);
 
-        int forwardVecSize = _visibleLayerDescs[v]._forwardRadius * 2 + 1;
+                    rowScales[count] = std::max(0.0f, 1.0f - recon);
+                }
 
-        forwardVecSize *= forwardVecSize * _visibleLayerDescs[v]._columnSize;
+                count++;
+            }
 
-        _feedForwardWeights[v].resize(_hiddenWidth * _hiddenHeight * _columnSize);
+        if (isFrozen()) {
+            _quantizedForwardWeights[v].accumulateRows(kernels, columnActivations, ci, rowOffsets, _codeIter == 0 ? nullptr : rowScales, count);
 
-        for (int x = 0; x < _hiddenWidth; x++)
-            for (int y = 0; y < _hiddenHeight; y++)
-                for (int c = 0; c < _columnSize; c++) {
-                    int hiddenCellIndex = x + y * _hiddenWidth + c * _hiddenWidth * _hiddenHeight;
+            continue;
+        }
 
-                    _feedForwardWeights[v][hiddenCellIndex].resize(forwardVecSize);
-                    
-                    for (int j = 0; j < forwardVecSize; j++)
-                        _feedForwardWeights[v][hiddenCellIndex][j] = 1.0f + initWeightDist(rng);
-                }
+        // Weights of this column's hidden cells
+        const float* columnWeights = getForwardColumn(v, ci);
 
-        if (_visibleLayerDescs[v]._predict) {
-            _feedBackWeights[v].resize(_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height * _visibleLayerDescs[v]._columnSize);
+        int cellStride = getForwardCellStride(v);
 
-            int backwardVecSize = _visibleLayerDescs[v]._backwardRadius * 2 + 1;
+        // Output cells, each row is a contiguous run of _columnSize weights in the minor layout, strided in the major one
+        if (_codeIter == 0)
+            columnKernels._accumulateRows(columnActivations, columnWeights, rowOffsets, count, cellStride, _columnSize);
+        else
+            columnKernels._accumulateRowsScaled(columnActivations, columnWeights, rowOffsets, rowScales, count, cellStride, _columnSize);
+    }
 
-            backwardVecSize *= backwardVecSize * _columnSize * 2;
+    // New weights change the reconstruction even if the winner stays
+    bool changed = !reuse || (_columnsDirty[ci] & _columnWeightsChanged) != 0;
 
-            for (int x = 0; x < _visibleLayerDescs[v]._width; x++)
-                for (int y = 0; y < _visibleLayerDescs[v]._height; y++)         
-                    for (int c = 0; c < _visibleLayerDescs[v]._columnSize; c++) {
-                        int visibleCellIndex = x + y * _visibleLayerDescs[v]._width + c * _visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height;
-                        
-                        _feedBackWeights[v][visibleCellIndex].resize(backwardVecSize);
+    for (int c = 0; c < _columnSize; c++) {
+        int hiddenCellIndex = ci + c * numHiddenColumns;
 
-                        for (int j = 0; j < backwardVecSize; j++)
-                            _feedBackWeights[v][visibleCellIndex][j] = initWeightDist(rng);
-                    }
+        if (_codeIter != 0)
+            columnActivations[c] += _hiddenActivations[hiddenCellIndex];
+
+        _hiddenActivations[hiddenCellIndex] = columnActivations[c];
+
+        if (_incremental) {
+            float &cached = _iterActivations[_codeIter][hiddenCellIndex];
+
+            if (!sameBits(cached, columnActivations[c])) {
+                cached = columnActivations[c];
+
+                changed = true;
+            }
         }
     }
 
-    _feedBackPrev = _feedBack = _hiddenStatesPrev = _hiddenStates;
+	// Find max element
+	int maxCellIndex = kernels._argMax(columnActivations, _columnSize);
 
-    _predictions = _inputsPrev = _inputs;
-}
+    if (!(columnActivations[maxCellIndex] > -99999.0f))
+        maxCellIndex = 0;
 
-void Layer::forward(ComputeSystem &cs, const std::vector<std::vector<int>> &inputs, bool learn) {
-    _inputsPrev = _inputs;
-    _inputs = inputs;
+    _hiddenStates[ci] = maxCellIndex;
 
-    _learn = learn;
+    if (_incremental) {
+        _iterStates[_codeIter][ci] = maxCellIndex;
 
-    _hiddenStatesPrev = _hiddenStates;
+        _columnsChanged[ci] = changed;
+    }
 
-    // Several inhibition iterations
-    for (int it = 0; it < _codeIters; it++) {
-        _codeIter = it;
+    if (packsWinners())
+        columnPackWinner(ci);
+}
 
-        // Clear recons
-        _recons.clear();
-        _recons.resize(_visibleLayerDescs.size());
+void Layer::columnReconstruct(int ci, int v, float* scratch) {
+    int visibleWidth = _visibleLayerDescs[v]._width;
+    int visibleHeight = _visibleLayerDescs[v]._height;
 
-        for (int v = 0; v < _visibleLayerDescs.size(); v++)
-            _recons[v].resize(_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height * _visibleLayerDescs[v]._columnSize, 0.0f);
-        
-        _reconCounts = _recons;
+    int visibleColumnX = ci % visibleWidth;
+    int visibleColumnY = ci / visibleWidth;
 
-        for (int ci = 0; ci < _hiddenStates.size(); ci++) {
-            std::shared_ptr<LayerForwardWorkItem> item = std::make_shared<LayerForwardWorkItem>();
+    int visibleColumnSize = _visibleLayerDescs[v]._columnSize;
 
-            item->_pLayer = this;
-            item->_ci = ci;
+    int forwardDiam = _visibleLayerDescs[v]._forwardRadius * 2 + 1;
 
-            cs._pool.addItem(item);
-        }
-        
-        cs._pool.wait();
+    int forwardSize = forwardDiam * forwardDiam;
+
+    // Hidden columns whose forward field covers this visible column
+    int lowerHiddenX = _reconRangesX[v][visibleColumnX * 2];
+    int upperHiddenX = _reconRangesX[v][visibleColumnX * 2 + 1];
+    int lowerHiddenY = _reconRangesY[v][visibleColumnY * 2];
+    int upperHiddenY = _reconRangesY[v][visibleColumnY * 2 + 1];
 
-        _reconsActLearn = _recons;
-        _reconCountsActLearn = _reconCounts;
+    // Only columns with an input read their reconstruction (scaling later code iterations, learning next pass)
+    if (getInputView(v)[ci] == _noInput) {
+        if (_incremental)
+            _reconsChanged[v][ci] = false;
+
+        return;
     }
-}
 
-void Layer::backward(ComputeSystem &cs, const std::vector<int> &feedBack, bool learn) {
-    _feedBackPrev = _feedBack;
-	_feedBack = feedBack;
+    bool reuse = _incremental && _incrementalValid;
 
-    _learn = learn;
+    // A column that had no input may hold a reconstruction from before
+    if (reuse && !_inputsChanged[v][ci]) {
+        bool hiddenChanged = false;
 
-    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
-        if (!_visibleLayerDescs[v]._predict)
-            continue;
+        for (int hy = lowerHiddenY; hy <= upperHiddenY && !hiddenChanged; hy++)
+            for (int hx = lowerHiddenX; hx <= upperHiddenX; hx++) {
+                if (_columnsChanged[hx + hy * _hiddenWidth]) {
+                    hiddenChanged = true;
 
-        for (int ci = 0; ci < _predictions[v].size(); ci++) {
-            std::shared_ptr<LayerBackwardWorkItem> item = std::make_shared<LayerBackwardWorkItem>();
+                    break;
+                }
+            }
 
-            item->_pLayer = this;
-            item->_ci = ci;
-            item->_v = v;
+        // Same winners with the same weights, the last pass' reconstruction still holds
+        if (!hiddenChanged) {
+            _reconsChanged[v][ci] = false;
 
-            cs._pool.addItem(item);
+            return;
         }
     }
 
-    cs._pool.wait();
-}
+    float* columnRecons = scratch;
 
-void Layer::readFromStream(std::istream &is) {
-    // Read header
-    is.read(reinterpret_cast<char*>(&_hiddenWidth), sizeof(int));
-    is.read(reinterpret_cast<char*>(&_hiddenHeight), sizeof(int));
-    is.read(reinterpret_cast<char*>(&_columnSize), sizeof(int));
+    std::fill(columnRecons, columnRecons + visibleColumnSize, 0.0f);
 
-    // Read hyperparameters
-    is.read(reinterpret_cast<char*>(&_alpha), sizeof(float));
-    is.read(reinterpret_cast<char*>(&_beta), sizeof(float));
-    is.read(reinterpret_cast<char*>(&_codeIters), sizeof(int));
+    // Gather from the winning cells in hidden column order, so sums do not depend on scheduling
+    for (int hy = lowerHiddenY; hy <= upperHiddenY; hy++) {
+        int lowerVisibleY = _forwardRangesY[v][hy]._origin;
 
-    int numVisibleLayerDescs;
+        for (int hx = lowerHiddenX; hx <= upperHiddenX; hx++) {
+            int lowerVisibleX = _forwardRangesX[v][hx]._origin;
 
-    is.read(reinterpret_cast<char*>(&numVisibleLayerDescs), sizeof(int));
+            int hiddenColumnIndex = hx + hy * _hiddenWidth;
 
-    _visibleLayerDescs.resize(numVisibleLayerDescs);
+            const float* weights = packsWinners() ? _winnerWeights[v].getRow(hiddenColumnIndex) : _feedForwardWeights[v].getRow(hiddenColumnIndex * _columnSize + _hiddenStates[hiddenColumnIndex]);
 
-    is.read(reinterpret_cast<char*>(_visibleLayerDescs.data()), _visibleLayerDescs.size() * sizeof(VisibleLayerDesc));
+            int wiStart = (visibleColumnX - lowerVisibleX) + (visibleColumnY - lowerVisibleY) * forwardDiam;
 
-    _inputs.resize(_visibleLayerDescs.size());
-    _inputsPrev.resize(_visibleLayerDescs.size());
-    _predictions.resize(_visibleLayerDescs.size());
+            // Input cells
+            for (int c = 0; c < visibleColumnSize; c++)
+                columnRecons[c] += weights[wiStart + c * forwardSize];
+        }
+    }
 
-    _feedForwardWeights.resize(_visibleLayerDescs.size());
-    _feedBackWeights.resize(_visibleLayerDescs.size());
-   
-    // Hidden data
-    _hiddenStates.resize(_hiddenWidth * _hiddenHeight);
-    _hiddenStatesPrev.resize(_hiddenStates.size());
-    _feedBack.resize(_hiddenStates.size());
-    _feedBackPrev.resize(_hiddenStates.size());
-    _hiddenActivations.resize(_hiddenStates.size() * _columnSize);
+    std::vector<float> &recons = _recons[_codeIter * _visibleLayerDescs.size() + v];
 
-    is.read(reinterpret_cast<char*>(_hiddenStates.data()), _hiddenStates.size() * sizeof(int));
-    is.read(reinterpret_cast<char*>(_hiddenStatesPrev.data()), _hiddenStatesPrev.size() * sizeof(int));
-    is.read(reinterpret_cast<char*>(_feedBack.data()), _feedBack.size() * sizeof(int));
-    is.read(reinterpret_cast<char*>(_feedBackPrev.data()), _feedBackPrev.size() * sizeof(int));
+    bool changed = !reuse;
 
-    // If feedback is -1, clear to empty
-    if (_feedBack.front() == -1)
-        _feedBack.clear();
+    for (int c = 0; c < visibleColumnSize; c++) {
+        float &recon = recons[ci + c * visibleWidth * visibleHeight];
 
-    if (_feedBackPrev.front() == -1)
-        _feedBackPrev.clear();
+        if (!sameBits(recon, columnRecons[c])) {
+            recon = columnRecons[c];
 
-    is.read(reinterpret_cast<char*>(_hiddenActivations.data()), _hiddenActivations.size() * sizeof(float));
+            changed = true;
+        }
+    }
 
-    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
-        // Visible layer data
-        _inputs[v].resize(_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height);
-        _inputsPrev[v].resize(_inputs[v].size());
-        _predictions[v].resize(_inputs[v].size());
-        
-        is.read(reinterpret_cast<char*>(_inputs[v].data()), _inputs[v].size() * sizeof(int));
-        is.read(reinterpret_cast<char*>(_inputsPrev[v].data()), _inputsPrev[v].size() * sizeof(int));
-        is.read(reinterpret_cast<char*>(_predictions[v].data()), _predictions[v].size() * sizeof(int));
+    if (_incremental)
+        _reconsChanged[v][ci] = changed;
+}
 
-        // Forward weights
-        int forwardVecSize = _visibleLayerDescs[v]._forwardRadius * 2 + 1;
+void Layer::columnBackwardActivations(int ci, int v, float* activations, float* activationsPrev, int* indexScratch) {
+    int visibleWidth = _visibleLayerDescs[v]._width;
 
-        forwardVecSize *= forwardVecSize * _visibleLayerDescs[v]._columnSize;
+    int visibleColumnX = ci % visibleWidth;
+    int visibleColumnY = ci / visibleWidth;
 
-        _feedForwardWeights[v].resize(_hiddenWidth * _hiddenHeight * _columnSize);
+    int visibleColumnSize = _visibleLayerDescs[v]._columnSize;
 
-        for (int x = 0; x < _hiddenWidth; x++)
-            for (int y = 0; y < _hiddenHeight; y++)
-                for (int c = 0; c < _columnSize; c++) {
-                    int hiddenCellIndex = x + y * _hiddenWidth + c * _hiddenWidth * _hiddenHeight;
+    const Kernels &kernels = getKernels();
 
-                    _feedForwardWeights[v][hiddenCellIndex].resize(forwardVecSize);
+    int backwardRadius = _visibleLayerDescs[v]._backwardRadius;
 
-                    is.read(reinterpret_cast<char*>(_feedForwardWeights[v][hiddenCellIndex].data()), _feedForwardWeights[v][hiddenCellIndex].size() * sizeof(float));
-                }
+    int backwardDiam = backwardRadius * 2 + 1;
+    int backwardSize = backwardDiam * backwardDiam;
+    int backwardVecSize = backwardSize * _columnSize;
 
-        // Backward weights
-        if (_visibleLayerDescs[v]._predict) {
-            _feedBackWeights[v].resize(_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height * _visibleLayerDescs[v]._columnSize);
+    // Clipped backward field
+    const FieldRange &rangeX = _backwardRangesX[v][visibleColumnX];
+    const FieldRange &rangeY = _backwardRangesY[v][visibleColumnY];
 
-            int backwardVecSize = _visibleLayerDescs[v]._backwardRadius * 2 + 1;
+    int lowerHiddenX = rangeX._origin;
+    int lowerHiddenY = rangeY._origin;
 
-            backwardVecSize *= backwardVecSize * _columnSize;
+    // Weight row offsets of the active hidden (and feed back) cells, in field order
+    int* rowOffsets = indexScratch;
+    int* rowOffsetsPrev = indexScratch + backwardSize * 2;
 
-            for (int x = 0; x < _visibleLayerDescs[v]._width; x++)
-                for (int y = 0; y < _visibleLayerDescs[v]._height; y++)         
-                    for (int c = 0; c < _visibleLayerDescs[v]._columnSize; c++) {
-                        int visibleCellIndex = x + y * _visibleLayerDescs[v]._width + c * _visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height;
+    int count = 0;
+    int countPrev = 0;
 
-                        _feedBackWeights[v][visibleCellIndex].resize(backwardVecSize);
-                            
-                        is.read(reinterpret_cast<char*>(_feedBackWeights[v][visibleCellIndex].data()), _feedBackWeights[v][visibleCellIndex].size() * sizeof(float));
-                    }
-        }
-    }
-}
+    for (int cx = rangeX._lower; cx <= rangeX._upper; cx++)
+        for (int cy = rangeY._lower; cy <= rangeY._upper; cy++) {
+            int hiddenColumnIndex = cx + cy * _hiddenWidth;
 
-void Layer::writeToStream(std::ostream &os) {
-    // Write header
-    os.write(reinterpret_cast<char*>(&_hiddenWidth), sizeof(int));
-    os.write(reinterpret_cast<char*>(&_hiddenHeight), sizeof(int));
-    os.write(reinterpret_cast<char*>(&_columnSize), sizeof(int));
+            int wi = (cx - lowerHiddenX) + (cy - lowerHiddenY) * backwardDiam;
 
-    // Write hyperparameters
-    os.write(reinterpret_cast<char*>(&_alpha), sizeof(float));
-    os.write(reinterpret_cast<char*>(&_beta), sizeof(float));
-    os.write(reinterpret_cast<char*>(&_codeIters), sizeof(int));
+            if (!_feedBack.empty() && !_feedBackPrev.empty()) {
+                if (activations != nullptr)
+                    rowOffsets[count++] = wi + _feedBack[hiddenColumnIndex] * backwardSize;
 
-    int numVisibleLayerDescs = _visibleLayerDescs.size();
+                if (activationsPrev != nullptr)
+                    rowOffsetsPrev[countPrev++] = wi + _feedBackPrev[hiddenColumnIndex] * backwardSize;
+            }
 
-    os.write(reinterpret_cast<char*>(&numVisibleLayerDescs), sizeof(int));
+            if (activations != nullptr)
+                rowOffsets[count++] = wi + _hiddenStates[hiddenColumnIndex] * backwardSize + backwardVecSize;
 
-    os.write(reinterpret_cast<char*>(_visibleLayerDescs.data()), _visibleLayerDescs.size() * sizeof(VisibleLayerDesc));
+            if (activationsPrev != nullptr)
+                rowOffsetsPrev[countPrev++] = wi + _hiddenStatesPrev[hiddenColumnIndex] * backwardSize + backwardVecSize;
+        }
 
-    // Hidden data
-    os.write(reinterpret_cast<char*>(_hiddenStates.data()), _hiddenStates.size() * sizeof(int));
-    os.write(reinterpret_cast<char*>(_hiddenStatesPrev.data()), _hiddenStatesPrev.size() * sizeof(int));
+    if (isFrozen()) {
+        if (activations != nullptr)
+            _quantizedFeedBackWeights[v].accumulateRows(kernels, activations, ci, rowOffsets, nullptr, count);
 
-    std::vector<int> writeFeedBack = _feedBack;
-    std::vector<int> writeFeedBackPrev = _feedBackPrev;
+        if (activationsPrev != nullptr)
+            _quantizedFeedBackWeights[v].accumulateRows(kernels, activationsPrev, ci, rowOffsetsPrev, nullptr, countPrev);
 
-    if (writeFeedBack.empty())
-        writeFeedBack.resize(_hiddenStates.size(), -1);
+        return;
+    }
 
-    if (writeFeedBackPrev.empty())
-        writeFeedBackPrev.resize(_hiddenStates.size(), -1);
+    const ColumnKernels &columnKernels = getColumnKernels(kernels, visibleColumnSize);
 
-    os.write(reinterpret_cast<char*>(writeFeedBack.data()), writeFeedBack.size() * sizeof(int));
-    os.write(reinterpret_cast<char*>(writeFeedBackPrev.data()), writeFeedBackPrev.size() * sizeof(int));
-    os.write(reinterpret_cast<char*>(_hiddenActivations.data()), _hiddenActivations.size() * sizeof(float));
+    // Rows of this column's visible cells are adjacent
+    const float* columnWeights = _feedBackWeights[v].getRow(ci * visibleColumnSize);
 
-    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
-        // Visible layer data
-        os.write(reinterpret_cast<char*>(_inputs[v].data()), _inputs[v].size() * sizeof(int));
-        os.write(reinterpret_cast<char*>(_inputsPrev[v].data()), _inputsPrev[v].size() * sizeof(int));
-        os.write(reinterpret_cast<char*>(_predictions[v].data()), _predictions[v].size() * sizeof(int));
+    int rowStride = _feedBackWeights[v].getRowStride();
 
-        // Forward weights
-        for (int x = 0; x < _hiddenWidth; x++)
-            for (int y = 0; y < _hiddenHeight; y++)
+    // Output cells
+    if (activations != nullptr)
+        columnKernels._accumulateRows(activations, columnWeights, rowOffsets, count, rowStride, visibleColumnSize);
+
+    if (activationsPrev != nullptr)
+        columnKernels._accumulateRows(activationsPrev, columnWeights, rowOffsetsPrev, countPrev, rowStride, visibleColumnSize);
+}
+
+void Layer::columnBackward(int ci, int v, float* scratch, int* indexScratch, bool predict) {
+    int visibleWidth = _visibleLayerDescs[v]._width;
+
+    int visibleColumnX = ci % visibleWidth;
+    int visibleColumnY = ci / visibleWidth;
+
+    int visibleColumnSize = _visibleLayerDescs[v]._columnSize;
+
+    // Extract input views
+    float* columnActivations = scratch;
+    float* columnActivationsPrev = scratch + visibleColumnSize;
+    float* deltas = scratch + visibleColumnSize * 2;
+
+    int inputIndex = getInputView(v)[ci];
+
+    // A missing input is not predicted and gives nothing to learn towards
+    if (inputIndex == _noInput) {
+        _predictions[v][ci] = _noInput;
+
+        _backwardActivationsKept[v][ci] = false;
+
+        return;
+    }
+
+    const Kernels &kernels = getKernels();
+
+    // Nothing to learn, so only predictions need activations
+    if (isFrozen()) {
+        if (predict) {
+            std::fill(columnActivations, columnActivations + visibleColumnSize, 0.0f);
+
+            columnBackwardActivations(ci, v, columnActivations, nullptr, indexScratch);
+
+            _predictions[v][ci] = kernels._argMax(columnActivations, visibleColumnSize);
+        }
+
+        _backwardActivationsKept[v][ci] = false;
+
+        return;
+    }
+
+    // Activations of the previous backward pass, see _backwardActivations
+    float* memoActivations = &_backwardActivations[v][ci * visibleColumnSize];
+
+    bool useFeedBack = !_feedBack.empty() && !_feedBackPrev.empty();
+
+    bool memoValid = _forwardsSinceBackward == 1 && _backwardActivationsFeedBack == useFeedBack && _backwardActivationsKept[v][ci];
+
+    // Columns that only learn need just the previous activations
+    float* activations = predict ? columnActivations : nullptr;
+
+    if (predict)
+        std::fill(columnActivations, columnActivations + visibleColumnSize, 0.0f);
+
+    if (memoValid) {
+        std::copy(memoActivations, memoActivations + visibleColumnSize, columnActivationsPrev);
+
+        if (predict)
+            columnBackwardActivations(ci, v, activations, nullptr, indexScratch);
+    }
+    else {
+        std::fill(columnActivationsPrev, columnActivationsPrev + visibleColumnSize, 0.0f);
+
+        columnBackwardActivations(ci, v, activations, columnActivationsPrev, indexScratch);
+    }
+
+    if (predict)
+        _predictions[v][ci] = kernels._argMax(columnActivations, visibleColumnSize);
+
+    // Whether learning changed a weight that columnActivations summed
+    bool memoStale = false;
+
+    if (_learn) {
+        kernels._deltas(deltas, columnActivationsPrev, inputIndex, _beta, visibleColumnSize);
+
+        _feedBackColumnsDirty[v][ci] = true;
+
+        float* columnWeights = _feedBackWeights[v].getRow(ci * visibleColumnSize);
+
+        int rowStride = _feedBackWeights[v].getRowStride();
+
+        int backwardRadius = _visibleLayerDescs[v]._backwardRadius;
+
+        int backwardDiam = backwardRadius * 2 + 1;
+        int backwardSize = backwardDiam * backwardDiam;
+        int backwardVecSize = backwardSize * _columnSize;
+
+        // Clipped backward field
+        const FieldRange &rangeX = _backwardRangesX[v][visibleColumnX];
+        const FieldRange &rangeY = _backwardRangesY[v][visibleColumnY];
+
+        int lowerHiddenX = rangeX._origin;
+        int lowerHiddenY = rangeY._origin;
+
+        for (int cx = rangeX._lower; cx <= rangeX._upper; cx++)
+            for (int cy = rangeY._lower; cy <= rangeY._upper; cy++) {
+                int hiddenColumnIndex = cx + cy * _hiddenWidth;
+
+                if (!_feedBackPrev.empty()) {
+                    int feedBackIndexPrev = _feedBackPrev[hiddenColumnIndex];
+
+                    int wiPrev = (cx - lowerHiddenX) + (cy - lowerHiddenY) * backwardDiam + feedBackIndexPrev * backwardSize;
+
+                    // Output cells
+                    for (int c = 0; c < visibleColumnSize; c++)
+                        columnWeights[c * rowStride + wiPrev] += deltas[c];
+
+                    if (useFeedBack && feedBackIndexPrev == _feedBack[hiddenColumnIndex])
+                        memoStale = true;
+                }
+
+                int hiddenIndexPrev = _hiddenStatesPrev[hiddenColumnIndex];
+
+                int wiPrev = (cx - lowerHiddenX) + (cy - lowerHiddenY) * backwardDiam + hiddenIndexPrev * backwardSize;
+
+                // Output cells
+                for (int c = 0; c < visibleColumnSize; c++)
+                    columnWeights[c * rowStride + wiPrev + backwardVecSize] += deltas[c];
+
+                if (hiddenIndexPrev == _hiddenStates[hiddenColumnIndex])
+                    memoStale = true;
+            }
+    }
+
+    // Keep this pass' activations, they are the next pass' previous activations.
+    // If learning changed any of the summed weights, sum again so results match a full recompute exactly.
+    if (!predict)
+        _backwardActivationsKept[v][ci] = false;
+    else {
+        if (memoStale) {
+            std::fill(memoActivations, memoActivations + visibleColumnSize, 0.0f);
+
+            columnBackwardActivations(ci, v, memoActivations, nullptr, indexScratch);
+        }
+        else
+            std::copy(columnActivations, columnActivations + visibleColumnSize, memoActivations);
+
+        _backwardActivationsKept[v][ci] = true;
+    }
+}
+
+void Layer::create(int hiddenWidth, int hiddenHeight, int columnSize, const std::vector<VisibleLayerDesc> &visibleLayerDescs, unsigned long seed, WeightLayout weightLayout) {
+    create(nullptr, hiddenWidth, hiddenHeight, columnSize, visibleLayerDescs, seed, weightLayout);
+}
+
+void Layer::create(ComputeSystem &cs, int hiddenWidth, int hiddenHeight, int columnSize, const std::vector<VisibleLayerDesc> &visibleLayerDescs, unsigned long seed, WeightLayout weightLayout) {
+    create(&cs, hiddenWidth, hiddenHeight, columnSize, visibleLayerDescs, seed, weightLayout);
+}
+
+void Layer::create(ComputeSystem* cs, int hiddenWidth, int hiddenHeight, int columnSize, const std::vector<VisibleLayerDesc> &visibleLayerDescs, unsigned long seed, WeightLayout weightLayout) {
+    // Every weight has its own counter, so the weights do not depend on the order (or thread) they are generated in
+    const uint32_t key[2] = { static_cast<uint32_t>(seed), static_cast<uint32_t>(static_cast<uint64_t>(seed) >> 32) };
+
+    _hiddenWidth = hiddenWidth;
+    _hiddenHeight = hiddenHeight;
+    _columnSize = columnSize;
+
+    _weightLayout = weightLayout;
+
+    _visibleLayerDescs = visibleLayerDescs;
+
+    _feedForwardWeights.resize(_visibleLayerDescs.size());
+    _feedBackWeights.resize(_visibleLayerDescs.size());
+
+    _inputs.resize(_visibleLayerDescs.size());
+
+    _hiddenStates.resize(_hiddenWidth * _hiddenHeight, 0);
+
+    _hiddenActivations.resize(_hiddenWidth * _hiddenHeight * _columnSize, 0.0f);
+
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        _inputs[v].resize(_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height, 0);
+
+        int forwardVecSize = _visibleLayerDescs[v]._forwardRadius * 2 + 1;
+
+        forwardVecSize *= forwardVecSize * _visibleLayerDescs[v]._columnSize;
+
+        createForwardWeights(v, forwardVecSize);
+
+        int cellStride = getForwardCellStride(v);
+        int weightStride = getForwardWeightStride();
+
+        // Streams are per hidden cell, the same for every layout
+        auto initForwardColumn = [this, v, forwardVecSize, cellStride, weightStride, &key](int ci, size_t threadIndex) {
+            for (int c = 0; c < _columnSize; c++)
+                initWeightRow(getForwardColumn(v, ci) + c * cellStride, forwardVecSize, weightStride, 1.0f, key, _initFeedForward, v, ci * _columnSize + c);
+        };
+
+        if (cs == nullptr) {
+            for (int ci = 0; ci < _hiddenStates.size(); ci++)
+                initForwardColumn(ci, 0);
+        }
+        else
+            cs->_pool.parallelFor(0, _hiddenStates.size(), 4, initForwardColumn);
+
+        if (_visibleLayerDescs[v]._predict) {
+            int backwardVecSize = _visibleLayerDescs[v]._backwardRadius * 2 + 1;
+
+            backwardVecSize *= backwardVecSize * _columnSize * 2;
+
+            _feedBackWeights[v].create(_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height * _visibleLayerDescs[v]._columnSize, backwardVecSize);
+
+            auto initFeedBackRow = [this, v, backwardVecSize, &key](int visibleRow, size_t threadIndex) {
+                initWeightRow(_feedBackWeights[v].getRow(visibleRow), backwardVecSize, 1, 0.0f, key, _initFeedBack, v, visibleRow);
+            };
+
+            if (cs == nullptr) {
+                for (int visibleRow = 0; visibleRow < _feedBackWeights[v].getNumRows(); visibleRow++)
+                    initFeedBackRow(visibleRow, 0);
+            }
+            else
+                cs->_pool.parallelFor(0, _feedBackWeights[v].getNumRows(), 16, initFeedBackRow);
+        }
+    }
+
+    _feedBackPrev = _feedBack = _hiddenStatesPrev = _hiddenStates;
+
+    _predictions = _inputsPrev = _inputs;
+
+    initScratchSize();
+    initFieldRanges();
+    initBackwardActivations();
+    initInputViews();
+    initForwardCaches();
+    initPredictionColumns();
+    initDirtyRows();
+    initPrecision();
+}
+
+void Layer::createForwardWeights(int v, int forwardVecSize) {
+    _winnerWeights.resize(_visibleLayerDescs.size());
+
+    if (_weightLayout == _hiddenCellMajor) {
+        _feedForwardWeights[v].create(_hiddenWidth * _hiddenHeight * _columnSize, forwardVecSize);
+
+        _winnerWeights[v].clear();
+    }
+    else {
+        _feedForwardWeights[v].create(_hiddenWidth * _hiddenHeight, forwardVecSize * _columnSize);
+
+        _winnerWeights[v].create(_hiddenWidth * _hiddenHeight, forwardVecSize);
+    }
+}
+
+void Layer::buildFieldRanges(std::vector<FieldRange> &ranges, int sourceSize, int targetSize, int radius) {
+    float toTarget = static_cast<float>(targetSize) / static_cast<float>(sourceSize);
+
+    ranges.resize(sourceSize);
+
+    for (int s = 0; s < sourceSize; s++) {
+        int center = s * toTarget + 0.5f;
+
+        ranges[s]._origin = center - radius;
+        ranges[s]._lower = std::max(0, center - radius);
+        ranges[s]._upper = std::min(targetSize - 1, center + radius);
+    }
+}
+
+void Layer::initFieldRanges() {
+    _forwardRangesX.resize(_visibleLayerDescs.size());
+    _forwardRangesY.resize(_visibleLayerDescs.size());
+    _backwardRangesX.resize(_visibleLayerDescs.size());
+    _backwardRangesY.resize(_visibleLayerDescs.size());
+    _reconRangesX.resize(_visibleLayerDescs.size());
+    _reconRangesY.resize(_visibleLayerDescs.size());
+    _reconCounts.resize(_visibleLayerDescs.size());
+
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        buildFieldRanges(_forwardRangesX[v], _hiddenWidth, _visibleLayerDescs[v]._width, _visibleLayerDescs[v]._forwardRadius);
+        buildFieldRanges(_forwardRangesY[v], _hiddenHeight, _visibleLayerDescs[v]._height, _visibleLayerDescs[v]._forwardRadius);
+        buildFieldRanges(_backwardRangesX[v], _visibleLayerDescs[v]._width, _hiddenWidth, _visibleLayerDescs[v]._backwardRadius);
+        buildFieldRanges(_backwardRangesY[v], _visibleLayerDescs[v]._height, _hiddenHeight, _visibleLayerDescs[v]._backwardRadius);
+
+        // Empty ranges (lower > upper) for visible coordinates no hidden column reaches
+        _reconRangesX[v].resize(_visibleLayerDescs[v]._width * 2);
+        _reconRangesY[v].resize(_visibleLayerDescs[v]._height * 2);
+
+        for (int x = 0; x < _visibleLayerDescs[v]._width; x++) {
+            _reconRangesX[v][x * 2] = _hiddenWidth;
+            _reconRangesX[v][x * 2 + 1] = -1;
+        }
+
+        for (int y = 0; y < _visibleLayerDescs[v]._height; y++) {
+            _reconRangesY[v][y * 2] = _hiddenHeight;
+            _reconRangesY[v][y * 2 + 1] = -1;
+        }
+
+        // Centers are monotonic in the hidden coordinate, so the covering hidden coordinates are contiguous
+        for (int hx = 0; hx < _hiddenWidth; hx++) {
+            for (int x = _forwardRangesX[v][hx]._lower; x <= _forwardRangesX[v][hx]._upper; x++) {
+                _reconRangesX[v][x * 2] = std::min(_reconRangesX[v][x * 2], hx);
+                _reconRangesX[v][x * 2 + 1] = std::max(_reconRangesX[v][x * 2 + 1], hx);
+            }
+        }
+
+        for (int hy = 0; hy < _hiddenHeight; hy++) {
+            for (int y = _forwardRangesY[v][hy]._lower; y <= _forwardRangesY[v][hy]._upper; y++) {
+                _reconRangesY[v][y * 2] = std::min(_reconRangesY[v][y * 2], hy);
+                _reconRangesY[v][y * 2 + 1] = std::max(_reconRangesY[v][y * 2 + 1], hy);
+            }
+        }
+
+        _reconCounts[v].resize(_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height);
+
+        for (int x = 0; x < _visibleLayerDescs[v]._width; x++)
+            for (int y = 0; y < _visibleLayerDescs[v]._height; y++) {
+                int countX = std::max(0, _reconRangesX[v][x * 2 + 1] - _reconRangesX[v][x * 2] + 1);
+                int countY = std::max(0, _reconRangesY[v][y * 2 + 1] - _reconRangesY[v][y * 2] + 1);
+
+                _reconCounts[v][x + y * _visibleLayerDescs[v]._width] = static_cast<float>(countX * countY);
+            }
+    }
+}
+
+void Layer::initScratchSize() {
+    // Column activations and row scales going forward, column reconstructions, activations, previous activations and deltas going backward
+    _scratchSize = _columnSize;
+
+    // Row offsets of a forward field, and of both backward activations (hidden and feed back rows)
+    _indexScratchSize = 0;
+
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        int forwardDiam = _visibleLayerDescs[v]._forwardRadius * 2 + 1;
+        int backwardDiam = _visibleLayerDescs[v]._backwardRadius * 2 + 1;
+
+        _scratchSize = std::max(_scratchSize, _columnSize + forwardDiam * forwardDiam);
+        _scratchSize = std::max(_scratchSize, _visibleLayerDescs[v]._columnSize * 3);
+
+        _indexScratchSize = std::max(_indexScratchSize, forwardDiam * forwardDiam);
+        _indexScratchSize = std::max(_indexScratchSize, backwardDiam * backwardDiam * 4);
+    }
+}
+
+void Layer::initBackwardActivations() {
+    _backwardActivations.resize(_visibleLayerDescs.size());
+    _backwardActivationsKept.resize(_visibleLayerDescs.size());
+
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        if (_visibleLayerDescs[v]._predict) {
+            _backwardActivations[v].assign(_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height * _visibleLayerDescs[v]._columnSize, 0.0f);
+            _backwardActivationsKept[v].assign(_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height, false);
+        }
+        else {
+            _backwardActivations[v].clear();
+            _backwardActivationsKept[v].clear();
+        }
+    }
+
+    // Nothing to reuse until a backward pass has run
+    _forwardsSinceBackward = 2;
+    _backwardActivationsFeedBack = false;
+}
+
+void Layer::initPredictionColumns() {
+    _predictionColumns.assign(_visibleLayerDescs.size(), std::vector<int>());
+    _predictionMask.assign(_visibleLayerDescs.size(), std::vector<char>());
+    _learnOutsidePredictions.assign(_visibleLayerDescs.size(), true);
+}
+
+void Layer::initDirtyRows() {
+    _forwardRowsDirty.resize(_visibleLayerDescs.size());
+    _feedBackColumnsDirty.resize(_visibleLayerDescs.size());
+
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        _forwardRowsDirty[v].assign(_feedForwardWeights[v].getNumRows(), false);
+        _feedBackColumnsDirty[v].assign(_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height, false);
+    }
+}
+
+void Layer::initPrecision() {
+    // Float weights were just created or read
+    _precision = _precisionFloat;
+
+    _quantizedForwardWeights.clear();
+    _quantizedFeedBackWeights.clear();
+}
+
+void Layer::initForwardCaches() {
+    // Nothing to learn from or reuse until a forward pass has run
+    _reconIters = 0;
+    _incrementalValid = false;
+    _incrementalAlpha = 0.0f;
+}
+
+void Layer::initInputViews() {
+    _inputViews.assign(_visibleLayerDescs.size(), nullptr);
+    _inputViewsPrev.assign(_visibleLayerDescs.size(), nullptr);
+}
+
+void Layer::remapInputViews(const std::vector<std::vector<int>> &from, const std::vector<std::vector<int>> &to) {
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        for (int s = 0; s < from.size(); s++) {
+            if (_inputViews[v] == from[s].data())
+                _inputViews[v] = to[s].data();
+
+            if (_inputViewsPrev[v] == from[s].data())
+                _inputViewsPrev[v] = to[s].data();
+        }
+    }
+}
+
+void Layer::forward(ComputeSystem &cs, const std::vector<std::vector<int>> &inputs, bool learn) {
+    assert(inputs.size() == _visibleLayerDescs.size());
+
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        // The current inputs become the previous ones
+        if (_inputViews[v] == nullptr)
+            _inputsPrev[v].swap(_inputs[v]);
+        else
+            _inputsPrev[v].assign(_inputViews[v], _inputViews[v] + _inputs[v].size());
+
+        _inputs[v] = inputs[v];
+
+        _inputViews[v] = nullptr;
+        _inputViewsPrev[v] = nullptr;
+    }
+
+    forwardColumns(cs, learn);
+}
+
+void Layer::forward(ComputeSystem &cs, const std::vector<const int*> &inputs, bool learn) {
+    assert(inputs.size() == _visibleLayerDescs.size());
+
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        // The current inputs become the previous ones, only owned ones need moving
+        if (_inputViews[v] == nullptr) {
+            _inputsPrev[v].swap(_inputs[v]);
+
+            _inputViewsPrev[v] = nullptr;
+        }
+        else
+            _inputViewsPrev[v] = _inputViews[v];
+
+        _inputViews[v] = inputs[v];
+    }
+
+    forwardColumns(cs, learn);
+}
+
+void Layer::reserveBuffers(ComputeSystem &cs) {
+    cs.reserveScratch(_scratchSize);
+    cs.reserveIndexScratch(_indexScratchSize);
+
+    // One set of recons per code iteration, fully overwritten by the gather, so only size them.
+    // Never shrunk, learning still reads the last pass' final set.
+    if (_recons.size() < _codeIters * _visibleLayerDescs.size())
+        _recons.resize(_codeIters * _visibleLayerDescs.size());
+
+    for (int it = 0; it < _codeIters; it++) {
+        for (int v = 0; v < _visibleLayerDescs.size(); v++)
+            _recons[it * _visibleLayerDescs.size() + v].resize(_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height * _visibleLayerDescs[v]._columnSize);
+    }
+
+    if (!_incremental)
+        return;
+
+    int numHiddenColumns = _hiddenWidth * _hiddenHeight;
+
+    if (_iterActivations.size() < _codeIters) {
+        _iterActivations.resize(_codeIters);
+        _iterStates.resize(_codeIters);
+    }
+
+    for (int it = 0; it < _codeIters; it++) {
+        _iterActivations[it].resize(numHiddenColumns * _columnSize);
+        _iterStates[it].resize(numHiddenColumns);
+    }
+
+    _columnsDirty.resize(numHiddenColumns);
+    _columnsChanged.resize(numHiddenColumns);
+
+    _inputsChanged.resize(_visibleLayerDescs.size());
+    _reconsChanged.resize(_visibleLayerDescs.size());
+
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        int numVisibleColumns = _visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height;
+
+        _inputsChanged[v].resize(numVisibleColumns);
+        _reconsChanged[v].resize(numVisibleColumns);
+    }
+}
+
+void Layer::prepareIncremental() {
+    // Caches of a pass with other settings do not line up
+    if (_reconIters != _codeIters || _incrementalAlpha != _alpha)
+        _incrementalValid = false;
+
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        int numVisibleColumns = _visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height;
+
+        const int* inputs = getInputView(v);
+        const int* inputsPrev = getInputViewPrev(v);
+
+        for (int i = 0; i < numVisibleColumns; i++)
+            _inputsChanged[v][i] = inputs[i] != inputsPrev[i];
+    }
+}
+
+void Layer::forwardColumns(ComputeSystem &cs, bool learn) {
+    _learn = learn && !isFrozen();
+
+    reserveBuffers(cs);
+
+    if (_incremental)
+        prepareIncremental();
+    else
+        _incrementalValid = false;
+
+    _hiddenStatesPrev = _hiddenStates;
+
+    _forwardsSinceBackward = std::min(_forwardsSinceBackward + 1, 2);
+
+    // Several inhibition iterations
+    for (int it = 0; it < _codeIters; it++) {
+        _codeIter = it;
+
+        cs._pool.parallelFor(0, _hiddenStates.size(), 4, [this, &cs](int ci, size_t threadIndex) {
+            columnForward(ci, cs.getScratch(threadIndex), cs.getIndexScratch(threadIndex));
+        });
+
+        // Reconstruct once all winners are known, each visible column only writes its own cells
+        for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+            cs._pool.parallelFor(0, _visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height, 16, [this, v, &cs](int ci, size_t threadIndex) {
+                columnReconstruct(ci, v, cs.getScratch(threadIndex));
+            });
+        }
+    }
+
+    _reconIters = _codeIters;
+
+    if (_incremental) {
+        _incrementalValid = true;
+        _incrementalAlpha = _alpha;
+    }
+}
+
+void Layer::backward(ComputeSystem &cs, const std::vector<int> &feedBack, bool learn) {
+    // Buffers are swapped and refilled in place, so stepping does not allocate
+    _feedBackPrev.swap(_feedBack);
+	_feedBack = feedBack;
+
+    _learn = learn && !isFrozen();
+
+    cs.reserveScratch(_scratchSize);
+    cs.reserveIndexScratch(_indexScratchSize);
+
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        if (!_visibleLayerDescs[v]._predict)
+            continue;
+
+        if (_predictionMask[v].empty()) {
+            cs._pool.parallelFor(0, _predictions[v].size(), 16, [this, v, &cs](int ci, size_t threadIndex) {
+                columnBackward(ci, v, cs.getScratch(threadIndex), cs.getIndexScratch(threadIndex), true);
+            });
+        }
+        else if (_learn && _learnOutsidePredictions[v]) {
+            // Every column learns, only the registered ones predict
+            cs._pool.parallelFor(0, _predictions[v].size(), 16, [this, v, &cs](int ci, size_t threadIndex) {
+                columnBackward(ci, v, cs.getScratch(threadIndex), cs.getIndexScratch(threadIndex), _predictionMask[v][ci] != 0);
+            });
+        }
+        else {
+            cs._pool.parallelFor(0, _predictionColumns[v].size(), 16, [this, v, &cs](int i, size_t threadIndex) {
+                columnBackward(_predictionColumns[v][i], v, cs.getScratch(threadIndex), cs.getIndexScratch(threadIndex), true);
+            });
+        }
+    }
+
+    _forwardsSinceBackward = 0;
+    _backwardActivationsFeedBack = !_feedBack.empty() && !_feedBackPrev.empty();
+}
+
+void Layer::setPredictionColumns(int v, const std::vector<int> &columns, bool learnOutside) {
+    assert(_visibleLayerDescs[v]._predict);
+
+    int numVisibleColumns = _visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height;
+
+    _predictionMask[v].assign(numVisibleColumns, false);
+
+    for (int i = 0; i < columns.size(); i++) {
+        assert(columns[i] >= 0 && columns[i] < numVisibleColumns);
+
+        _predictionMask[v][columns[i]] = true;
+    }
+
+    // Sorted and without duplicates, so neighbouring columns stay together in the backward pass
+    _predictionColumns[v].clear();
+
+    for (int i = 0; i < numVisibleColumns; i++) {
+        if (_predictionMask[v][i])
+            _predictionColumns[v].push_back(i);
+        else {
+            _predictions[v][i] = _noInput;
+
+            // Not visited (or only learning) from now on, so their kept activations go stale
+            _backwardActivationsKept[v][i] = false;
+        }
+    }
+
+    _learnOutsidePredictions[v] = learnOutside;
+}
+
+void Layer::setPredictionRegion(int v, int x, int y, int width, int height, bool learnOutside) {
+    std::vector<int> columns;
+
+    for (int cy = std::max(0, y); cy < std::min(_visibleLayerDescs[v]._height, y + height); cy++)
+        for (int cx = std::max(0, x); cx < std::min(_visibleLayerDescs[v]._width, x + width); cx++)
+            columns.push_back(cx + cy * _visibleLayerDescs[v]._width);
+
+    setPredictionColumns(v, columns, learnOutside);
+}
+
+void Layer::clearPredictionColumns(int v) {
+    _predictionColumns[v].clear();
+    _predictionMask[v].clear();
+    _learnOutsidePredictions[v] = true;
+}
+
+bool Layer::readFromStream(std::istream &is) {
+    // Read header
+    is.read(reinterpret_cast<char*>(&_hiddenWidth), sizeof(int));
+    is.read(reinterpret_cast<char*>(&_hiddenHeight), sizeof(int));
+    is.read(reinterpret_cast<char*>(&_columnSize), sizeof(int));
+
+    // Read hyperparameters
+    is.read(reinterpret_cast<char*>(&_alpha), sizeof(float));
+    is.read(reinterpret_cast<char*>(&_beta), sizeof(float));
+    is.read(reinterpret_cast<char*>(&_codeIters), sizeof(int));
+
+    // The legacy format has no layout, weights are stored one hidden cell at a time
+    _weightLayout = _hiddenCellMajor;
+
+    int numVisibleLayerDescs;
+
+    is.read(reinterpret_cast<char*>(&numVisibleLayerDescs), sizeof(int));
+
+    // The same limits as readSections(...)
+    const int maxSize = 1 << 16;
+
+    if (!is.good() || _hiddenWidth < 1 || _hiddenWidth > maxSize || _hiddenHeight < 1 || _hiddenHeight > maxSize || _columnSize < 1 || _columnSize > maxSize
+        || _codeIters < 0 || _codeIters > maxSize || numVisibleLayerDescs < 0 || numVisibleLayerDescs > maxSize)
+        return false;
+
+    _visibleLayerDescs.resize(numVisibleLayerDescs);
+
+    is.read(reinterpret_cast<char*>(_visibleLayerDescs.data()), _visibleLayerDescs.size() * sizeof(VisibleLayerDesc));
+
+    if (!is.good())
+        return false;
+
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        const VisibleLayerDesc &vld = _visibleLayerDescs[v];
+
+        if (vld._width < 0 || vld._width > maxSize || vld._height < 0 || vld._height > maxSize || vld._columnSize < 0 || vld._columnSize > maxSize
+            || vld._forwardRadius < 0 || vld._forwardRadius > maxSize || vld._backwardRadius < 0 || vld._backwardRadius > maxSize)
+            return false;
+    }
+
+    uint64_t numHiddenColumns = static_cast<uint64_t>(_hiddenWidth) * _hiddenHeight;
+
+    // States, feed back (both twice) and activations
+    if (!streamHolds(is, { numHiddenColumns, 4 + static_cast<uint64_t>(_columnSize), sizeof(int) }))
+        return false;
+
+    _inputs.resize(_visibleLayerDescs.size());
+    _inputsPrev.resize(_visibleLayerDescs.size());
+    _predictions.resize(_visibleLayerDescs.size());
+
+    _feedForwardWeights.resize(_visibleLayerDescs.size());
+    _feedBackWeights.resize(_visibleLayerDescs.size());
+   
+    // Hidden data
+    _hiddenStates.resize(_hiddenWidth * _hiddenHeight);
+    _hiddenStatesPrev.resize(_hiddenStates.size());
+    _feedBack.resize(_hiddenStates.size());
+    _feedBackPrev.resize(_hiddenStates.size());
+    _hiddenActivations.resize(_hiddenStates.size() * _columnSize);
+
+    is.read(reinterpret_cast<char*>(_hiddenStates.data()), _hiddenStates.size() * sizeof(int));
+    is.read(reinterpret_cast<char*>(_hiddenStatesPrev.data()), _hiddenStatesPrev.size() * sizeof(int));
+    is.read(reinterpret_cast<char*>(_feedBack.data()), _feedBack.size() * sizeof(int));
+    is.read(reinterpret_cast<char*>(_feedBackPrev.data()), _feedBackPrev.size() * sizeof(int));
+
+    // If feedback is -1, clear to empty
+    if (_feedBack.front() == -1)
+        _feedBack.clear();
+
+    if (_feedBackPrev.front() == -1)
+        _feedBackPrev.clear();
+
+    is.read(reinterpret_cast<char*>(_hiddenActivations.data()), _hiddenActivations.size() * sizeof(float));
+
+    initScratchSize();
+    initFieldRanges();
+    initBackwardActivations();
+    initInputViews();
+    initForwardCaches();
+    initPredictionColumns();
+
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        uint64_t numVisibleColumns = static_cast<uint64_t>(_visibleLayerDescs[v]._width) * _visibleLayerDescs[v]._height;
+
+        uint64_t forwardDiam = _visibleLayerDescs[v]._forwardRadius * 2 + 1;
+        uint64_t backwardDiam = _visibleLayerDescs[v]._backwardRadius * 2 + 1;
+
+        // Inputs, previous inputs and predictions, then the weights
+        if (!streamHolds(is, { numVisibleColumns, 3, sizeof(int) })
+            || !streamHolds(is, { numHiddenColumns, static_cast<uint64_t>(_columnSize), forwardDiam * forwardDiam, static_cast<uint64_t>(_visibleLayerDescs[v]._columnSize), sizeof(float) })
+            || (_visibleLayerDescs[v]._predict && !streamHolds(is, { numVisibleColumns, static_cast<uint64_t>(_visibleLayerDescs[v]._columnSize), backwardDiam * backwardDiam, static_cast<uint64_t>(_columnSize) * 2, sizeof(float) })))
+            return false;
+
+        // Visible layer data
+        _inputs[v].resize(_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height);
+        _inputsPrev[v].resize(_inputs[v].size());
+        _predictions[v].resize(_inputs[v].size());
+        
+        is.read(reinterpret_cast<char*>(_inputs[v].data()), _inputs[v].size() * sizeof(int));
+        is.read(reinterpret_cast<char*>(_inputsPrev[v].data()), _inputsPrev[v].size() * sizeof(int));
+        is.read(reinterpret_cast<char*>(_predictions[v].data()), _predictions[v].size() * sizeof(int));
+
+        // Forward weights
+        int forwardVecSize = _visibleLayerDescs[v]._forwardRadius * 2 + 1;
+
+        forwardVecSize *= forwardVecSize * _visibleLayerDescs[v]._columnSize;
+
+        createForwardWeights(v, forwardVecSize);
+
+        int cellStride = getForwardCellStride(v);
+
+        for (int x = 0; x < _hiddenWidth; x++)
+            for (int y = 0; y < _hiddenHeight; y++)
                 for (int c = 0; c < _columnSize; c++) {
-                    int hiddenCellIndex = x + y * _hiddenWidth + c * _hiddenWidth * _hiddenHeight;
+                    float* weights = getForwardColumn(v, x + y * _hiddenWidth) + c * cellStride;
 
-                    os.write(reinterpret_cast<char*>(_feedForwardWeights[v][hiddenCellIndex].data()), _feedForwardWeights[v][hiddenCellIndex].size() * sizeof(float));
+                    is.read(reinterpret_cast<char*>(weights), forwardVecSize * sizeof(float));
                 }
 
         // Backward weights
         if (_visibleLayerDescs[v]._predict) {
+            // Hidden state and feed back weights, as in create(...)
+            int backwardVecSize = _visibleLayerDescs[v]._backwardRadius * 2 + 1;
+
+            backwardVecSize *= backwardVecSize * _columnSize * 2;
+
+            _feedBackWeights[v].create(_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height * _visibleLayerDescs[v]._columnSize, backwardVecSize);
+
             for (int x = 0; x < _visibleLayerDescs[v]._width; x++)
                 for (int y = 0; y < _visibleLayerDescs[v]._height; y++)         
                     for (int c = 0; c < _visibleLayerDescs[v]._columnSize; c++) {
-                        int visibleCellIndex = x + y * _visibleLayerDescs[v]._width + c * _visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height;
+                        int visibleRow = (x + y * _visibleLayerDescs[v]._width) * _visibleLayerDescs[v]._columnSize + c;
                             
-                        os.write(reinterpret_cast<char*>(_feedBackWeights[v][visibleCellIndex].data()), _feedBackWeights[v][visibleCellIndex].size() * sizeof(float));
+                        is.read(reinterpret_cast<char*>(_feedBackWeights[v].getRow(visibleRow)), backwardVecSize * sizeof(float));
                     }
         }
     }
-}
\ No newline at end of file
+
+    if (!is.good())
+        return false;
+
+    initDirtyRows();
+    initPrecision();
+
+    return true;
+}
+
+bool Layer::readSections(ModelReader &reader, int l) {
+    size_t size;
+
+    const char* section = reader.getSection(_sectionLayer, l, 0, size);
+
+    if (section == nullptr)
+        return false;
+
+    ModelParser parser(section, size);
+
+    // Parameters, counts are bounded so a bad file cannot ask for absurd allocations
+    const int maxSize = 1 << 16;
+
+    _hiddenWidth = parser.getCount(maxSize);
+    _hiddenHeight = parser.getCount(maxSize);
+    _columnSize = parser.getCount(maxSize);
+
+    _alpha = parser.getFloat();
+    _beta = parser.getFloat();
+    _codeIters = parser.getCount(maxSize);
+
+    int weightLayout = parser.getInt();
+
+    if (weightLayout != _hiddenCellMajor && weightLayout != _hiddenCellMinor)
+        parser.fail();
+
+    _weightLayout = static_cast<WeightLayout>(weightLayout);
+
+    _visibleLayerDescs.resize(parser.getCount(maxSize));
+
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        _visibleLayerDescs[v]._width = parser.getCount(maxSize);
+        _visibleLayerDescs[v]._height = parser.getCount(maxSize);
+        _visibleLayerDescs[v]._columnSize = parser.getCount(maxSize);
+        _visibleLayerDescs[v]._forwardRadius = parser.getCount(maxSize);
+        _visibleLayerDescs[v]._backwardRadius = parser.getCount(maxSize);
+        _visibleLayerDescs[v]._predict = parser.getInt() != 0;
+    }
+
+    if (!parser.good() || _hiddenWidth == 0 || _hiddenHeight == 0 || _columnSize == 0)
+        return false;
+
+    // Hidden states
+    int numHiddenColumns = _hiddenWidth * _hiddenHeight;
+
+    _hiddenStates.resize(numHiddenColumns);
+    _hiddenStatesPrev.resize(numHiddenColumns);
+    _hiddenActivations.resize(numHiddenColumns * _columnSize);
+
+    parser.getInts(_hiddenStates.data(), _hiddenStates.size());
+    parser.getInts(_hiddenStatesPrev.data(), _hiddenStatesPrev.size());
+
+    // Feed back is empty for the top layer
+    _feedBack.resize(parser.getInt() != 0 ? numHiddenColumns : 0);
+    parser.getInts(_feedBack.data(), _feedBack.size());
+
+    _feedBackPrev.resize(parser.getInt() != 0 ? numHiddenColumns : 0);
+    parser.getInts(_feedBackPrev.data(), _feedBackPrev.size());
+
+    parser.getFloats(_hiddenActivations.data(), _hiddenActivations.size());
+
+    // Visible states
+    _inputs.resize(_visibleLayerDescs.size());
+    _inputsPrev.resize(_visibleLayerDescs.size());
+    _predictions.resize(_visibleLayerDescs.size());
+
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        _inputs[v].resize(_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height);
+        _inputsPrev[v].resize(_inputs[v].size());
+        _predictions[v].resize(_inputs[v].size());
+
+        parser.getInts(_inputs[v].data(), _inputs[v].size());
+        parser.getInts(_inputsPrev[v].data(), _inputsPrev[v].size());
+        parser.getInts(_predictions[v].data(), _predictions[v].size());
+    }
+
+    initScratchSize();
+    initFieldRanges();
+    initBackwardActivations();
+    initInputViews();
+    initForwardCaches();
+    initPredictionColumns();
+
+    // Reconstructions the next step learns from, those of the last code iteration only
+    if (parser.getInt() != 0) {
+        _recons.resize(_visibleLayerDescs.size());
+
+        for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+            _recons[v].resize(_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height * _visibleLayerDescs[v]._columnSize);
+
+            parser.getFloats(_recons[v].data(), _recons[v].size());
+        }
+
+        _reconIters = 1;
+    }
+    else
+        _recons.clear();
+
+    if (!parser.good())
+        return false;
+
+    // Weights, stored as laid out in memory (see createForwardWeights)
+    _feedForwardWeights.resize(_visibleLayerDescs.size());
+    _feedBackWeights.resize(_visibleLayerDescs.size());
+    _winnerWeights.resize(_visibleLayerDescs.size());
+
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        int forwardVecSize = _visibleLayerDescs[v]._forwardRadius * 2 + 1;
+
+        forwardVecSize *= forwardVecSize * _visibleLayerDescs[v]._columnSize;
+
+        if (_weightLayout == _hiddenCellMajor) {
+            if (!readWeights(reader, _sectionFeedForward, l, v, numHiddenColumns * _columnSize, forwardVecSize, _feedForwardWeights[v]))
+                return false;
+
+            _winnerWeights[v].clear();
+        }
+        else {
+            if (!readWeights(reader, _sectionFeedForward, l, v, numHiddenColumns, forwardVecSize * _columnSize, _feedForwardWeights[v]))
+                return false;
+
+            _winnerWeights[v].create(numHiddenColumns, forwardVecSize);
+        }
+
+        if (_visibleLayerDescs[v]._predict) {
+            int backwardVecSize = _visibleLayerDescs[v]._backwardRadius * 2 + 1;
+
+            backwardVecSize *= backwardVecSize * _columnSize * 2;
+
+            if (!readWeights(reader, _sectionFeedBack, l, v, _visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height * _visibleLayerDescs[v]._columnSize, backwardVecSize, _feedBackWeights[v]))
+                return false;
+        }
+        else
+            _feedBackWeights[v].clear();
+    }
+
+    initDirtyRows();
+    initPrecision();
+
+    return true;
+}
+
+void Layer::initWinnerWeights() {
+    // The packed winner weights are not stored
+    if (_weightLayout == _hiddenCellMinor) {
+        for (int ci = 0; ci < _hiddenWidth * _hiddenHeight; ci++)
+            columnPackWinner(ci);
+    }
+}
+
+void Layer::writeSections(ModelWriter &writer, int l, std::vector<ModelBuffer> &buffers, bool delta) const {
+    buffers.resize(delta ? 1 + _visibleLayerDescs.size() * 2 : 1);
+
+    ModelBuffer &buffer = buffers.front();
+
+    // Parameters
+    buffer.putInt(_hiddenWidth);
+    buffer.putInt(_hiddenHeight);
+    buffer.putInt(_columnSize);
+
+    buffer.putFloat(_alpha);
+    buffer.putFloat(_beta);
+    buffer.putInt(_codeIters);
+    buffer.putInt(_weightLayout);
+
+    buffer.putInt(_visibleLayerDescs.size());
+
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        buffer.putInt(_visibleLayerDescs[v]._width);
+        buffer.putInt(_visibleLayerDescs[v]._height);
+        buffer.putInt(_visibleLayerDescs[v]._columnSize);
+        buffer.putInt(_visibleLayerDescs[v]._forwardRadius);
+        buffer.putInt(_visibleLayerDescs[v]._backwardRadius);
+        buffer.putInt(_visibleLayerDescs[v]._predict ? 1 : 0);
+    }
+
+    // Hidden states
+    buffer.putInts(_hiddenStates.data(), _hiddenStates.size());
+    buffer.putInts(_hiddenStatesPrev.data(), _hiddenStatesPrev.size());
+
+    buffer.putInt(_feedBack.empty() ? 0 : 1);
+    buffer.putInts(_feedBack.data(), _feedBack.size());
+
+    buffer.putInt(_feedBackPrev.empty() ? 0 : 1);
+    buffer.putInts(_feedBackPrev.data(), _feedBackPrev.size());
+
+    buffer.putFloats(_hiddenActivations.data(), _hiddenActivations.size());
+
+    // Visible states
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        int numVisibleColumns = _visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height;
+
+        buffer.putInts(getInputView(v), numVisibleColumns);
+        buffer.putInts(getInputViewPrev(v), numVisibleColumns);
+        buffer.putInts(_predictions[v].data(), numVisibleColumns);
+    }
+
+    // Reconstructions the next step learns from
+    buffer.putInt(_reconIters > 0 ? 1 : 0);
+
+    if (_reconIters > 0) {
+        for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+            const std::vector<float> &recons = _recons[(_reconIters - 1) * _visibleLayerDescs.size() + v];
+
+            buffer.putFloats(recons.data(), recons.size());
+        }
+    }
+
+    writer.addSection(_sectionLayer, l, 0, buffer.getBytes().data(), buffer.getBytes().size());
+
+    // Weight rows changed since the last checkpoint
+    if (delta) {
+        for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+            ModelBuffer &feedForward = buffers[1 + v * 2];
+
+            putDirtyRows(feedForward, _feedForwardWeights[v], _forwardRowsDirty[v], 1);
+
+            writer.addSection(_sectionFeedForwardDelta, l, v, feedForward.getBytes().data(), feedForward.getBytes().size());
+
+            if (_visibleLayerDescs[v]._predict) {
+                ModelBuffer &feedBack = buffers[2 + v * 2];
+
+                putDirtyRows(feedBack, _feedBackWeights[v], _feedBackColumnsDirty[v], _visibleLayerDescs[v]._columnSize);
+
+                writer.addSection(_sectionFeedBackDelta, l, v, feedBack.getBytes().data(), feedBack.getBytes().size());
+            }
+        }
+
+        return;
+    }
+
+    // Weights, as laid out in memory
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        writer.addFloatSection(_sectionFeedForward, l, v, _feedForwardWeights[v].getRow(0), _feedForwardWeights[v].getMemorySize() / sizeof(float));
+
+        if (_visibleLayerDescs[v]._predict)
+            writer.addFloatSection(_sectionFeedBack, l, v, _feedBackWeights[v].getRow(0), _feedBackWeights[v].getMemorySize() / sizeof(float));
+    }
+}
+
+void Layer::makeWeightsPrivate() {
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        _feedForwardWeights[v].makePrivate();
+        _feedBackWeights[v].makePrivate();
+    }
+}
+
+void Layer::freeze(WeightPrecision precision) {
+    if (isFrozen() || precision == _precisionFloat)
+        return;
+
+    _precision = precision;
+
+    _quantizedForwardWeights.resize(_visibleLayerDescs.size());
+    _quantizedFeedBackWeights.resize(_visibleLayerDescs.size());
+
+    int numHiddenColumns = _hiddenWidth * _hiddenHeight;
+
+    for (int v = 0; v < _visibleLayerDescs.size(); v++) {
+        int forwardVecSize = _visibleLayerDescs[v]._forwardRadius * 2 + 1;
+
+        forwardVecSize *= forwardVecSize * _visibleLayerDescs[v]._columnSize;
+
+        _quantizedForwardWeights[v].create(precision, numHiddenColumns, forwardVecSize, _columnSize);
+
+        for (int ci = 0; ci < numHiddenColumns; ci++)
+            _quantizedForwardWeights[v].setBlock(ci, getForwardColumn(v, ci), getForwardCellStride(v), getForwardWeightStride());
+
+        if (!_feedBackWeights[v].empty()) {
+            int numVisibleColumns = _visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height;
+            int visibleColumnSize = _visibleLayerDescs[v]._columnSize;
+
+            _quantizedFeedBackWeights[v].create(precision, numVisibleColumns, _feedBackWeights[v].getRowSize(), visibleColumnSize);
+
+            for (int ci = 0; ci < numVisibleColumns; ci++)
+                _quantizedFeedBackWeights[v].setBlock(ci, _feedBackWeights[v].getRow(ci * visibleColumnSize), _feedBackWeights[v].getRowStride(), 1);
+        }
+
+        // Only learning reads these
+        _feedForwardWeights[v].clear();
+        _feedBackWeights[v].clear();
+
+        _backwardActivations[v] = std::vector<float>();
+
+        _forwardRowsDirty[v] = std::vector<char>();
+        _feedBackColumnsDirty[v] = std::vector<char>();
+
+        // Reading single cells of quantized rows is scattered, reconstruction reads packed winners in both layouts
+        _winnerWeights[v].create(numHiddenColumns, forwardVecSize);
+    }
+
+    for (int ci = 0; ci < numHiddenColumns; ci++)
+        columnPackWinner(ci);
+
+    _learn = false;
+}
\ No newline at end of file
@@ -9,7 +9,11 @@
 #pragma once
 
 #include "ComputeSystem.h"
+#include "ModelFile.h"
+#include "QuantizedMatrix.h"
+#include "WeightMatrix.h"
 
+#include <initializer_list>
 #include <istream>
 #include <ostream>
 #include <unordered_map>
@@ -20,40 +24,11 @@ namespace eogmaneo {
     */
     float sigmoid(float x);
 
-    class Layer;
-
     /*!
-    \brief Layer forward work item. Internal use only.
+    \brief Whether a seekable stream has the bytes of a block of the given dimensions (their product) left.
+    Checked before a legacy file's block is allocated, so a damaged file cannot ask for more memory than it holds.
     */
-	class LayerForwardWorkItem : public WorkItem {
-	public:
-		Layer* _pLayer;
-
-		int _ci;
-
-		LayerForwardWorkItem()
-			: _pLayer(nullptr)
-		{}
-
-		void run(size_t threadIndex) override;
-	};
-
-    /*!
-    \brief Layer backward work item. Internal use only.
-    */
-	class LayerBackwardWorkItem : public WorkItem {
-	public:
-		class Layer* _pLayer;
-
-		int _ci;
-        int _v;
-
-		LayerBackwardWorkItem()
-			: _pLayer(nullptr)
-		{}
-
-		void run(size_t threadIndex) override;
-	};
+    bool streamHolds(std::istream &is, std::initializer_list<uint64_t> dims);
 
     /*!
     \brief Visible layer parameters.
@@ -96,6 +71,20 @@ namespace eogmaneo {
 		{}
 	};
 
+    /*!
+    \brief Column index marking a missing (masked) input column.
+    Masked columns add nothing to hidden activations, are not learned from and are not predicted (their prediction is _noInput).
+    */
+    const int _noInput = -1;
+
+    /*!
+    \brief Memory layout of a layer's feed forward weights.
+    */
+    enum WeightLayout {
+        _hiddenCellMajor = 0, // All weights of a hidden cell are adjacent
+        _hiddenCellMinor = 1 // For each weight index, the weights of all cells in a hidden column are adjacent
+    };
+
     /*!
     \brief A layer in the hierarchy.
     */
@@ -110,8 +99,26 @@ namespace eogmaneo {
 
         std::vector<float> _hiddenActivations;
         
-        std::vector<std::vector<std::vector<float>>> _feedForwardWeights;
-        std::vector<std::vector<std::vector<float>>> _feedBackWeights;
+        // One matrix per visible layer, forward rows are hidden cells (or hidden columns, see _weightLayout), feed back rows are visible cells.
+        // Rows are ordered column by column, row (x + y * width) * columnSize + c
+        std::vector<WeightMatrix> _feedForwardWeights;
+        std::vector<WeightMatrix> _feedBackWeights;
+
+        WeightLayout _weightLayout;
+
+        // With _hiddenCellMinor or frozen, a contiguous copy of each hidden column's winning cell weights for reconstruction
+        std::vector<WeightMatrix> _winnerWeights;
+
+        // Precision of the weights, below _precisionFloat the layer is frozen and the quantized matrices replace the float ones.
+        // Forward blocks are hidden columns with a row per weight index, feed back blocks are visible columns with a row per feed back weight.
+        WeightPrecision _precision;
+
+        std::vector<QuantizedMatrix> _quantizedForwardWeights;
+        std::vector<QuantizedMatrix> _quantizedFeedBackWeights;
+
+        // Per visible layer, whether learning changed each forward weight row and each visible column's feed back rows since the last checkpoint (see Hierarchy::saveDelta)
+        std::vector<std::vector<char>> _forwardRowsDirty;
+        std::vector<std::vector<char>> _feedBackColumnsDirty;
 
         std::vector<VisibleLayerDesc> _visibleLayerDescs;
 
@@ -120,26 +127,192 @@ namespace eogmaneo {
         std::vector<std::vector<int>> _inputs;
         std::vector<std::vector<int>> _inputsPrev;
 
+        // Inputs read in place (see forward(...) with views), nullptr when _inputs (_inputsPrev) hold them
+        std::vector<const int*> _inputViews;
+        std::vector<const int*> _inputViewsPrev;
+
+        // Reconstructions of each code iteration of the last forward pass, slot it * numVisibleLayers + v
         std::vector<std::vector<float>> _recons;
+
+        // Code iterations in _recons, 0 before the first forward pass (nothing to learn from yet)
+        int _reconIters;
+
+        /*!
+        \brief Receptive field of a coordinate along one axis, in the other layer's coordinates.
+        */
+        struct FieldRange {
+            int _origin; // Unclipped lower coordinate, weight index 0
+            int _lower, _upper; // Inclusive, clipped to the other layer
+        };
+
+        // Per visible layer, the forward field of each hidden x (y) and the backward field of each visible x (y).
+        // Fields are separable, so a column's clipped rectangle is the ranges of its x and y, which needs no bounds checks.
+        std::vector<std::vector<FieldRange>> _forwardRangesX;
+        std::vector<std::vector<FieldRange>> _forwardRangesY;
+        std::vector<std::vector<FieldRange>> _backwardRangesX;
+        std::vector<std::vector<FieldRange>> _backwardRangesY;
+
+        // Number of hidden columns reconstructing each visible column, fixed by the geometry
         std::vector<std::vector<float>> _reconCounts;
 
-        std::vector<std::vector<float>> _reconsActLearn;
-        std::vector<std::vector<float>> _reconCountsActLearn;
+        // Per visible layer, inclusive [lower, upper] range of hidden x (y) coordinates whose forward field covers each visible x (y)
+        std::vector<std::vector<int>> _reconRangesX;
+        std::vector<std::vector<int>> _reconRangesY;
         
         std::vector<int> _feedBack;
         std::vector<int> _feedBackPrev;
 
+        // Per predicted visible layer, column activations (cell ci * columnSize + c) of the last backward pass with the weights as they are now.
+        // The next backward pass' previous activations sum over the same states, so they are reused instead of gathered again.
+        std::vector<std::vector<float>> _backwardActivations;
+
+        // Forward passes since the last backward pass, _backwardActivations line up with the previous states only when this is 1
+        int _forwardsSinceBackward;
+
+        // Whether _backwardActivations include the feed back weights
+        bool _backwardActivationsFeedBack;
+
+        // Per predicted visible layer and column, whether the last backward pass kept the column's activations in _backwardActivations
+        std::vector<std::vector<char>> _backwardActivationsKept;
+
+        // Per visible layer, the columns whose predictions are computed and a flag per column of the same (both empty for all columns),
+        // and whether the other columns still learn
+        std::vector<std::vector<int>> _predictionColumns;
+        std::vector<std::vector<char>> _predictionMask;
+        std::vector<char> _learnOutsidePredictions;
+
+        // Incremental forward pass (see _incremental), per code iteration hidden activations (running sums) and hidden states of the last pass
+        std::vector<std::vector<float>> _iterActivations;
+        std::vector<std::vector<int>> _iterStates;
+
+        // Per visible layer and column, whether the input changed since the last pass and whether the current code iteration's reconstruction did
+        std::vector<std::vector<char>> _inputsChanged;
+        std::vector<std::vector<char>> _reconsChanged;
+
+        // Bits of _columnsDirty
+        enum ColumnDirt {
+            _columnFieldChanged = 1, // An input in the forward field changed
+            _columnWeightsChanged = 2 // Learning changed the column's weights
+        };
+
+        // Per hidden column, what changed in its forward field since the last pass (ColumnDirt bits) and whether the current code iteration's results differ from the last pass'
+        std::vector<char> _columnsDirty;
+        std::vector<char> _columnsChanged;
+
+        // Whether the caches hold the last forward pass, run with the current number of code iterations and learning rate
+        bool _incrementalValid;
+        float _incrementalAlpha;
+
         bool _learn;
         int _codeIter;
+
+        // Floats and ints of per-thread scratch memory the column functions need
+        int _scratchSize;
+        int _indexScratchSize;
   
-        void columnForward(int ci);
-        void columnBackward(int ci, int v);
+        void columnForward(int ci, float* scratch, int* indexScratch);
+        bool columnLearn(int ci);
+        bool columnFieldChanged(int ci, const std::vector<std::vector<char>> &changed) const;
+        void columnPackWinner(int ci);
+        void columnReconstruct(int ci, int v, float* scratch);
+        void columnBackward(int ci, int v, float* scratch, int* indexScratch, bool predict);
+        void columnBackwardActivations(int ci, int v, float* activations, float* activationsPrev, int* indexScratch);
+
+        void initScratchSize();
+        void initFieldRanges();
+        void initBackwardActivations();
+        void initInputViews();
+        void initForwardCaches();
+        void initPredictionColumns();
+        void initDirtyRows();
+        void initPrecision();
+
+        /*!
+        \brief Size the buffers a pass with the current settings uses (scratch, reconstructions, incremental caches), if not yet sized.
+        */
+        void reserveBuffers(ComputeSystem &cs);
+
+        void prepareIncremental();
+        void forwardColumns(ComputeSystem &cs, bool learn);
+
+        //!@{
+        /*!
+        \brief Current and previous inputs of a visible layer, wherever they are stored.
+        */
+        const int* getInputView(int v) const {
+            return _inputViews[v] != nullptr ? _inputViews[v] : _inputs[v].data();
+        }
+
+        const int* getInputViewPrev(int v) const {
+            return _inputViewsPrev[v] != nullptr ? _inputViewsPrev[v] : _inputsPrev[v].data();
+        }
+        //!@}
+
+        /*!
+        \brief Point views into the slots of one set of buffers at the matching slots of a copy of them.
+        */
+        void remapInputViews(const std::vector<std::vector<int>> &from, const std::vector<std::vector<int>> &to);
+
+        void create(ComputeSystem* cs, int hiddenWidth, int hiddenHeight, int columnSize, const std::vector<VisibleLayerDesc> &visibleLayerDescs, unsigned long seed, WeightLayout weightLayout);
+        void createForwardWeights(int v, int forwardVecSize);
+
+        static void buildFieldRanges(std::vector<FieldRange> &ranges, int sourceSize, int targetSize, int radius);
+
+        //!@{
+        /*!
+        \brief Start of the feed forward weights of a hidden column.
+        Weight wi of cell c is at getForwardColumn(v, ci)[c * getForwardCellStride(v) + wi * getForwardWeightStride()].
+        */
+        float* getForwardColumn(int v, int ci) {
+            return _weightLayout == _hiddenCellMajor ? _feedForwardWeights[v].getRow(ci * _columnSize) : _feedForwardWeights[v].getRow(ci);
+        }
+
+        const float* getForwardColumn(int v, int ci) const {
+            return _weightLayout == _hiddenCellMajor ? _feedForwardWeights[v].getRow(ci * _columnSize) : _feedForwardWeights[v].getRow(ci);
+        }
+        //!@}
+
+        int getForwardCellStride(int v) const {
+            return _weightLayout == _hiddenCellMajor ? _feedForwardWeights[v].getRowStride() : 1;
+        }
+
+        int getForwardWeightStride() const {
+            return _weightLayout == _hiddenCellMajor ? 1 : _columnSize;
+        }
+
+        /*!
+        \brief Whether reconstruction reads the winner weights from _winnerWeights (packed by columnPackWinner(...)).
+        */
+        bool packsWinners() const {
+            return _weightLayout == _hiddenCellMinor || isFrozen();
+        }
+
+        /*!
+        \brief Read from a stream in the legacy (headerless) format.
+        Returns false on a short read or out of range parameters, the layer is then unusable.
+        */
+        bool readFromStream(std::istream &is);
+
+        //!@{
+        /*!
+        \brief Read or write the sections of layer l in a model file (see ModelFile.h).
+        Writing references the weights and buffers (the first receives the parameters and states) until the writer is done.
+        Reading queues the weight reads on the reader (see ModelReader::requestFloatSection), initWinnerWeights() follows once they ran.
+        \param delta whether only weight rows changed since the last checkpoint are written (as delta sections, one more buffer each).
+        */
+        bool readSections(ModelReader &reader, int l);
+        void writeSections(ModelWriter &writer, int l, std::vector<ModelBuffer> &buffers, bool delta) const;
+        //!@}
+
+        /*!
+        \brief Pack the winner weights from the forward weights, after those were read.
+        */
+        void initWinnerWeights();
 
         /*!
-        \brief Write to stream
+        \brief Replace weights that are views of a mapped model file by owned copies, so they can be learned.
         */
-        void readFromStream(std::istream &is);
-        void writeToStream(std::ostream &os);
+        void makeWeightsPrivate();
 
     public:
         /*!
@@ -157,11 +330,17 @@ namespace eogmaneo {
         */
         int _codeIters;
 
+        /*!
+        \brief Incremental forward pass, only hidden columns whose forward field (inputs, weights or reconstructions) changed since the last pass are recomputed.
+        Does not change results, pays off when few inputs change per step. Costs a copy of the hidden activations per code iteration.
+        */
+        bool _incremental;
+
         /*!
         \brief Initialize defaults.
         */
         Layer()
-        : _alpha(0.1f), _beta(0.1f), _codeIters(2)
+        : _weightLayout(_hiddenCellMajor), _precision(_precisionFloat), _alpha(0.1f), _beta(0.1f), _codeIters(2), _incremental(false)
         {}
 
         /*!
@@ -171,16 +350,31 @@ namespace eogmaneo {
         \param columnSize column size of the layer.
         \param visibleLayerDescs descriptor structures for all visible layers this (hidden) layer has.
         \param seed random number generator seed for layer generation.
+        \param weightLayout memory layout of the feed forward weights. Does not change results.
+        Each weight is drawn from a counter-based generator keyed on (seed, visible layer, cell, weight index), so the weights only depend on the seed.
         */
-        void create(int hiddenWidth, int hiddenHeight, int columnSize, const std::vector<VisibleLayerDesc> &visibleLayerDescs, unsigned long seed);
+        void create(int hiddenWidth, int hiddenHeight, int columnSize, const std::vector<VisibleLayerDesc> &visibleLayerDescs, unsigned long seed, WeightLayout weightLayout = _hiddenCellMajor);
+
+        /*!
+        \brief Create a layer like create(...), initializing the weights in parallel on the compute system's workers. The weights are the same for any number of workers.
+        */
+        void create(ComputeSystem &cs, int hiddenWidth, int hiddenHeight, int columnSize, const std::vector<VisibleLayerDesc> &visibleLayerDescs, unsigned long seed, WeightLayout weightLayout = _hiddenCellMajor);
 
         /*!
         \brief Forward activation and learning.
-        \param inputs vector of input SDRs in columnar format.
+        \param inputs vector of input SDRs in columnar format, columns may be _noInput.
         \param learn whether learning is enabled.
         */
         void forward(ComputeSystem &cs, const std::vector<std::vector<int> > &inputs, bool learn);
 
+        /*!
+        \brief Forward activation and learning, reading the inputs in place instead of copying them.
+        The memory behind the inputs must stay unchanged until after the next forward(...) call, which reads it as the previous inputs.
+        \param inputs one pointer per visible layer to its input SDR in columnar format, columns may be _noInput.
+        \param learn whether learning is enabled.
+        */
+        void forward(ComputeSystem &cs, const std::vector<const int*> &inputs, bool learn);
+
         /*!
         \brief Backward activation.
         \param feedBack vector of feedback SDRs in columnar format.
@@ -188,6 +382,47 @@ namespace eogmaneo {
         */
         void backward(ComputeSystem &cs, const std::vector<int> &feedBack, bool learn);
 
+        /*!
+        \brief Freeze the layer for inference, replacing its weights by reduced precision copies.
+        Frees the float weights and the state only learning needs, forward(...) and backward(...) no longer learn. Cannot be undone (load or create again).
+        \param precision _precisionHalf or _precisionInt8, _precisionFloat leaves the layer as it is.
+        */
+        void freeze(WeightPrecision precision);
+
+        /*!
+        \brief Whether the layer is frozen (see freeze(...)).
+        */
+        bool isFrozen() const {
+            return _precision != _precisionFloat;
+        }
+
+        /*!
+        \brief Get the precision of the weights.
+        */
+        WeightPrecision getWeightPrecision() const {
+            return _precision;
+        }
+
+        /*!
+        \brief Only compute predictions of a visible layer for some of its columns, the others are _noInput.
+        \param v visible layer index, must be predicted.
+        \param columns visible column indices (x + y * width) whose predictions are needed.
+        \param learnOutside whether the other columns keep learning, which leaves all results exactly as without the restriction.
+        Otherwise they learn lazily, only once they are predicted again, and backward passes cost in proportion to the predicted columns.
+        Inference only backward passes always skip the other columns.
+        */
+        void setPredictionColumns(int v, const std::vector<int> &columns, bool learnOutside = true);
+
+        /*!
+        \brief Only compute predictions of a visible layer inside a rectangle of columns (clipped to the layer), see setPredictionColumns.
+        */
+        void setPredictionRegion(int v, int x, int y, int width, int height, bool learnOutside = true);
+
+        /*!
+        \brief Compute predictions of all columns of a visible layer again.
+        */
+        void clearPredictionColumns(int v);
+
         //!@{
         /*!
         \brief Get dimensions.
@@ -208,6 +443,13 @@ namespace eogmaneo {
             return _columnSize;
         }
 
+        /*!
+        \brief Get the memory layout of the feed forward weights.
+        */
+        WeightLayout getWeightLayout() const {
+            return _weightLayout;
+        }
+
         /*!
         \brief Get the number of visible layers this (hidden) layer uses.
         */
@@ -239,19 +481,53 @@ namespace eogmaneo {
         /*!
         \brief Get inputs of a visible layer, in columnar format.
         */
-        const std::vector<int> &getInputs(int v) const {
-            return _inputs[v];
+        std::vector<int> getInputs(int v) const {
+            const int* inputs = getInputView(v);
+
+            return std::vector<int>(inputs, inputs + _visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height);
         }
 
         /*!
         \brief Get predictions of a visible layer, in columnar format.
+        Columns whose input is missing and columns left out by setPredictionColumns(...) are _noInput.
         */
         const std::vector<int> &getPredictions(int v) const {
             return _predictions[v];
         }
 
-        friend class LayerForwardWorkItem;
-        friend class LayerBackwardWorkItem;
+        /*!
+        \brief Get the feed forward weights of a hidden cell for a visible layer, empty if the layer is frozen.
+        \param v visible layer index.
+        \param hiddenCellIndex hidden cell index (x + y * hiddenWidth + c * hiddenWidth * hiddenHeight).
+        */
+        WeightView getFeedForwardWeights(int v, int hiddenCellIndex) const {
+            if (_feedForwardWeights[v].empty())
+                return WeightView();
+
+            int hiddenColumnIndex = hiddenCellIndex % (_hiddenWidth * _hiddenHeight);
+            int c = hiddenCellIndex / (_hiddenWidth * _hiddenHeight);
+
+            int forwardVecSize = _visibleLayerDescs[v]._forwardRadius * 2 + 1;
+
+            forwardVecSize *= forwardVecSize * _visibleLayerDescs[v]._columnSize;
+
+            return WeightView(getForwardColumn(v, hiddenColumnIndex) + c * getForwardCellStride(v), forwardVecSize, getForwardWeightStride());
+        }
+
+        /*!
+        \brief Get the feed back weights of a visible cell, empty if the visible layer is not predicted or the layer is frozen.
+        \param v visible layer index.
+        \param visibleCellIndex visible cell index (x + y * width + c * width * height).
+        */
+        WeightView getFeedBackWeights(int v, int visibleCellIndex) const {
+            if (_feedBackWeights[v].empty())
+                return WeightView();
+
+            int visibleColumnIndex = visibleCellIndex % (_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height);
+            int c = visibleCellIndex / (_visibleLayerDescs[v]._width * _visibleLayerDescs[v]._height);
+
+            return WeightView(_feedBackWeights[v].getRow(visibleColumnIndex * _visibleLayerDescs[v]._columnSize + c), _feedBackWeights[v].getRowSize(), 1);
+        }
 
         friend class Hierarchy;
     };
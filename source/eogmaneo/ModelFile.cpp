@@ -0,0 +1,896 @@
+// ----------------------------------------------------------------------------
+//  EOgmaNeo
+//  Copyright(c) 2017-2018 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of EOgmaNeo is licensed to you under the terms described
+//  in the EOGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#include "ModelFile.h"
+
+#include "Kernels.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace eogmaneo;
+
+namespace {
+    const char _magic[8] = { 'E', 'O', 'G', 'M', 'A', 'N', 'E', 'O' };
+
+    const size_t _headerSize = 64;
+    const size_t _tableEntrySize = 32;
+    const size_t _sectionAlignment = 64;
+
+    // Largest single read or write
+    const size_t _maxTransfer = static_cast<size_t>(1) << 30;
+
+    size_t alignUp(size_t x, size_t alignment) {
+        return (x + alignment - 1) / alignment * alignment;
+    }
+
+    void putU32(char* dst, uint32_t x) {
+        for (int i = 0; i < 4; i++)
+            dst[i] = static_cast<char>((x >> (i * 8)) & 0xff);
+    }
+
+    void putU64(char* dst, uint64_t x) {
+        for (int i = 0; i < 8; i++)
+            dst[i] = static_cast<char>((x >> (i * 8)) & 0xff);
+    }
+
+    bool isWeightSection(uint32_t type) {
+        return type == _sectionFeedForward || type == _sectionFeedBack;
+    }
+
+    uint32_t getU32(const char* src) {
+        uint32_t x = 0;
+
+        for (int i = 0; i < 4; i++)
+            x |= static_cast<uint32_t>(static_cast<unsigned char>(src[i])) << (i * 8);
+
+        return x;
+    }
+
+    uint64_t getU64(const char* src) {
+        uint64_t x = 0;
+
+        for (int i = 0; i < 8; i++)
+            x |= static_cast<uint64_t>(static_cast<unsigned char>(src[i])) << (i * 8);
+
+        return x;
+    }
+
+    // Copy 4-byte elements between host and file order
+    void copyWords(char* dst, const char* src, size_t count) {
+        if (hostIsLittleEndian()) {
+            std::memcpy(dst, src, count * 4);
+
+            return;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            for (int j = 0; j < 4; j++)
+                dst[i * 4 + j] = src[i * 4 + 3 - j];
+        }
+    }
+}
+
+uint32_t eogmaneo::crc32c(const void* data, size_t size, uint32_t crc) {
+    return ~getKernels()._crc32c(~crc, static_cast<const unsigned char*>(data), size);
+}
+
+bool eogmaneo::hostIsLittleEndian() {
+    const uint32_t one = 1;
+
+    char first;
+
+    std::memcpy(&first, &one, 1);
+
+    return first == 1;
+}
+
+void ModelBuffer::putInt(int x) {
+    putInts(&x, 1);
+}
+
+void ModelBuffer::putUInt64(uint64_t x) {
+    size_t start = _bytes.size();
+
+    _bytes.resize(start + sizeof(uint64_t));
+
+    putU64(_bytes.data() + start, x);
+}
+
+void ModelBuffer::putFloat(float x) {
+    putFloats(&x, 1);
+}
+
+void ModelBuffer::putInts(const int* x, size_t count) {
+    size_t start = _bytes.size();
+
+    _bytes.resize(start + count * sizeof(int));
+
+    copyWords(_bytes.data() + start, reinterpret_cast<const char*>(x), count);
+}
+
+void ModelBuffer::putFloats(const float* x, size_t count) {
+    size_t start = _bytes.size();
+
+    _bytes.resize(start + count * sizeof(float));
+
+    copyWords(_bytes.data() + start, reinterpret_cast<const char*>(x), count);
+}
+
+const char* ModelParser::take(size_t size) {
+    if (!_good || size > _size - _pos) {
+        _good = false;
+
+        return nullptr;
+    }
+
+    const char* p = _data + _pos;
+
+    _pos += size;
+
+    return p;
+}
+
+int ModelParser::getInt() {
+    int x = 0;
+
+    getInts(&x, 1);
+
+    return x;
+}
+
+uint64_t ModelParser::getUInt64() {
+    const char* p = take(sizeof(uint64_t));
+
+    return p == nullptr ? 0 : getU64(p);
+}
+
+float ModelParser::getFloat() {
+    float x = 0.0f;
+
+    getFloats(&x, 1);
+
+    return x;
+}
+
+void ModelParser::getInts(int* x, size_t count) {
+    const char* p = take(count * sizeof(int));
+
+    if (p == nullptr)
+        std::fill(x, x + count, 0);
+    else
+        copyWords(reinterpret_cast<char*>(x), p, count);
+}
+
+void ModelParser::getFloats(float* x, size_t count) {
+    const char* p = take(count * sizeof(float));
+
+    if (p == nullptr)
+        std::fill(x, x + count, 0.0f);
+    else
+        copyWords(reinterpret_cast<char*>(x), p, count);
+}
+
+int ModelParser::getCount(int maxCount) {
+    int count = getInt();
+
+    if (count < 0 || count > maxCount) {
+        _good = false;
+
+        return 0;
+    }
+
+    return count;
+}
+
+bool PositionedFile::open(const std::string &fileName, bool write) {
+    close();
+
+#ifdef _WIN32
+    HANDLE file;
+
+    if (write)
+        file = CreateFileA(fileName.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    else
+        file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    _handle = reinterpret_cast<intptr_t>(file);
+#else
+    int file = write ? ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666) : ::open(fileName.c_str(), O_RDONLY);
+
+    if (file < 0)
+        return false;
+
+    _handle = file;
+#endif
+
+    return true;
+}
+
+bool PositionedFile::close() {
+    if (_handle == -1)
+        return true;
+
+#ifdef _WIN32
+    bool closed = CloseHandle(reinterpret_cast<HANDLE>(_handle)) != 0;
+#else
+    bool closed = ::close(static_cast<int>(_handle)) == 0;
+#endif
+
+    _handle = -1;
+
+    return closed;
+}
+
+bool PositionedFile::read(char* data, size_t size, uint64_t offset) const {
+    while (size > 0) {
+        // Single calls are limited (to 2 GB on Linux)
+        size_t chunk = std::min(size, _maxTransfer);
+
+#ifdef _WIN32
+        OVERLAPPED overlapped = {};
+
+        overlapped.Offset = static_cast<DWORD>(offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+        DWORD done = 0;
+
+        if (!ReadFile(reinterpret_cast<HANDLE>(_handle), data, static_cast<DWORD>(chunk), &done, &overlapped) || done == 0)
+            return false;
+#else
+        ssize_t done = pread(static_cast<int>(_handle), data, chunk, static_cast<off_t>(offset));
+
+        if (done < 0 && errno == EINTR)
+            continue;
+
+        if (done <= 0)
+            return false;
+#endif
+
+        data += done;
+        size -= done;
+        offset += done;
+    }
+
+    return true;
+}
+
+bool PositionedFile::write(const char* data, size_t size, uint64_t offset) const {
+    while (size > 0) {
+        size_t chunk = std::min(size, _maxTransfer);
+
+#ifdef _WIN32
+        OVERLAPPED overlapped = {};
+
+        overlapped.Offset = static_cast<DWORD>(offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+        DWORD done = 0;
+
+        if (!WriteFile(reinterpret_cast<HANDLE>(_handle), data, static_cast<DWORD>(chunk), &done, &overlapped) || done == 0)
+            return false;
+#else
+        ssize_t done = pwrite(static_cast<int>(_handle), data, chunk, static_cast<off_t>(offset));
+
+        if (done < 0 && errno == EINTR)
+            continue;
+
+        if (done <= 0)
+            return false;
+#endif
+
+        data += done;
+        size -= done;
+        offset += done;
+    }
+
+    return true;
+}
+
+bool PositionedFile::getSize(uint64_t &size) const {
+#ifdef _WIN32
+    LARGE_INTEGER fileSize;
+
+    if (!GetFileSizeEx(reinterpret_cast<HANDLE>(_handle), &fileSize))
+        return false;
+
+    size = static_cast<uint64_t>(fileSize.QuadPart);
+#else
+    struct stat status;
+
+    if (fstat(static_cast<int>(_handle), &status) != 0)
+        return false;
+
+    size = static_cast<uint64_t>(status.st_size);
+#endif
+
+    return true;
+}
+
+
+void ModelWriter::addSection(uint32_t type, uint32_t layer, uint32_t item, const char* data, size_t size) {
+    Section section;
+
+    section._type = type;
+    section._layer = layer;
+    section._item = item;
+    section._data = data;
+    section._size = size;
+
+    _sections.push_back(section);
+}
+
+void ModelWriter::addFloatSection(uint32_t type, uint32_t layer, uint32_t item, const float* data, size_t count) {
+    if (hostIsLittleEndian()) {
+        addSection(type, layer, item, reinterpret_cast<const char*>(data), count * sizeof(float));
+
+        return;
+    }
+
+    _swapped.push_back(std::vector<char>(count * sizeof(float)));
+
+    copyWords(_swapped.back().data(), reinterpret_cast<const char*>(data), count);
+
+    addSection(type, layer, item, _swapped.back().data(), _swapped.back().size());
+}
+
+void ModelWriter::clear() {
+    _sections.clear();
+    _swapped.clear();
+}
+
+void ModelWriter::snapshot() {
+    size_t size = 0;
+
+    for (size_t s = 0; s < _sections.size(); s++)
+        size += _sections[s]._size;
+
+    // Grows only, an arena of the same model is reused as is
+    if (_arena.size() < size)
+        _arena.resize(size);
+
+    size_t offset = 0;
+
+    for (size_t s = 0; s < _sections.size(); s++) {
+        std::memcpy(_arena.data() + offset, _sections[s]._data, _sections[s]._size);
+
+        _sections[s]._data = _arena.data() + offset;
+
+        offset += _sections[s]._size;
+    }
+}
+
+bool ModelWriter::write(const std::string &fileName) {
+    bool success = beginWrite(fileName);
+
+    for (size_t s = 0; success && s < _sections.size(); s++)
+        success = writeSection(s);
+
+    return endWrite(success);
+}
+
+bool ModelWriter::beginWrite(const std::string &fileName) {
+    _fileName = fileName;
+
+    // Sections follow the header and the table
+    size_t offset = alignUp(_headerSize + _sections.size() * _tableEntrySize, _sectionAlignment);
+
+    for (size_t s = 0; s < _sections.size(); s++) {
+        _sections[s]._offset = offset;
+        _sections[s]._crc = 0;
+
+        offset = alignUp(offset + _sections[s]._size, _sectionAlignment);
+    }
+
+    _fileSize = offset;
+
+    return _file.open(_fileName + ".tmp", true);
+}
+
+bool ModelWriter::writeSection(size_t s) {
+    Section &section = _sections[s];
+
+    section._crc = crc32c(section._data, section._size);
+
+    if (!_file.write(section._data, section._size, section._offset))
+        return false;
+
+    // Zero padding up to the next section (or the end of the file)
+    const char zeros[_sectionAlignment] = {};
+
+    size_t padding = alignUp(section._size, _sectionAlignment) - section._size;
+
+    return padding == 0 || _file.write(zeros, padding, section._offset + section._size);
+}
+
+bool ModelWriter::endWrite(bool success) {
+    std::string tempFileName = _fileName + ".tmp";
+
+    // Header and section table, written last as they hold the checksums
+    if (success) {
+        size_t tableSize = _sections.size() * _tableEntrySize;
+
+        std::vector<char> head(alignUp(_headerSize + tableSize, _sectionAlignment), 0);
+
+        for (size_t s = 0; s < _sections.size(); s++) {
+            char* entry = head.data() + _headerSize + s * _tableEntrySize;
+
+            putU32(entry, _sections[s]._type);
+            putU32(entry + 4, _sections[s]._layer);
+            putU32(entry + 8, _sections[s]._item);
+            putU32(entry + 12, _sections[s]._crc);
+            putU64(entry + 16, _sections[s]._offset);
+            putU64(entry + 24, _sections[s]._size);
+        }
+
+        std::memcpy(head.data(), _magic, sizeof(_magic));
+        putU32(head.data() + 8, _modelFileVersion);
+        putU32(head.data() + 12, static_cast<uint32_t>(_sections.size()));
+        putU64(head.data() + 16, _fileSize);
+        putU32(head.data() + 24, crc32c(head.data() + _headerSize, tableSize));
+        putU32(head.data() + 28, crc32c(head.data(), 28));
+
+        success = _file.write(head.data(), head.size(), 0);
+    }
+
+    success = _file.close() && success;
+
+    if (!success) {
+        std::remove(tempFileName.c_str());
+
+        return false;
+    }
+
+#ifdef _WIN32
+    return MoveFileExA(tempFileName.c_str(), _fileName.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return std::rename(tempFileName.c_str(), _fileName.c_str()) == 0;
+#endif
+}
+
+MappedFile::~MappedFile() {
+    if (_data == nullptr)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(_data);
+    CloseHandle(static_cast<HANDLE>(_handle));
+#else
+    munmap(const_cast<char*>(_data), _size);
+#endif
+}
+
+bool MappedFile::map(const std::string &fileName) {
+    if (_data != nullptr)
+        return false;
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize;
+
+    HANDLE mapping = nullptr;
+
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+    // The mapping keeps the file open
+    CloseHandle(file);
+
+    if (mapping == nullptr)
+        return false;
+
+    const void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+    if (data == nullptr) {
+        CloseHandle(mapping);
+
+        return false;
+    }
+
+    _handle = mapping;
+    _size = static_cast<size_t>(fileSize.QuadPart);
+#else
+    int file = ::open(fileName.c_str(), O_RDONLY);
+
+    if (file < 0)
+        return false;
+
+    struct stat status;
+
+    void* data = MAP_FAILED;
+
+    if (fstat(file, &status) == 0 && status.st_size > 0)
+        data = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, file, 0);
+
+    // The mapping keeps the file open
+    close(file);
+
+    if (data == MAP_FAILED)
+        return false;
+
+    _size = static_cast<size_t>(status.st_size);
+#endif
+
+    _data = static_cast<const char*>(data);
+
+    return true;
+}
+
+bool ModelReader::isModelFile(const std::string &fileName) {
+    std::ifstream is(fileName, std::ios::binary);
+
+    char magic[sizeof(_magic)];
+
+    if (!is.read(magic, sizeof(magic)))
+        return false;
+
+    return std::memcmp(magic, _magic, sizeof(_magic)) == 0;
+}
+
+bool ModelReader::open(const std::string &fileName) {
+    _sections.clear();
+    _requests.clear();
+    _storage.clear();
+    _mapping.reset();
+    _size = 0;
+
+    uint64_t fileSize;
+
+    if (!_file.open(fileName, false) || !_file.getSize(fileSize) || fileSize < _headerSize)
+        return false;
+
+    _size = static_cast<size_t>(fileSize);
+
+    // Header, then the table it describes
+    char header[_headerSize];
+
+    if (!_file.read(header, _headerSize, 0) || !checkHeader(header))
+        return false;
+
+    std::vector<char> table(getU32(header + 12) * _tableEntrySize);
+
+    if (!_file.read(table.data(), table.size(), _headerSize) || !readTable(header, table.data()))
+        return false;
+
+    // Small sections are read now, weights once their destination is known
+    size_t storageSize = 0;
+
+    for (size_t s = 0; s < _sections.size(); s++) {
+        if (!isWeightSection(_sections[s]._type))
+            storageSize += _sections[s]._size;
+    }
+
+    _storage.resize(storageSize);
+
+    size_t pos = 0;
+
+    for (size_t s = 0; s < _sections.size(); s++) {
+        if (isWeightSection(_sections[s]._type))
+            continue;
+
+        char* data = _storage.data() + pos;
+
+        if (!_file.read(data, _sections[s]._size, _sections[s]._offset) || crc32c(data, _sections[s]._size) != _sections[s]._crc)
+            return false;
+
+        _sections[s]._data = data;
+
+        pos += _sections[s]._size;
+    }
+
+    return true;
+}
+
+bool ModelReader::map(const std::string &fileName, bool checkWeights) {
+    _sections.clear();
+    _requests.clear();
+    _storage.clear();
+    _file.close();
+    _mapping.reset();
+    _size = 0;
+
+    std::shared_ptr<MappedFile> mapping = std::make_shared<MappedFile>();
+
+    if (!mapping->map(fileName) || mapping->getSize() < _headerSize)
+        return false;
+
+    _mapping = mapping;
+    _size = mapping->getSize();
+
+    const char* data = mapping->getData();
+
+    if (!checkHeader(data) || !readTable(data, data + _headerSize))
+        return false;
+
+    for (size_t s = 0; s < _sections.size(); s++) {
+        _sections[s]._data = data + _sections[s]._offset;
+
+        if ((checkWeights || !isWeightSection(_sections[s]._type)) && crc32c(_sections[s]._data, _sections[s]._size) != _sections[s]._crc)
+            return false;
+    }
+
+    return true;
+}
+
+bool ModelReader::checkHeader(const char* header) const {
+    if (std::memcmp(header, _magic, sizeof(_magic)) != 0 || getU32(header + 28) != crc32c(header, 28))
+        return false;
+
+    if (getU32(header + 8) != _modelFileVersion || getU64(header + 16) != _size)
+        return false;
+
+    return getU32(header + 12) <= (_size - _headerSize) / _tableEntrySize;
+}
+
+bool ModelReader::readTable(const char* header, const char* table) {
+    size_t numSections = getU32(header + 12);
+
+    if (getU32(header + 24) != crc32c(table, numSections * _tableEntrySize))
+        return false;
+
+    _sections.resize(numSections);
+
+    for (size_t s = 0; s < numSections; s++) {
+        const char* entry = table + s * _tableEntrySize;
+
+        uint64_t offset = getU64(entry + 16);
+        uint64_t size = getU64(entry + 24);
+
+        if (offset % _sectionAlignment != 0 || offset > _size || size > _size - offset)
+            return false;
+
+        _sections[s]._type = getU32(entry);
+        _sections[s]._layer = getU32(entry + 4);
+        _sections[s]._item = getU32(entry + 8);
+        _sections[s]._crc = getU32(entry + 12);
+        _sections[s]._offset = static_cast<size_t>(offset);
+        _sections[s]._size = static_cast<size_t>(size);
+        _sections[s]._data = nullptr;
+    }
+
+    return true;
+}
+
+const ModelReader::Section* ModelReader::findSection(uint32_t type, uint32_t layer, uint32_t item) const {
+    for (size_t s = 0; s < _sections.size(); s++) {
+        if (_sections[s]._type == type && _sections[s]._layer == layer && _sections[s]._item == item)
+            return &_sections[s];
+    }
+
+    return nullptr;
+}
+
+const char* ModelReader::getSection(uint32_t type, uint32_t layer, uint32_t item, size_t &size) const {
+    const Section* section = findSection(type, layer, item);
+
+    if (section == nullptr || section->_data == nullptr) {
+        size = 0;
+
+        return nullptr;
+    }
+
+    size = section->_size;
+
+    return section->_data;
+}
+
+const char* ModelReader::getSection(size_t s, uint32_t &type, uint32_t &layer, uint32_t &item, size_t &size) const {
+    type = _sections[s]._type;
+    layer = _sections[s]._layer;
+    item = _sections[s]._item;
+    size = _sections[s]._size;
+
+    return _sections[s]._data;
+}
+
+bool ModelReader::getCheckpoint(uint64_t &id, uint64_t &parentId) const {
+    size_t size;
+
+    const char* section = getSection(_sectionCheckpoint, 0, 0, size);
+
+    if (section == nullptr)
+        return false;
+
+    ModelParser parser(section, size);
+
+    id = parser.getUInt64();
+    parentId = parser.getUInt64();
+
+    return parser.good();
+}
+
+bool ModelReader::requestFloatSection(uint32_t type, uint32_t layer, uint32_t item, float* data, size_t count) {
+    const Section* section = findSection(type, layer, item);
+
+    if (section == nullptr || section->_size != count * sizeof(float))
+        return false;
+
+    if (section->_data != nullptr) {
+        copyWords(reinterpret_cast<char*>(data), section->_data, count);
+
+        return true;
+    }
+
+    Request request;
+
+    request._section = section - _sections.data();
+    request._data = data;
+
+    _requests.push_back(request);
+
+    return true;
+}
+
+bool ModelReader::readRequest(size_t r) const {
+    const Section &section = _sections[_requests[r]._section];
+
+    char* data = reinterpret_cast<char*>(_requests[r]._data);
+
+    if (!_file.read(data, section._size, section._offset) || crc32c(data, section._size) != section._crc)
+        return false;
+
+    // From file to host order, in place
+    if (!hostIsLittleEndian()) {
+        for (size_t i = 0; i < section._size; i += 4)
+            std::reverse(data + i, data + i + 4);
+    }
+
+    return true;
+}
+
+namespace {
+    struct MergedSection {
+        uint32_t _type;
+        uint32_t _layer;
+        uint32_t _item;
+
+        std::vector<char> _data;
+    };
+
+    // Overwrite rows of a weight section with those of a delta section
+    bool applyDelta(std::vector<char> &weights, const char* delta, size_t size) {
+        ModelParser parser(delta, size);
+
+        int rowBytes = parser.getInt();
+        int numRuns = parser.getInt();
+
+        // Signs are checked first, the sizes are compared unsigned
+        if (!parser.good() || rowBytes <= 0 || numRuns < 0)
+            return false;
+
+        if (weights.size() % static_cast<size_t>(rowBytes) != 0 || static_cast<size_t>(numRuns) > (size - 8) / 8)
+            return false;
+
+        std::vector<int> runs(numRuns * 2);
+
+        parser.getInts(runs.data(), runs.size());
+
+        size_t numRows = weights.size() / rowBytes;
+
+        size_t offset = 8 + runs.size() * sizeof(int);
+
+        for (int r = 0; r < numRuns; r++) {
+            int first = runs[r * 2];
+            int count = runs[r * 2 + 1];
+
+            if (first < 0 || count < 0)
+                return false;
+
+            if (static_cast<size_t>(first) > numRows || static_cast<size_t>(count) > numRows - static_cast<size_t>(first))
+                return false;
+
+            size_t runBytes = static_cast<size_t>(count) * rowBytes;
+
+            if (runBytes > size - offset)
+                return false;
+
+            std::memcpy(weights.data() + static_cast<size_t>(first) * rowBytes, delta + offset, runBytes);
+
+            offset += runBytes;
+        }
+
+        return offset == size;
+    }
+}
+
+bool eogmaneo::mergeModelFiles(const std::vector<std::string> &fileNames, const std::string &fileName) {
+    std::vector<MergedSection> sections;
+
+    uint64_t id = 0;
+
+    for (size_t f = 0; f < fileNames.size(); f++) {
+        ModelReader reader;
+
+        uint64_t fileId, parentId;
+
+        if (!reader.map(fileNames[f]) || !reader.getCheckpoint(fileId, parentId))
+            return false;
+
+        // A full model first, then each delta applies to the checkpoint before it
+        if (parentId != (f == 0 ? 0 : id))
+            return false;
+
+        id = fileId;
+
+        for (size_t s = 0; s < reader.getNumSections(); s++) {
+            uint32_t type, layer, item;
+            size_t size;
+
+            const char* data = reader.getSection(s, type, layer, item, size);
+
+            // Written anew below
+            if (type == _sectionCheckpoint)
+                continue;
+
+            bool delta = type == _sectionFeedForwardDelta || type == _sectionFeedBackDelta;
+
+            if (delta)
+                type = type == _sectionFeedForwardDelta ? _sectionFeedForward : _sectionFeedBack;
+
+            size_t m = 0;
+
+            while (m < sections.size() && !(sections[m]._type == type && sections[m]._layer == layer && sections[m]._item == item))
+                m++;
+
+            if (delta) {
+                if (m == sections.size() || !applyDelta(sections[m]._data, data, size))
+                    return false;
+            }
+            else {
+                if (m == sections.size()) {
+                    sections.push_back(MergedSection());
+
+                    sections[m]._type = type;
+                    sections[m]._layer = layer;
+                    sections[m]._item = item;
+                }
+
+                sections[m]._data.assign(data, data + size);
+            }
+        }
+    }
+
+    if (sections.empty())
+        return false;
+
+    ModelBuffer checkpoint;
+
+    checkpoint.putUInt64(id);
+    checkpoint.putUInt64(0);
+
+    ModelWriter writer;
+
+    writer.addSection(_sectionCheckpoint, 0, 0, checkpoint.getBytes().data(), checkpoint.getBytes().size());
+
+    for (size_t m = 0; m < sections.size(); m++)
+        writer.addSection(sections[m]._type, sections[m]._layer, sections[m]._item, sections[m]._data.data(), sections[m]._data.size());
+
+    return writer.write(fileName);
+}
@@ -0,0 +1,415 @@
+// ----------------------------------------------------------------------------
+//  EOgmaNeo
+//  Copyright(c) 2017-2018 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of EOgmaNeo is licensed to you under the terms described
+//  in the EOGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace eogmaneo {
+    /*
+    Model file layout, all fields little-endian:
+
+    Header, 64 bytes
+        0   char[8] magic "EOGMANEO"
+        8   u32 version (_modelFileVersion)
+        12  u32 number of sections
+        16  u64 file size
+        24  u32 CRC-32C of the section table
+        28  u32 CRC-32C of bytes 0 to 27
+        32  zero padding
+
+    Section table at offset 64, 32 bytes per section
+        0   u32 type (ModelSectionType)
+        4   u32 layer index
+        8   u32 item index (visible layer for weights)
+        12  u32 CRC-32C of the section data
+        16  u64 offset, a multiple of 64
+        24  u64 size in bytes
+
+    Section data follows, each section starting 64-byte aligned, zero padded in between.
+    Weight sections hold a WeightMatrix buffer as it is in memory, padded rows included, so a mapped file can be used in place.
+
+    A delta checkpoint is a model file with all sections but the weights, which are replaced by delta sections holding the rows
+    changed since the checkpoint it applies to. Every checkpoint has a random id, mergeModelFiles(...) applies deltas to a full model.
+    */
+
+    /*!
+    \brief Version written by this library, files of other versions are rejected.
+    */
+    const uint32_t _modelFileVersion = 1;
+
+    /*!
+    \brief Kinds of sections in a model file.
+    */
+    enum ModelSectionType {
+        _sectionHierarchy = 0x52454948, // "HIER", hierarchy parameters and tick counters
+        _sectionHistory = 0x54534948, // "HIST", input history of a layer
+        _sectionLayer = 0x5259414c, // "LAYR", layer parameters and states
+        _sectionFeedForward = 0x5446464c, // "LFFT", feed forward weights of a visible layer
+        _sectionFeedBack = 0x5442464c, // "LFBT", feed back weights of a visible layer
+        _sectionCheckpoint = 0x54504b43, // "CKPT", u64 checkpoint id, u64 id of the checkpoint a delta applies to (0 for a full model)
+        _sectionFeedForwardDelta = 0x4446464c, // "LFFD", changed feed forward weight rows: i32 row size in bytes, i32 number of runs, runs of (i32 first row, i32 rows), then the rows of all runs
+        _sectionFeedBackDelta = 0x4442464c // "LFBD", changed feed back weight rows, as _sectionFeedForwardDelta
+    };
+
+    /*!
+    \brief CRC-32C (Castagnoli) of a buffer, continuing from crc (0 to start).
+    */
+    uint32_t crc32c(const void* data, size_t size, uint32_t crc = 0);
+
+    /*!
+    \brief Whether the host stores numbers little-endian, the file byte order.
+    */
+    bool hostIsLittleEndian();
+
+    /*!
+    \brief Appends little-endian fields to a byte buffer.
+    */
+    class ModelBuffer {
+    private:
+        std::vector<char> _bytes;
+
+    public:
+        void putInt(int x);
+        void putUInt64(uint64_t x);
+        void putFloat(float x);
+        void putInts(const int* x, size_t count);
+        void putFloats(const float* x, size_t count);
+
+        const std::vector<char> &getBytes() const {
+            return _bytes;
+        }
+
+        std::vector<char> &getBytes() {
+            return _bytes;
+        }
+    };
+
+    /*!
+    \brief Reads little-endian fields from a byte range.
+    Reading past the end fails the reader (fields read as 0), check good() once done.
+    */
+    class ModelParser {
+    private:
+        const char* _data;
+        size_t _size;
+        size_t _pos;
+        bool _good;
+
+        const char* take(size_t size);
+
+    public:
+        ModelParser(const char* data, size_t size)
+        : _data(data), _size(size), _pos(0), _good(true)
+        {}
+
+        int getInt();
+        uint64_t getUInt64();
+        float getFloat();
+        void getInts(int* x, size_t count);
+        void getFloats(float* x, size_t count);
+
+        /*!
+        \brief Read a count and check it against a limit, failing the reader if it is negative or larger.
+        */
+        int getCount(int maxCount);
+
+        bool good() const {
+            return _good;
+        }
+
+        /*!
+        \brief Mark the data as invalid (e.g. a value out of range).
+        */
+        void fail() {
+            _good = false;
+        }
+    };
+
+    /*!
+    \brief A file read and written at explicit offsets (pread/pwrite), so several threads can use it at once.
+    */
+    class PositionedFile {
+    private:
+        intptr_t _handle;
+
+    public:
+        PositionedFile()
+        : _handle(-1)
+        {}
+
+        PositionedFile(const PositionedFile &other) = delete;
+        PositionedFile &operator=(const PositionedFile &other) = delete;
+
+        ~PositionedFile() {
+            close();
+        }
+
+        /*!
+        \brief Open a file for reading, or create (truncate) it for writing.
+        */
+        bool open(const std::string &fileName, bool write);
+
+        /*!
+        \brief Close the file, false if pending writes failed.
+        */
+        bool close();
+
+        bool isOpen() const {
+            return _handle != -1;
+        }
+
+        //!@{
+        /*!
+        \brief Read or write size bytes at offset, false unless all of them were.
+        */
+        bool read(char* data, size_t size, uint64_t offset) const;
+        bool write(const char* data, size_t size, uint64_t offset) const;
+        //!@}
+
+        bool getSize(uint64_t &size) const;
+    };
+
+    /*!
+    \brief Collects sections and writes them as one model file.
+    Section data is referenced, not copied, so it must stay alive and unchanged until written.
+    */
+    class ModelWriter {
+    private:
+        struct Section {
+            uint32_t _type;
+            uint32_t _layer;
+            uint32_t _item;
+
+            const char* _data;
+            size_t _size;
+
+            // Set by beginWrite(...) and writeSection(...)
+            size_t _offset;
+            uint32_t _crc;
+        };
+
+        std::vector<Section> _sections;
+
+        // Byte swapped copies of sections when the host is big-endian
+        std::vector<std::vector<char>> _swapped;
+
+        // Copies of all sections made by snapshot(), kept for the next one
+        std::vector<char> _arena;
+
+        // File being written and its final name
+        PositionedFile _file;
+        std::string _fileName;
+        size_t _fileSize;
+
+    public:
+        ModelWriter()
+        : _fileSize(0)
+        {}
+
+        /*!
+        \brief Add a section of already little-endian bytes.
+        */
+        void addSection(uint32_t type, uint32_t layer, uint32_t item, const char* data, size_t size);
+
+        /*!
+        \brief Add a section of floats in host byte order.
+        */
+        void addFloatSection(uint32_t type, uint32_t layer, uint32_t item, const float* data, size_t count);
+
+        /*!
+        \brief Forget all sections, keeping the storage of the last snapshot for the next one.
+        */
+        void clear();
+
+        /*!
+        \brief Copy all sections into storage owned by the writer, so their sources can change (or go away) before they are written.
+        */
+        void snapshot();
+
+        /*!
+        \brief Write the header, the section table and all sections. Returns false if the file could not be written.
+        The file is written under a temporary name (fileName + ".tmp") and then renamed, so it is either the old or the complete new file.
+        */
+        bool write(const std::string &fileName);
+
+        //!@{
+        /*!
+        \brief Write in steps, like write(...): beginWrite, then writeSection for every section (from any thread, in any order), then endWrite.
+        Each step returns false on failure, endWrite(false) discards the file.
+        */
+        bool beginWrite(const std::string &fileName);
+
+        size_t getNumSections() const {
+            return _sections.size();
+        }
+
+        bool writeSection(size_t s);
+        bool endWrite(bool success = true);
+        //!@}
+    };
+
+    /*!
+    \brief A whole file mapped read-only into memory, shared with every other process mapping it. Unmapped when destroyed.
+    */
+    class MappedFile {
+    private:
+        const char* _data;
+        size_t _size;
+
+        void* _handle;
+
+    public:
+        MappedFile()
+        : _data(nullptr), _size(0), _handle(nullptr)
+        {}
+
+        MappedFile(const MappedFile &other) = delete;
+        MappedFile &operator=(const MappedFile &other) = delete;
+
+        ~MappedFile();
+
+        /*!
+        \brief Map a file. Returns false if it cannot be opened or mapped.
+        */
+        bool map(const std::string &fileName);
+
+        const char* getData() const {
+            return _data;
+        }
+
+        size_t getSize() const {
+            return _size;
+        }
+    };
+
+    /*!
+    \brief Reads a model file, its header and table checked.
+    Opened, it holds the small sections and reads weight sections straight into their destination on request. Mapped, it holds all sections.
+    */
+    class ModelReader {
+    private:
+        struct Section {
+            uint32_t _type;
+            uint32_t _layer;
+            uint32_t _item;
+            uint32_t _crc;
+
+            size_t _offset;
+            size_t _size;
+
+            // Contents, nullptr for weight sections of an opened file
+            const char* _data;
+        };
+
+        struct Request {
+            size_t _section;
+            float* _data;
+        };
+
+        // Header, table and small sections of an opened file
+        PositionedFile _file;
+        std::vector<char> _storage;
+
+        // File contents when mapped, the mapping is page aligned
+        std::shared_ptr<const MappedFile> _mapping;
+
+        size_t _size;
+
+        std::vector<Section> _sections;
+
+        std::vector<Request> _requests;
+
+        bool checkHeader(const char* header) const;
+        bool readTable(const char* header, const char* table);
+
+        const Section* findSection(uint32_t type, uint32_t layer, uint32_t item) const;
+
+    public:
+        ModelReader()
+        : _size(0)
+        {}
+
+        // Sections point into _storage or _mapping
+        ModelReader(const ModelReader &other) = delete;
+        ModelReader &operator=(const ModelReader &other) = delete;
+
+        /*!
+        \brief Whether a file starts with the model file magic (so is not a legacy file).
+        */
+        static bool isModelFile(const std::string &fileName);
+
+        /*!
+        \brief Open a file and read its header, table and all but the weight sections. Returns false if it cannot be read, is not a model file of this version, or is corrupt.
+        */
+        bool open(const std::string &fileName);
+
+        /*!
+        \brief Map and check a file, like open(...). Sections point into the mapping, which stays valid as long as getMapping() is held.
+        \param checkWeights whether weight section checksums are checked, which reads every page of them. Skip it when the file is known to be good.
+        */
+        bool map(const std::string &fileName, bool checkWeights = true);
+
+        /*!
+        \brief Get the mapping of a file opened with map(...), nullptr if the file was read.
+        */
+        const std::shared_ptr<const MappedFile> &getMapping() const {
+            return _mapping;
+        }
+
+        /*!
+        \brief Find a section the reader holds, nullptr (and size 0) if the file does not have it.
+        */
+        const char* getSection(uint32_t type, uint32_t layer, uint32_t item, size_t &size) const;
+
+        //!@{
+        /*!
+        \brief Enumerate sections, in file order (nullptr for those not held).
+        */
+        size_t getNumSections() const {
+            return _sections.size();
+        }
+
+        const char* getSection(size_t s, uint32_t &type, uint32_t &layer, uint32_t &item, size_t &size) const;
+        //!@}
+
+        /*!
+        \brief Read the checkpoint ids, false if the file has none (e.g. written before checkpoints were tracked).
+        */
+        bool getCheckpoint(uint64_t &id, uint64_t &parentId) const;
+
+        /*!
+        \brief Get a section of little-endian floats in host order, false if it is missing or not count floats long.
+        A held section is copied right away, otherwise the read is queued for readRequest(...).
+        */
+        bool requestFloatSection(uint32_t type, uint32_t layer, uint32_t item, float* data, size_t count);
+
+        //!@{
+        /*!
+        \brief Run queued section reads, from any thread and in any order. A read returns false if it fails or the data is corrupt.
+        */
+        size_t getNumRequests() const {
+            return _requests.size();
+        }
+
+        bool readRequest(size_t r) const;
+        //!@}
+    };
+
+    /*!
+    \brief Compact a full model file and delta checkpoints into a new full model file.
+    \param fileNames the full model first, then deltas in order, each applying to the checkpoint before it.
+    \param fileName the merged model, with the id of the last checkpoint so later deltas still apply to it.
+    Returns false if a file cannot be read, is corrupt or does not continue the chain.
+    */
+    bool mergeModelFiles(const std::vector<std::string> &fileNames, const std::string &fileName);
+}
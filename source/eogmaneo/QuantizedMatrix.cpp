@@ -0,0 +1,91 @@
+// ----------------------------------------------------------------------------
+//  EOgmaNeo
+//  Copyright(c) 2017-2018 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of EOgmaNeo is licensed to you under the terms described
+//  in the EOGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#include "QuantizedMatrix.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <assert.h>
+
+using namespace eogmaneo;
+
+void QuantizedMatrix::create(WeightPrecision precision, int numBlocks, int blockRows, int rowSize) {
+    assert(precision == _precisionHalf || precision == _precisionInt8);
+
+    _precision = precision;
+
+    _numBlocks = numBlocks;
+    _blockRows = blockRows;
+    _rowSize = rowSize;
+
+    size_t size = static_cast<size_t>(_numBlocks) * _blockRows * _rowSize;
+
+    if (_precision == _precisionHalf) {
+        _halves.assign(size, 0);
+        _bytes.clear();
+        _steps.clear();
+        _bases.clear();
+    }
+    else {
+        _halves.clear();
+        _bytes.assign(size, 0);
+        _steps.assign(static_cast<size_t>(_numBlocks) * _rowSize, 0.0f);
+        _bases.assign(_steps.size(), 0.0f);
+    }
+}
+
+void QuantizedMatrix::setBlock(int block, const float* weights, int cellStride, int weightStride) {
+    size_t start = static_cast<size_t>(block) * _blockRows * _rowSize;
+
+    for (int i = 0; i < _rowSize; i++) {
+        const float* cellWeights = weights + static_cast<size_t>(i) * cellStride;
+
+        if (_precision == _precisionHalf) {
+            for (int r = 0; r < _blockRows; r++)
+                _halves[start + static_cast<size_t>(r) * _rowSize + i] = floatToHalf(cellWeights[static_cast<size_t>(r) * weightStride]);
+
+            continue;
+        }
+
+        // Symmetric around the middle of the cell's range, so both ends are exact
+        float lower = cellWeights[0];
+        float upper = cellWeights[0];
+
+        for (int r = 1; r < _blockRows; r++) {
+            lower = std::min(lower, cellWeights[static_cast<size_t>(r) * weightStride]);
+            upper = std::max(upper, cellWeights[static_cast<size_t>(r) * weightStride]);
+        }
+
+        float base = lower * 0.5f + upper * 0.5f;
+        float step = (upper - lower) / 254.0f;
+
+        size_t cell = static_cast<size_t>(block) * _rowSize + i;
+
+        _steps[cell] = step;
+        _bases[cell] = base;
+
+        for (int r = 0; r < _blockRows; r++) {
+            float q = step > 0.0f ? std::round((cellWeights[static_cast<size_t>(r) * weightStride] - base) / step) : 0.0f;
+
+            _bytes[start + static_cast<size_t>(r) * _rowSize + i] = static_cast<int8_t>(std::min(127.0f, std::max(-127.0f, q)));
+        }
+    }
+}
+
+void QuantizedMatrix::accumulateRows(const Kernels &kernels, float* dst, int block, const int* rows, const float* scales, int count) const {
+    size_t start = static_cast<size_t>(block) * _blockRows * _rowSize;
+
+    if (_precision == _precisionHalf)
+        kernels._accumulateRowsHalf(dst, _halves.data() + start, rows, scales, count, _rowSize, _rowSize);
+    else {
+        size_t cell = static_cast<size_t>(block) * _rowSize;
+
+        kernels._accumulateRowsInt8(dst, _bytes.data() + start, _steps.data() + cell, _bases.data() + cell, rows, scales, count, _rowSize, _rowSize);
+    }
+}
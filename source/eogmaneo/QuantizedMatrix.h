@@ -0,0 +1,98 @@
+// ----------------------------------------------------------------------------
+//  EOgmaNeo
+//  Copyright(c) 2017-2018 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of EOgmaNeo is licensed to you under the terms described
+//  in the EOGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include "Kernels.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace eogmaneo {
+    /*!
+    \brief Precision of a layer's weights (see Hierarchy::freeze(...)).
+    */
+    enum WeightPrecision {
+        _precisionFloat = 0, // 32 bit floats, can learn
+        _precisionHalf = 1, // 16 bit floats
+        _precisionInt8 = 2 // 8 bit integers, with a step and base per cell
+    };
+
+    /*!
+    \brief Frozen weights at reduced precision, for inference only.
+    Weights are grouped in blocks, one per column of cells (a hidden column's feed forward weights, a visible column's feed back weights).
+    A block has a row per weight index holding that weight of all cells, so accumulating rows for a column reads contiguous memory.
+    With _precisionInt8 each cell of a block has its own range: weight = byte * step + base.
+    */
+    class QuantizedMatrix {
+    private:
+        WeightPrecision _precision;
+
+        int _numBlocks;
+        int _blockRows;
+        int _rowSize;
+
+        std::vector<uint16_t> _halves;
+        std::vector<int8_t> _bytes;
+
+        // Per block and cell, for _precisionInt8
+        std::vector<float> _steps;
+        std::vector<float> _bases;
+
+    public:
+        QuantizedMatrix()
+        : _precision(_precisionHalf), _numBlocks(0), _blockRows(0), _rowSize(0)
+        {}
+
+        /*!
+        \brief Allocate numBlocks blocks of blockRows rows of rowSize weights (cells).
+        \param precision _precisionHalf or _precisionInt8.
+        */
+        void create(WeightPrecision precision, int numBlocks, int blockRows, int rowSize);
+
+        /*!
+        \brief Quantize the weights of a block, weight r of cell i is weights[i * cellStride + r * weightStride].
+        */
+        void setBlock(int block, const float* weights, int cellStride, int weightStride);
+
+        /*!
+        \brief Get weight row of cell i, dequantized.
+        */
+        float get(int block, int row, int i) const {
+            size_t index = (static_cast<size_t>(block) * _blockRows + row) * _rowSize + i;
+
+            if (_precision == _precisionHalf)
+                return halfToFloat(_halves[index]);
+
+            size_t cell = static_cast<size_t>(block) * _rowSize + i;
+
+            return static_cast<float>(_bytes[index]) * _steps[cell] + _bases[cell];
+        }
+
+        /*!
+        \brief dst[i] += get(block, rows[k], i) * scales[k] (without scales if nullptr) for all cells, k = 0 .. count - 1 in that order.
+        */
+        void accumulateRows(const Kernels &kernels, float* dst, int block, const int* rows, const float* scales, int count) const;
+
+        WeightPrecision getPrecision() const {
+            return _precision;
+        }
+
+        bool empty() const {
+            return _numBlocks == 0;
+        }
+
+        /*!
+        \brief Get the number of bytes allocated.
+        */
+        size_t getMemorySize() const {
+            return _halves.size() * sizeof(uint16_t) + _bytes.size() + (_steps.size() + _bases.size()) * sizeof(float);
+        }
+    };
+}
@@ -0,0 +1,48 @@
+// ----------------------------------------------------------------------------
+//  EOgmaNeo
+//  Copyright(c) 2017-2018 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of EOgmaNeo is licensed to you under the terms described
+//  in the EOGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstdint>
+
+namespace eogmaneo {
+    /*!
+    \brief Philox4x32-10 counter-based random number generator (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3").
+    Maps a 128 bit counter and a 64 bit key to 4 random words, so any part of a stream can be generated on its own, on any thread and in any order.
+    */
+    inline void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t result[4]) {
+        uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+        uint32_t k0 = key[0], k1 = key[1];
+
+        for (int r = 0; r < 10; r++) {
+            uint64_t p0 = static_cast<uint64_t>(0xd2511f53u) * c0;
+            uint64_t p1 = static_cast<uint64_t>(0xcd9e8d57u) * c2;
+
+            c0 = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+            c1 = static_cast<uint32_t>(p1);
+            c2 = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+            c3 = static_cast<uint32_t>(p0);
+
+            // Weyl sequence key schedule
+            k0 += 0x9e3779b9u;
+            k1 += 0xbb67ae85u;
+        }
+
+        result[0] = c0;
+        result[1] = c1;
+        result[2] = c2;
+        result[3] = c3;
+    }
+
+    /*!
+    \brief Uniform float in [0, 1) from a random word, using its top 24 bits.
+    */
+    inline float uniformFloat(uint32_t x) {
+        return static_cast<float>(x >> 8) * (1.0f / 16777216.0f);
+    }
+}
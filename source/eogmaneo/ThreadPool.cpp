@@ -8,15 +8,63 @@
 
 #include "ThreadPool.h"
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define EOGMANEO_CPU_RELAX() _mm_pause()
+#else
+#define EOGMANEO_CPU_RELAX() std::this_thread::yield()
+#endif
+
 using namespace eogmaneo;
 
+template<typename Pred>
+bool ThreadPool::spinWait(const Pred &pred) const {
+	WaitPolicy policy = static_cast<WaitPolicy>(_waitPolicy.load());
+
+	if (policy == _block)
+		return pred();
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for (int i = 1;; i++) {
+		if (pred())
+			return true;
+
+		EOGMANEO_CPU_RELAX();
+
+		// Only look at the clock every so often
+		if (i % 64 == 0) {
+			if (policy == _spinThenBlock) {
+				if (std::chrono::steady_clock::now() - start >= std::chrono::microseconds(_spinMicroseconds))
+					return pred();
+			}
+			else if (i % 1024 == 0)
+				std::this_thread::yield(); // Do not starve the caller when oversubscribed
+		}
+	}
+}
+
+void RangeWorkItem::run(size_t threadIndex) {
+	_pPool->runRange(_rangeIndex, threadIndex);
+}
+
 void WorkerThread::run(WorkerThread* pWorker) {
+	ThreadPool* pPool = pWorker->_pPool;
+
 	while (true) {
-		std::unique_lock<std::mutex> lock(pWorker->_mutex);
+		// Spin first if the policy allows, then sleep
+		if (!pPool->spinWait([pWorker] { return static_cast<bool>(pWorker->_proceed); })) {
+			std::unique_lock<std::mutex> lock(pWorker->_mutex);
 
-		pWorker->_conditionVariable.wait(lock, [pWorker] { return static_cast<bool>(pWorker->_proceed); });
+			pWorker->_conditionVariable.wait(lock, [pWorker] { return static_cast<bool>(pWorker->_proceed); });
+		}
+
+		// Held while busy, so destroy waits for the current item
+		std::lock_guard<std::mutex> lock(pWorker->_mutex);
 
 		pWorker->_proceed = false;
 
@@ -26,51 +74,190 @@ void WorkerThread::run(WorkerThread* pWorker) {
 			if (pWorker->_item != nullptr) {
 				pWorker->_item->run(pWorker->_workerIndex);
 				pWorker->_item->_done = true;
+
+				pWorker->_pPool->onItemDone();
 			}
 
 			pWorker->_pPool->onWorkerAvailable(pWorker->_workerIndex);
 		}
+	}
+}
+
+void ThreadPool::onItemDone() {
+	// Last one out releases the waiter, unless it is still spinning
+	if (_numPending.fetch_sub(1) == 1 && _waiting) {
+		std::lock_guard<std::mutex> lock(_doneMutex);
 
-		pWorker->_conditionVariable.notify_one();
+		_doneCondition.notify_all();
 	}
 }
 
+void ThreadPool::pushAvailable(size_t workerIndex) {
+	_availableThreadIndicies[(_availableFront + _numAvailable) % _availableThreadIndicies.size()] = workerIndex;
+	_numAvailable++;
+}
+
+size_t ThreadPool::popAvailable() {
+	size_t workerIndex = _availableThreadIndicies[_availableFront];
+
+	_availableFront = (_availableFront + 1) % _availableThreadIndicies.size();
+	_numAvailable--;
+
+	return workerIndex;
+}
+
 void ThreadPool::onWorkerAvailable(size_t workerIndex) {
+	// Own deque first, then steal, without touching the pool mutex
+	if (_mode == _workStealing && takeItem(workerIndex))
+		return;
+
 	std::lock_guard<std::mutex> lock(_mutex);
 
-	if (_itemQueue.empty())
-		_availableThreadIndicies.push_back(workerIndex);
+	if (_mode == _workStealing) {
+		// Check again, addItem pushes to the deques while holding the pool mutex
+		if (!takeItem(workerIndex))
+			pushAvailable(workerIndex);
+	}
+	else if (_itemQueueFront == _itemQueue.size())
+		pushAvailable(workerIndex);
 	else {
 		// Assign new task
-		_workers[workerIndex]->_item = _itemQueue.front();
-		_itemQueue.pop_front();
+		_workers[workerIndex]->_item = std::move(_itemQueue[_itemQueueFront++]);
 		_workers[workerIndex]->_proceed = true;
+
+		// Reset once drained, or drop the consumed half, both keep the storage
+		if (_itemQueueFront == _itemQueue.size()) {
+			_itemQueue.clear();
+			_itemQueueFront = 0;
+		}
+		else if (_itemQueueFront * 2 >= _itemQueue.size()) {
+			_itemQueue.erase(_itemQueue.begin(), _itemQueue.begin() + _itemQueueFront);
+			_itemQueueFront = 0;
+		}
+	}
+}
+
+bool ThreadPool::popDeque(WorkerThread* pWorker, std::shared_ptr<WorkItem> &item, bool back) {
+	if (pWorker->_dequeSize == 0)
+		return false;
+
+	std::lock_guard<std::mutex> lock(pWorker->_dequeMutex);
+
+	if (pWorker->_dequeFront == pWorker->_deque.size())
+		return false;
+
+	if (back) {
+		item = std::move(pWorker->_deque.back());
+		pWorker->_deque.pop_back();
+	}
+	else
+		item = std::move(pWorker->_deque[pWorker->_dequeFront++]);
+
+	// Reset once drained, keeps the storage
+	if (pWorker->_dequeFront == pWorker->_deque.size()) {
+		pWorker->_deque.clear();
+		pWorker->_dequeFront = 0;
+	}
+
+	pWorker->_dequeSize--;
+
+	return true;
+}
+
+bool ThreadPool::takeItem(size_t workerIndex) {
+	WorkerThread* pWorker = _workers[workerIndex].get();
+
+	std::shared_ptr<WorkItem> item;
+
+	if (!popDeque(pWorker, item, true)) {
+		// Steal, starting from a random victim
+		size_t start = pWorker->_rng() % _workers.size();
+
+		for (size_t i = 0; i < _workers.size(); i++) {
+			size_t victimIndex = (start + i) % _workers.size();
+
+			if (victimIndex != workerIndex && popDeque(_workers[victimIndex].get(), item, false))
+				break;
+		}
+	}
+
+	if (item == nullptr)
+		return false;
+
+	pWorker->_item = item;
+	pWorker->_proceed = true;
+
+	return true;
+}
+
+void ThreadPool::runSubRange(size_t rangeIndex, size_t threadIndex) {
+	RangeWorkItem* pRange = _rangeItems[rangeIndex].get();
+
+	while (true) {
+		int chunkBegin = pRange->_next.fetch_add(_rangeGrain);
+
+		if (chunkBegin >= pRange->_end)
+			break;
+
+		_rangeFunc(_pRangeData, chunkBegin, std::min(pRange->_end, chunkBegin + _rangeGrain), threadIndex);
 	}
 }
 
-void ThreadPool::create(size_t numWorkers) {
+void ThreadPool::runRange(size_t rangeIndex, size_t threadIndex) {
+	// With a shared queue there is a single range all items claim from
+	size_t ownIndex = std::min(rangeIndex, _numRanges - 1);
+
+	runSubRange(ownIndex, threadIndex);
+
+	if (_numRanges > 1) {
+		// Steal chunks from the other ranges, starting from a random victim
+		size_t start = _workers[threadIndex]->_rng() % _numRanges;
+
+		for (size_t i = 0; i < _numRanges; i++) {
+			size_t victimIndex = (start + i) % _numRanges;
+
+			if (victimIndex != ownIndex)
+				runSubRange(victimIndex, threadIndex);
+		}
+	}
+}
+
+void ThreadPool::create(size_t numWorkers, SchedulingMode mode) {
+	_mode = mode;
+
 	_workers.resize(numWorkers);
+	_rangeItems.resize(numWorkers);
+
+	_availableThreadIndicies.assign(numWorkers, 0);
+	_availableFront = 0;
+	_numAvailable = 0;
+
+	// A parallelFor queues at most one range per worker, so the queues never grow past that while stepping
+	_itemQueue.reserve(numWorkers);
 
 	// Add all threads as available and launch threads
 	for (size_t i = 0; i < _workers.size(); i++) {
 		_workers[i].reset(new WorkerThread());
+		_workers[i]->_deque.reserve(numWorkers);
 
-		_availableThreadIndicies.push_back(i);
+		pushAvailable(i);
 
 		// Block all threads as there are no tasks yet
 		_workers[i]->_pPool = this;
 		_workers[i]->_workerIndex = i;
+		_workers[i]->_rng.seed(static_cast<unsigned long>(i + 1));
 
 		_workers[i]->start();
+
+		_rangeItems[i] = std::make_shared<RangeWorkItem>();
+		_rangeItems[i]->_pPool = this;
+		_rangeItems[i]->_rangeIndex = i;
 	}
 }
 
 void ThreadPool::destroy() {
 	//std::lock_guard<std::mutex> lock(_mutex);
 
-	_itemQueue.clear();
-	_availableThreadIndicies.clear();
-
 	for (size_t i = 0; i < _workers.size(); i++) {
 		{
 			std::lock_guard<std::mutex> lock(_workers[i]->_mutex);
@@ -82,15 +269,29 @@ void ThreadPool::destroy() {
 
 		_workers[i]->_thread->join();
 	}
+
+	// Workers may still have been registering themselves until joined
+	_itemQueue.clear();
+	_itemQueueFront = 0;
+	_availableFront = 0;
+	_numAvailable = 0;
+
+	for (size_t i = 0; i < _workers.size(); i++) {
+		_workers[i]->_deque.clear();
+		_workers[i]->_dequeFront = 0;
+		_workers[i]->_dequeSize = 0;
+	}
+
+	_numPending = 0;
 }
 
 void ThreadPool::addItem(const std::shared_ptr<WorkItem> &item) {
+	_numPending++;
+
 	std::lock_guard<std::mutex> lock(_mutex);
 
 	if (workersAvailable()) {
-		size_t workerIndex = _availableThreadIndicies.front();
-
-		_availableThreadIndicies.pop_front();
+		size_t workerIndex = popAvailable();
 
 		std::lock_guard<std::mutex> lock(_workers[workerIndex]->_mutex);
 
@@ -98,24 +299,66 @@ void ThreadPool::addItem(const std::shared_ptr<WorkItem> &item) {
 		_workers[workerIndex]->_proceed = true;
 		_workers[workerIndex]->_conditionVariable.notify_one();
 	}
+	else if (_mode == _workStealing) {
+		// Everyone is busy, spread over the deques
+		WorkerThread* pWorker = _workers[_nextDeque].get();
+
+		_nextDeque = (_nextDeque + 1) % _workers.size();
+
+		std::lock_guard<std::mutex> dequeLock(pWorker->_dequeMutex);
+
+		pWorker->_deque.push_back(item);
+		pWorker->_dequeSize++;
+	}
 	else
 		_itemQueue.push_back(item);
 }
 
 void ThreadPool::wait() {
-	// Try to aquire every mutex until no tasks are left
-	while (true) {
-		for (size_t i = 0; i < _workers.size(); i++) {
-			std::unique_lock<std::mutex> lock(_workers[i]->_mutex);
+	if (spinWait([this] { return _numPending == 0; }))
+		return;
 
-			WorkerThread* pWorker = _workers[i].get();
+	std::unique_lock<std::mutex> lock(_doneMutex);
 
-			_workers[i]->_conditionVariable.wait(lock, [pWorker] { return !pWorker->_proceed; });
-		}
+	_waiting = true;
 
-		std::lock_guard<std::mutex> lock(_mutex);
+	_doneCondition.wait(lock, [this] { return _numPending == 0; });
 
-		if (_itemQueue.empty())
-			break;
+	_waiting = false;
+}
+
+void ThreadPool::parallelFor(int begin, int end, int grain, void (*chunkFunc)(const void*, int, int, size_t), const void* pData) {
+	if (begin >= end)
+		return;
+
+	grain = std::max(1, grain);
+
+	// No workers, run on the calling thread
+	if (_workers.empty()) {
+		chunkFunc(pData, begin, end, 0);
+
+		return;
 	}
-}
\ No newline at end of file
+
+	size_t numChunks = (end - begin + grain - 1) / grain;
+
+	// Each item keeps claiming chunks until the range is exhausted
+	size_t numItems = std::min(_workers.size(), numChunks);
+
+	_rangeFunc = chunkFunc;
+	_pRangeData = pData;
+	_rangeGrain = grain;
+
+	// Work stealing splits the range into one contiguous sub-range per item
+	_numRanges = _mode == _workStealing ? numItems : 1;
+
+	for (size_t r = 0; r < _numRanges; r++) {
+		_rangeItems[r]->_next = begin + static_cast<int>(numChunks * r / _numRanges) * grain;
+		_rangeItems[r]->_end = std::min(end, begin + static_cast<int>(numChunks * (r + 1) / _numRanges) * grain);
+	}
+
+	for (size_t i = 0; i < numItems; i++)
+		addItem(_rangeItems[i]);
+
+	wait();
+}
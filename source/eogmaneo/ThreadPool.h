@@ -13,10 +13,27 @@
 #include <atomic>
 #include <condition_variable>
 #include <vector>
-#include <list>
 #include <memory>
+#include <random>
 
 namespace eogmaneo {
+	/*!
+	\brief How the thread pool distributes work items among its workers.
+	*/
+	enum SchedulingMode {
+		_sharedQueue = 0, // One queue shared by all workers
+		_workStealing = 1 // Per-worker deques, idle workers steal from random victims
+	};
+
+	/*!
+	\brief How idle workers and ThreadPool::wait wait for something to happen.
+	*/
+	enum WaitPolicy {
+		_block = 0, // Sleep on a condition variable right away
+		_spin = 1, // Busy wait, never sleep (occupies a core per worker)
+		_spinThenBlock = 2 // Busy wait up to the spin budget, then sleep
+	};
+
 	/*!
 	\brief Work item. Inherit from this to be able to add to thread pool.
 	*/
@@ -46,6 +63,28 @@ namespace eogmaneo {
 		friend class ThreadPool;
 		friend class WorkerThread;
 	};
+
+	/*!
+	\brief Range work item. Claims chunks of the pool's current parallel for range. For internal use.
+	*/
+	class RangeWorkItem : public WorkItem {
+	public:
+		class ThreadPool* _pPool;
+
+		size_t _rangeIndex;
+
+		// Sub-range owned by this item (work stealing), other items claim from it once theirs is exhausted
+		std::atomic_int _next;
+		int _end;
+
+		RangeWorkItem()
+			: _pPool(nullptr), _rangeIndex(0), _end(0)
+		{
+			_next = 0;
+		}
+
+		void run(size_t threadIndex) override;
+	};
 	
 	/*!
 	\brief Worker thread. For internal use.
@@ -62,13 +101,23 @@ namespace eogmaneo {
 
 		std::shared_ptr<class WorkItem> _item;
 
+		// Work stealing deque, the owner takes from the back, thieves from the front
+		std::mutex _dequeMutex;
+		std::vector<std::shared_ptr<class WorkItem>> _deque;
+		size_t _dequeFront;
+		std::atomic_int _dequeSize;
+
+		// Victim selection
+		std::minstd_rand _rng;
+
 		class ThreadPool* _pPool;
 		size_t _workerIndex;
 
 		WorkerThread()
-			: _pPool(nullptr), _workerIndex(0)
+			: _dequeFront(0), _pPool(nullptr), _workerIndex(0)
 		{
 			_proceed = false;
+			_dequeSize = 0;
 		}
 
 		void start() {
@@ -87,15 +136,76 @@ namespace eogmaneo {
 	private:
 		std::mutex _mutex;
 
+		SchedulingMode _mode;
+
+		// Completion latch, only the last finishing item takes the mutex (and only if someone sleeps on it)
+		std::atomic_int _numPending;
+		std::atomic_bool _waiting;
+		std::mutex _doneMutex;
+		std::condition_variable _doneCondition;
+
+		std::atomic_int _waitPolicy;
+		std::atomic_int _spinMicroseconds;
+
 		std::vector<std::unique_ptr<class WorkerThread>> _workers;
 
-		std::list<size_t> _availableThreadIndicies;
+		// Ring of idle workers, each worker is in it at most once
+		std::vector<size_t> _availableThreadIndicies;
+		size_t _availableFront;
+		size_t _numAvailable;
+
+		// Queue keeps its storage once grown, so steady state scheduling does not allocate
+		std::vector<std::shared_ptr<class WorkItem>> _itemQueue;
+		size_t _itemQueueFront;
 
-		std::list<std::shared_ptr<class WorkItem>> _itemQueue;
+		void pushAvailable(size_t workerIndex);
+		size_t popAvailable();
+
+		// Deque that receives the next item when all workers are busy (work stealing)
+		size_t _nextDeque;
+
+		// One reusable item per worker, so a parallel for does not allocate
+		std::vector<std::shared_ptr<class RangeWorkItem>> _rangeItems;
+
+		// Current parallel for range
+		void (*_rangeFunc)(const void*, int, int, size_t);
+		const void* _pRangeData;
+		int _rangeGrain;
+		size_t _numRanges;
 
 		void onWorkerAvailable(size_t workerIndex);
+		void onItemDone();
+
+		bool takeItem(size_t workerIndex);
+		bool popDeque(WorkerThread* pWorker, std::shared_ptr<class WorkItem> &item, bool back);
+
+		void runRange(size_t rangeIndex, size_t threadIndex);
+		void runSubRange(size_t rangeIndex, size_t threadIndex);
+
+		// Busy wait on pred according to the wait policy, returns whether pred became true
+		template<typename Pred>
+		bool spinWait(const Pred &pred) const;
+
+		template<typename Func>
+		static void runChunk(const void* pData, int begin, int end, size_t threadIndex) {
+			const Func &func = *static_cast<const Func*>(pData);
+
+			for (int i = begin; i < end; i++)
+				func(i, threadIndex);
+		}
+
+		void parallelFor(int begin, int end, int grain, void (*chunkFunc)(const void*, int, int, size_t), const void* pData);
 
 	public:
+		ThreadPool()
+			: _mode(_sharedQueue), _availableFront(0), _numAvailable(0), _itemQueueFront(0), _nextDeque(0), _rangeFunc(nullptr), _pRangeData(nullptr), _rangeGrain(1), _numRanges(0)
+		{
+			_numPending = 0;
+			_waiting = false;
+			_waitPolicy = _block;
+			_spinMicroseconds = 50;
+		}
+
 		~ThreadPool() {
 			destroy();
 		}
@@ -103,8 +213,9 @@ namespace eogmaneo {
 		/*!
 		\brief Create the pool.
 		\param numWorkers number of worker threads.
+		\param mode how items are distributed among the workers.
 		*/
-		void create(size_t numWorkers);
+		void create(size_t numWorkers, SchedulingMode mode = _sharedQueue);
 
 		/*!
 		\brief Destroy the thread pool.
@@ -121,7 +232,7 @@ namespace eogmaneo {
 		\brief Get number of currently unused worker threads.
 		*/
 		bool workersAvailable() const {
-			return !_availableThreadIndicies.empty();
+			return _numAvailable != 0;
 		}
 
 		/*!
@@ -131,11 +242,44 @@ namespace eogmaneo {
 			return _workers.size();
 		}
 
+		/*!
+		\brief Set how idle workers and wait() wait.
+		\param policy wait policy, _block by default.
+		\param spinMicroseconds how long to busy wait before sleeping with _spinThenBlock.
+		*/
+		void setWaitPolicy(WaitPolicy policy, int spinMicroseconds = 50) {
+			_waitPolicy = policy;
+			_spinMicroseconds = spinMicroseconds;
+		}
+
+		/*!
+		\brief Get the wait policy.
+		*/
+		WaitPolicy getWaitPolicy() const {
+			return static_cast<WaitPolicy>(_waitPolicy.load());
+		}
+
 		/*!
 		\brief Wait for all items to be processed.
+		Returns immediately if nothing is pending, otherwise sleeps until the last item completes.
 		*/
 		void wait();
+
+		/*!
+		\brief Run func(i, threadIndex) for every i in [begin, end) and wait for completion.
+		Workers claim contiguous chunks of grain indices at a time, no work items are allocated.
+		\param begin first index.
+		\param end one past the last index.
+		\param grain number of indices per chunk.
+		\param func function to run, called as func(int i, size_t threadIndex).
+		With work stealing, each worker starts on its own contiguous sub-range and then steals chunks from others.
+		*/
+		template<typename Func>
+		void parallelFor(int begin, int end, int grain, const Func &func) {
+			parallelFor(begin, end, grain, &ThreadPool::runChunk<Func>, &func);
+		}
 		
 		friend class WorkerThread;
+		friend class RangeWorkItem;
 	};
 }
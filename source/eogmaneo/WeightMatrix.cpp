@@ -0,0 +1,178 @@
+// ----------------------------------------------------------------------------
+//  EOgmaNeo
+//  Copyright(c) 2017-2018 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of EOgmaNeo is licensed to you under the terms described
+//  in the EOGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#include "WeightMatrix.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+using namespace eogmaneo;
+
+namespace {
+    float* alignedAlloc(size_t size) {
+        if (size == 0)
+            return nullptr;
+
+        void* p = nullptr;
+
+#ifdef _MSC_VER
+        p = _aligned_malloc(size, WeightMatrix::_alignment);
+#else
+        if (posix_memalign(&p, WeightMatrix::_alignment, size) != 0)
+            p = nullptr;
+#endif
+
+        if (p == nullptr)
+            throw std::bad_alloc();
+
+        return static_cast<float*>(p);
+    }
+
+    void alignedFree(float* p) {
+#ifdef _MSC_VER
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+    }
+}
+
+int WeightMatrix::paddedRowSize(int rowSize) {
+    const int floatsPerLine = _alignment / sizeof(float);
+
+    return (rowSize + floatsPerLine - 1) / floatsPerLine * floatsPerLine;
+}
+
+void WeightMatrix::release() {
+    if (!_view)
+        alignedFree(_data);
+
+    _data = nullptr;
+    _numRows = _rowSize = _rowStride = 0;
+    _view = false;
+}
+
+WeightMatrix::WeightMatrix(const WeightMatrix &other)
+: _data(nullptr), _numRows(0), _rowSize(0), _rowStride(0), _view(false)
+{
+    *this = other;
+}
+
+WeightMatrix::WeightMatrix(WeightMatrix &&other) noexcept
+: _data(other._data), _numRows(other._numRows), _rowSize(other._rowSize), _rowStride(other._rowStride), _view(other._view)
+{
+    other._data = nullptr;
+    other._numRows = other._rowSize = other._rowStride = 0;
+    other._view = false;
+}
+
+WeightMatrix &WeightMatrix::operator=(const WeightMatrix &other) {
+    if (this == &other)
+        return *this;
+
+    // Views share their memory
+    if (other._view) {
+        release();
+
+        _data = other._data;
+        _numRows = other._numRows;
+        _rowSize = other._rowSize;
+        _rowStride = other._rowStride;
+        _view = true;
+
+        return *this;
+    }
+
+    if (_view || getMemorySize() != other.getMemorySize()) {
+        release();
+
+        _data = alignedAlloc(other.getMemorySize());
+    }
+
+    _numRows = other._numRows;
+    _rowSize = other._rowSize;
+    _rowStride = other._rowStride;
+
+    if (_data != nullptr)
+        std::copy(other._data, other._data + static_cast<size_t>(_numRows) * _rowStride, _data);
+
+    return *this;
+}
+
+WeightMatrix &WeightMatrix::operator=(WeightMatrix &&other) noexcept {
+    if (this == &other)
+        return *this;
+
+    release();
+
+    _data = other._data;
+    _numRows = other._numRows;
+    _rowSize = other._rowSize;
+    _rowStride = other._rowStride;
+    _view = other._view;
+
+    other._data = nullptr;
+    other._numRows = other._rowSize = other._rowStride = 0;
+    other._view = false;
+
+    return *this;
+}
+
+void WeightMatrix::create(int numRows, int rowSize) {
+    int rowStride = paddedRowSize(rowSize);
+
+    if (_view || static_cast<size_t>(numRows) * rowStride != static_cast<size_t>(_numRows) * _rowStride) {
+        release();
+
+        _data = alignedAlloc(static_cast<size_t>(numRows) * rowStride * sizeof(float));
+    }
+
+    _numRows = numRows;
+    _rowSize = rowSize;
+    _rowStride = rowStride;
+
+    // Padding is zeroed too, so whole rows can be processed safely
+    if (_data != nullptr)
+        std::fill(_data, _data + static_cast<size_t>(_numRows) * _rowStride, 0.0f);
+}
+
+bool WeightMatrix::createView(const float* data, size_t size, int numRows, int rowSize) {
+    release();
+
+    int rowStride = paddedRowSize(rowSize);
+
+    if (reinterpret_cast<uintptr_t>(data) % _alignment != 0 || size != static_cast<size_t>(numRows) * rowStride * sizeof(float))
+        return false;
+
+    _data = const_cast<float*>(data);
+    _numRows = numRows;
+    _rowSize = rowSize;
+    _rowStride = rowStride;
+    _view = true;
+
+    return true;
+}
+
+void WeightMatrix::makePrivate() {
+    if (!_view)
+        return;
+
+    float* data = alignedAlloc(getMemorySize());
+
+    if (data != nullptr)
+        std::copy(_data, _data + static_cast<size_t>(_numRows) * _rowStride, data);
+
+    _data = data;
+    _view = false;
+}
@@ -0,0 +1,157 @@
+// ----------------------------------------------------------------------------
+//  EOgmaNeo
+//  Copyright(c) 2017-2018 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of EOgmaNeo is licensed to you under the terms described
+//  in the EOGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstddef>
+
+namespace eogmaneo {
+    /*!
+    \brief Read-only view of a strided run of weights, e.g. all weights of a single cell.
+    */
+    struct WeightView {
+        const float* _data;
+        int _size;
+        int _stride;
+
+        WeightView()
+        : _data(nullptr), _size(0), _stride(1)
+        {}
+
+        WeightView(const float* data, int size, int stride)
+        : _data(data), _size(size), _stride(stride)
+        {}
+
+        float operator[](int i) const {
+            return _data[static_cast<size_t>(i) * _stride];
+        }
+
+        int size() const {
+            return _size;
+        }
+    };
+
+    /*!
+    \brief Dense matrix of weights.
+    All rows live in a single 64-byte aligned buffer, each row padded to a multiple of 64 bytes.
+    The buffer is either owned, or a view of read-only memory owned elsewhere (see createView(...)).
+    */
+    class WeightMatrix {
+    private:
+        float* _data;
+
+        int _numRows;
+        int _rowSize;
+        int _rowStride;
+
+        // Whether _data is a view, not freed and never written to
+        bool _view;
+
+        static int paddedRowSize(int rowSize);
+
+        void release();
+
+    public:
+        /*!
+        \brief Alignment (in bytes) of the buffer and of every row.
+        */
+        static const int _alignment = 64;
+
+        WeightMatrix()
+        : _data(nullptr), _numRows(0), _rowSize(0), _rowStride(0), _view(false)
+        {}
+
+        WeightMatrix(const WeightMatrix &other);
+        WeightMatrix(WeightMatrix &&other) noexcept;
+
+        ~WeightMatrix() {
+            release();
+        }
+
+        WeightMatrix &operator=(const WeightMatrix &other);
+        WeightMatrix &operator=(WeightMatrix &&other) noexcept;
+
+        /*!
+        \brief Allocate numRows rows of rowSize floats, zero initialized.
+        */
+        void create(int numRows, int rowSize);
+
+        /*!
+        \brief View numRows rows of rowSize floats laid out as create(...) lays them out, in memory that outlives the matrix (e.g. a mapped model file).
+        The memory may be read-only, so a view must not be written to. Copies of a view are views of the same memory.
+        Returns false (leaving the matrix empty) if data is not 64-byte aligned or size (in bytes) does not match the layout.
+        */
+        bool createView(const float* data, size_t size, int numRows, int rowSize);
+
+        /*!
+        \brief Replace a view with an owned copy of its weights, so they can be written to. Does nothing to an owned buffer.
+        */
+        void makePrivate();
+
+        /*!
+        \brief Free the buffer.
+        */
+        void clear() {
+            release();
+        }
+
+        //!@{
+        /*!
+        \brief Get a row.
+        */
+        float* getRow(int row) {
+            return _data + static_cast<size_t>(row) * _rowStride;
+        }
+
+        const float* getRow(int row) const {
+            return _data + static_cast<size_t>(row) * _rowStride;
+        }
+        //!@}
+
+        //!@{
+        /*!
+        \brief Get dimensions.
+        */
+        int getNumRows() const {
+            return _numRows;
+        }
+
+        int getRowSize() const {
+            return _rowSize;
+        }
+        //!@}
+
+        /*!
+        \brief Get the distance (in floats) between the starts of consecutive rows.
+        */
+        int getRowStride() const {
+            return _rowStride;
+        }
+
+        /*!
+        \brief Whether the matrix holds no rows.
+        */
+        bool empty() const {
+            return _numRows == 0;
+        }
+
+        /*!
+        \brief Whether the matrix is a view of memory it does not own.
+        */
+        bool isView() const {
+            return _view;
+        }
+
+        /*!
+        \brief Get the number of bytes allocated, including padding.
+        */
+        size_t getMemorySize() const {
+            return static_cast<size_t>(_numRows) * _rowStride * sizeof(float);
+        }
+    };
+}
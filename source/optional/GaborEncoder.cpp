@@ -9,20 +9,13 @@
 #include "GaborEncoder.h"
 
 #include "Layer.h"
+#include "Kernels.h"
 
 #include <algorithm>
 #include <fstream>
 
 using namespace eogmaneo;
 
-void GaborEncoderActivateWorkItem::run(size_t threadIndex) {
-	_pEncoder->activate(_cx, _cy);
-}
-
-void GaborEncoderReconstructWorkItem::run(size_t threadIndex) {
-	_pEncoder->reconstruct(_cx, _cy);
-}
-
 void GaborEncoder::create(int inputWidth, int inputHeight, int hiddenWidth, int hiddenHeight, int columnSize, int radius,
     unsigned long seed, float sigma, float lam)
 {
@@ -79,18 +72,11 @@ void GaborEncoder::create(int inputWidth, int inputHeight, int hiddenWidth, int
 const std::vector<int> &GaborEncoder::activate(ComputeSystem &cs, const std::vector<float> &inputs) {
 	_inputs = inputs;
 
-    for (int cx = 0; cx < _hiddenWidth; cx++)
-        for (int cy = 0; cy < _hiddenHeight; cy++) {
-            std::shared_ptr<GaborEncoderActivateWorkItem> item = std::make_shared<GaborEncoderActivateWorkItem>();
+    cs.reserveScratch(_columnSize);
 
-            item->_pEncoder = this;
-            item->_cx = cx;
-            item->_cy = cy;
-            
-            cs._pool.addItem(item);
-        }
-        
-    cs._pool.wait();
+    cs._pool.parallelFor(0, _hiddenWidth * _hiddenHeight, 8, [this, &cs](int i, size_t threadIndex) {
+        activate(i % _hiddenWidth, i / _hiddenWidth, cs.getScratch(threadIndex));
+    });
 
     return _hiddenStates;
 }
@@ -104,18 +90,9 @@ const std::vector<float> &GaborEncoder::reconstruct(ComputeSystem &cs, const std
 	_counts.clear();
 	_counts.assign(_inputWidth * _inputHeight, 0.0f);
 	
-    for (int cx = 0; cx < _hiddenWidth; cx++)
-        for (int cy = 0; cy < _hiddenHeight; cy++) {
-            std::shared_ptr<GaborEncoderReconstructWorkItem> item = std::make_shared<GaborEncoderReconstructWorkItem>();
-
-			item->_pEncoder = this;
-            item->_cx = cx;
-			item->_cy = cy;
-			
-			cs._pool.addItem(item);
-        }
-		
-	cs._pool.wait();
+    cs._pool.parallelFor(0, _hiddenWidth * _hiddenHeight, 8, [this](int i, size_t threadIndex) {
+        reconstruct(i % _hiddenWidth, i / _hiddenWidth);
+    });
 	
 	// Rescale
 	for (int i = 0; i < _recons.size(); i++)
@@ -124,13 +101,15 @@ const std::vector<float> &GaborEncoder::reconstruct(ComputeSystem &cs, const std
     return _recons;
 }
 
-void GaborEncoder::activate(int cx, int cy) {
+void GaborEncoder::activate(int cx, int cy, float* scratch) {
     int diam = _radius * 2 + 1;
     int weightsPerUnit = diam * diam;
 
     int maxCellIndex = 0;
     float maxValue = -99999.0f;
 
+    const Kernels &kernels = getKernels();
+
     // Projection
     float toInputX = static_cast<float>(_inputWidth) / static_cast<float>(_hiddenWidth);
     float toInputY = static_cast<float>(_inputHeight) / static_cast<float>(_hiddenHeight);
@@ -141,24 +120,27 @@ void GaborEncoder::activate(int cx, int cy) {
     int lowerX = centerX - _radius;
     int lowerY = centerY - _radius;
 
-    for (int c = 0; c < _columnSize; c++) {
-        // Compute value
-        float value = 0.0f;
+    // Compute values of all cells at once, one input at a time
+    float* values = scratch;
 
-        for (int sx = 0; sx < diam; sx++)
-            for (int sy = 0; sy < diam; sy++) {
-                int index = sx + sy * diam;
+    std::fill(values, values + _columnSize, 0.0f);
 
-                int vx = lowerX + sx;
-                int vy = lowerY + sy;
+    for (int sx = 0; sx < diam; sx++)
+        for (int sy = 0; sy < diam; sy++) {
+            int index = sx + sy * diam;
 
-                if (vx >= 0 && vy >= 0 && vx < _inputWidth && vy < _inputHeight) {
-                    int wi = index + weightsPerUnit * c;
-                    int ii = vx + vy * _inputWidth;
+            int vx = lowerX + sx;
+            int vy = lowerY + sy;
 
-                    value += _inputs[ii] * _weights[wi];
-                }
+            if (vx >= 0 && vy >= 0 && vx < _inputWidth && vy < _inputHeight) {
+                int ii = vx + vy * _inputWidth;
+
+                kernels._accumulateScaled(values, &_weights[index], weightsPerUnit, _inputs[ii], _columnSize);
             }
+        }
+
+    for (int c = 0; c < _columnSize; c++) {
+        float value = values[c];
 
         if (value > maxValue) {
             maxValue = value;
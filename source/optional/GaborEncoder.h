@@ -13,40 +13,6 @@
 #include <random>
 
 namespace eogmaneo {
-	class GaborEncoder;
-	
-    /*!
-    \brief Image encoder work item. Internal use only.
-    */
-	class GaborEncoderActivateWorkItem : public WorkItem {
-	public:
-		GaborEncoder* _pEncoder;
-
-		int _cx, _cy;
-
-		GaborEncoderActivateWorkItem()
-			: _pEncoder(nullptr)
-		{}
-
-		void run(size_t threadIndex) override;
-	};
-	
-    /*!
-    \brief Image decoder work item. Internal use only.
-    */
-	class GaborEncoderReconstructWorkItem : public WorkItem {
-	public:
-		GaborEncoder* _pEncoder;
-
-		int _cx, _cy;
-
-		GaborEncoderReconstructWorkItem()
-			: _pEncoder(nullptr)
-		{}
-
-		void run(size_t threadIndex) override;
-	};
-	
     /*!
     \brief Encoders values to a chunked SDR through random transformation.
     */
@@ -61,7 +27,7 @@ namespace eogmaneo {
 
         std::vector<float> _weights;
 
-		void activate(int cx, int cy);
+		void activate(int cx, int cy, float* scratch);
 		void reconstruct(int cx, int cy);
 
 		std::vector<int> _reconHiddenStates;
@@ -148,9 +114,5 @@ namespace eogmaneo {
         const std::vector<float> &getWeights() const {
             return _weights;
         }
-		
-		friend class GaborEncoderActivateWorkItem;
-		friend class GaborEncoderReconstructWorkItem;
-        friend class GaborEncoderLearnWorkItem;
     };
 }
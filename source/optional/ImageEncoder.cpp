@@ -9,20 +9,13 @@
 #include "ImageEncoder.h"
 
 #include "Layer.h"
+#include "Kernels.h"
 
 #include <algorithm>
 #include <fstream>
 
 using namespace eogmaneo;
 
-void ImageEncoderActivateWorkItem::run(size_t threadIndex) {
-	_pEncoder->activate(_cx, _cy);
-}
-
-void ImageEncoderLearnWorkItem::run(size_t threadIndex) {
-    _pEncoder->learn(_cx, _cy, _beta);
-}
-
 void ImageEncoder::create(int inputWidth, int inputHeight, int hiddenWidth, int hiddenHeight, int columnSize, int radius,
     unsigned long seed)
 {
@@ -61,45 +54,30 @@ void ImageEncoder::create(int inputWidth, int inputHeight, int hiddenWidth, int
 const std::vector<int> &ImageEncoder::activate(ComputeSystem &cs, const std::vector<float> &inputs) {
 	_inputs = inputs;
 
-    for (int cx = 0; cx < _hiddenWidth; cx++)
-        for (int cy = 0; cy < _hiddenHeight; cy++) {
-            std::shared_ptr<ImageEncoderActivateWorkItem> item = std::make_shared<ImageEncoderActivateWorkItem>();
+    cs.reserveScratch(_columnSize);
 
-            item->_pEncoder = this;
-            item->_cx = cx;
-            item->_cy = cy;
-            
-            cs._pool.addItem(item);
-        }
-        
-    cs._pool.wait();
+    cs._pool.parallelFor(0, _hiddenWidth * _hiddenHeight, 8, [this, &cs](int i, size_t threadIndex) {
+        activate(i % _hiddenWidth, i / _hiddenWidth, cs.getScratch(threadIndex));
+    });
 
     return _hiddenStates;
 }
 
 void ImageEncoder::learn(ComputeSystem &cs, float beta) {
-    for (int cx = 0; cx < _hiddenWidth; cx++)
-        for (int cy = 0; cy < _hiddenHeight; cy++) {
-            std::shared_ptr<ImageEncoderLearnWorkItem> item = std::make_shared<ImageEncoderLearnWorkItem>();
-
-            item->_pEncoder = this;
-            item->_cx = cx;
-            item->_cy = cy;
-            item->_beta = beta;
-
-            cs._pool.addItem(item);
-        }
-
-    cs._pool.wait();
+    cs._pool.parallelFor(0, _hiddenWidth * _hiddenHeight, 8, [this, beta](int i, size_t threadIndex) {
+        learn(i % _hiddenWidth, i / _hiddenWidth, beta);
+    });
 }
 
-void ImageEncoder::activate(int cx, int cy) {
+void ImageEncoder::activate(int cx, int cy, float* scratch) {
     int diam = _radius * 2 + 1;
     int weightsPerUnit = diam * diam;
 
     int maxCellIndex = 0;
     float maxValue = -99999.0f;
 
+    const Kernels &kernels = getKernels();
+
     // Projection
     float toInputX = static_cast<float>(_inputWidth) / static_cast<float>(_hiddenWidth);
     float toInputY = static_cast<float>(_inputHeight) / static_cast<float>(_hiddenHeight);
@@ -110,26 +88,37 @@ void ImageEncoder::activate(int cx, int cy) {
     int lowerX = centerX - _radius;
     int lowerY = centerY - _radius;
 
-    for (int c = 0; c < _columnSize; c++) {
-        int ui = cx + cy * _hiddenWidth + c * _hiddenWidth * _hiddenHeight;
+    int hiddenColumnIndex = cx + cy * _hiddenWidth;
+
+    // Units of this column are hiddenWidth * hiddenHeight apart
+    int unitStride = _hiddenWidth * _hiddenHeight;
+
+    // Compute values of all cells at once, one input at a time
+    float* values = scratch;
+
+    for (int c = 0; c < _columnSize; c++)
+        values[c] = _biases[hiddenColumnIndex + c * unitStride];
 
-        // Compute value
-        float value = _biases[ui];
+    const float* columnWeights = &_weights[weightsPerUnit * hiddenColumnIndex];
 
-        for (int sx = 0; sx < diam; sx++)
-            for (int sy = 0; sy < diam; sy++) {
-                int index = sx + sy * diam;
+    for (int sx = 0; sx < diam; sx++)
+        for (int sy = 0; sy < diam; sy++) {
+            int index = sx + sy * diam;
 
-                int vx = lowerX + sx;
-                int vy = lowerY + sy;
+            int vx = lowerX + sx;
+            int vy = lowerY + sy;
 
-                if (vx >= 0 && vy >= 0 && vx < _inputWidth && vy < _inputHeight) {
-                    int wi = index + weightsPerUnit * ui;
-                    int ii = vx + vy * _inputWidth;
+            if (vx >= 0 && vy >= 0 && vx < _inputWidth && vy < _inputHeight) {
+                int ii = vx + vy * _inputWidth;
 
-                    value += _inputs[ii] * _weights[wi];
-                }
+                kernels._accumulateScaled(values, columnWeights + index, weightsPerUnit * unitStride, _inputs[ii], _columnSize);
             }
+        }
+
+    for (int c = 0; c < _columnSize; c++) {
+        int ui = hiddenColumnIndex + c * unitStride;
+
+        float value = values[c];
 
         _hiddenActivations[ui] = value;
 
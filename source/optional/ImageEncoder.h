@@ -13,42 +13,6 @@
 #include <random>
 
 namespace eogmaneo {
-	class ImageEncoder;
-	
-    /*!
-    \brief Image encoder work item. Internal use only.
-    */
-	class ImageEncoderActivateWorkItem : public WorkItem {
-	public:
-		ImageEncoder* _pEncoder;
-
-		int _cx, _cy;
-
-		ImageEncoderActivateWorkItem()
-			: _pEncoder(nullptr)
-		{}
-
-		void run(size_t threadIndex) override;
-	};
-	
-    /*!
-    \brief Image learn work item. Internal use only.
-    */
-    class ImageEncoderLearnWorkItem : public WorkItem {
-    public:
-        ImageEncoder* _pEncoder;
-
-        int _cx, _cy;
-
-        float _beta;
-
-        ImageEncoderLearnWorkItem()
-            : _pEncoder(nullptr)
-        {}
-
-        void run(size_t threadIndex) override;
-    };
-	
     /*!
     \brief Encoders values to a columnar SDR through random transformation.
     */
@@ -65,7 +29,7 @@ namespace eogmaneo {
         std::vector<float> _weights;
         std::vector<float> _biases;
 
-		void activate(int cx, int cy);
+		void activate(int cx, int cy, float* scratch);
 		void reconstruct(int cx, int cy);
         void learn(int cx, int cy, float beta);
 
@@ -145,9 +109,5 @@ namespace eogmaneo {
         const std::vector<int> &getHiddenStates() const {
             return _hiddenStates;
         }
-		
-		friend class ImageEncoderActivateWorkItem;
-		friend class ImageEncoderReconstructWorkItem;
-        friend class ImageEncoderLearnWorkItem;
     };
 }
@@ -9,24 +9,13 @@
 #include "KMeansEncoder.h"
 
 #include "Layer.h"
+#include "Kernels.h"
 
 #include <algorithm>
 #include <fstream>
 
 using namespace eogmaneo;
 
-void KMeansEncoderActivateWorkItem::run(size_t threadIndex) {
-	_pEncoder->activate(_cx, _cy);
-}
-
-void KMeansEncoderReconstructWorkItem::run(size_t threadIndex) {
-	_pEncoder->reconstruct(_cx, _cy);
-}
-
-void KMeansEncoderLearnWorkItem::run(size_t threadIndex) {
-    _pEncoder->learn(_cx, _cy, _alpha);
-}
-
 void KMeansEncoder::create(int inputWidth, int inputHeight, int hiddenWidth, int hiddenHeight, int columnSize, int radius,
     float initMinWeight, float initMaxWeight,
     unsigned long seed)
@@ -63,18 +52,11 @@ void KMeansEncoder::create(int inputWidth, int inputHeight, int hiddenWidth, int
 const std::vector<int> &KMeansEncoder::activate(ComputeSystem &cs, const std::vector<float> &inputs) {
 	_inputs = inputs;
 
-    for (int cx = 0; cx < _hiddenWidth; cx++)
-        for (int cy = 0; cy < _hiddenHeight; cy++) {
-            std::shared_ptr<KMeansEncoderActivateWorkItem> item = std::make_shared<KMeansEncoderActivateWorkItem>();
+    cs.reserveScratch(_columnSize);
 
-            item->_pEncoder = this;
-            item->_cx = cx;
-            item->_cy = cy;
-            
-            cs._pool.addItem(item);
-        }
-        
-    cs._pool.wait();
+    cs._pool.parallelFor(0, _hiddenWidth * _hiddenHeight, 8, [this, &cs](int i, size_t threadIndex) {
+        activate(i % _hiddenWidth, i / _hiddenWidth, cs.getScratch(threadIndex));
+    });
 
     return _hiddenStates;
 }
@@ -88,18 +70,9 @@ const std::vector<float> &KMeansEncoder::reconstruct(ComputeSystem &cs, const st
 	_counts.clear();
 	_counts.assign(_inputWidth * _inputHeight, 0.0f);
 	
-    for (int cx = 0; cx < _hiddenWidth; cx++)
-        for (int cy = 0; cy < _hiddenHeight; cy++) {
-            std::shared_ptr<KMeansEncoderReconstructWorkItem> item = std::make_shared<KMeansEncoderReconstructWorkItem>();
-
-			item->_pEncoder = this;
-            item->_cx = cx;
-			item->_cy = cy;
-			
-			cs._pool.addItem(item);
-        }
-		
-	cs._pool.wait();
+    cs._pool.parallelFor(0, _hiddenWidth * _hiddenHeight, 8, [this](int i, size_t threadIndex) {
+        reconstruct(i % _hiddenWidth, i / _hiddenWidth);
+    });
 	
 	// Rescale
 	for (int i = 0; i < _recons.size(); i++)
@@ -109,28 +82,20 @@ const std::vector<float> &KMeansEncoder::reconstruct(ComputeSystem &cs, const st
 }
 
 void KMeansEncoder::learn(ComputeSystem &cs, float alpha) {
-    for (int cx = 0; cx < _hiddenWidth; cx++)
-        for (int cy = 0; cy < _hiddenHeight; cy++) {
-            std::shared_ptr<KMeansEncoderLearnWorkItem> item = std::make_shared<KMeansEncoderLearnWorkItem>();
-
-            item->_pEncoder = this;
-            item->_cx = cx;
-            item->_cy = cy;
-            item->_alpha = alpha;
-
-            cs._pool.addItem(item);
-        }
-
-    cs._pool.wait();
+    cs._pool.parallelFor(0, _hiddenWidth * _hiddenHeight, 8, [this, alpha](int i, size_t threadIndex) {
+        learn(i % _hiddenWidth, i / _hiddenWidth, alpha);
+    });
 }
 
-void KMeansEncoder::activate(int cx, int cy) {
+void KMeansEncoder::activate(int cx, int cy, float* scratch) {
     int diam = _radius * 2 + 1;
     int weightsPerUnit = diam * diam;
 
     int maxCellIndex = 0;
     float maxValue = -99999.0f;
 
+    const Kernels &kernels = getKernels();
+
     // Projection
     float toInputX = static_cast<float>(_inputWidth) / static_cast<float>(_hiddenWidth);
     float toInputY = static_cast<float>(_inputHeight) / static_cast<float>(_hiddenHeight);
@@ -141,28 +106,34 @@ void KMeansEncoder::activate(int cx, int cy) {
     int lowerX = centerX - _radius;
     int lowerY = centerY - _radius;
 
-    for (int c = 0; c < _columnSize; c++) {
-        int ui = cx + cy * _hiddenWidth + c * _hiddenWidth * _hiddenHeight;
+    int hiddenColumnIndex = cx + cy * _hiddenWidth;
 
-        // Compute value
-        float value = 0.0f;
+    // Units of this column are hiddenWidth * hiddenHeight apart
+    int unitStride = _hiddenWidth * _hiddenHeight;
 
-        for (int sx = 0; sx < diam; sx++)
-            for (int sy = 0; sy < diam; sy++) {
-                int index = sx + sy * diam;
+    // Compute values of all cells at once, one input at a time
+    float* values = scratch;
 
-                int vx = lowerX + sx;
-                int vy = lowerY + sy;
+    std::fill(values, values + _columnSize, 0.0f);
 
-                if (vx >= 0 && vy >= 0 && vx < _inputWidth && vy < _inputHeight) {
-                    int wi = index + weightsPerUnit * ui;
-                    int ii = vx + vy * _inputWidth;
+    const float* columnWeights = &_weights[weightsPerUnit * hiddenColumnIndex];
 
-                    float d = _inputs[ii] - _weights[wi];
-                    
-                    value += -d * d;
-                }
+    for (int sx = 0; sx < diam; sx++)
+        for (int sy = 0; sy < diam; sy++) {
+            int index = sx + sy * diam;
+
+            int vx = lowerX + sx;
+            int vy = lowerY + sy;
+
+            if (vx >= 0 && vy >= 0 && vx < _inputWidth && vy < _inputHeight) {
+                int ii = vx + vy * _inputWidth;
+
+                kernels._accumulateNegSquaredDistance(values, columnWeights + index, weightsPerUnit * unitStride, _inputs[ii], _columnSize);
             }
+        }
+
+    for (int c = 0; c < _columnSize; c++) {
+        float value = values[c];
 
         if (value > maxValue) {
             maxValue = value;
@@ -13,58 +13,6 @@
 #include <random>
 
 namespace eogmaneo {
-	class KMeansEncoder;
-	
-    /*!
-    \brief Image encoder work item. Internal use only.
-    */
-	class KMeansEncoderActivateWorkItem : public WorkItem {
-	public:
-		KMeansEncoder* _pEncoder;
-
-		int _cx, _cy;
-
-		KMeansEncoderActivateWorkItem()
-			: _pEncoder(nullptr)
-		{}
-
-		void run(size_t threadIndex) override;
-	};
-	
-    /*!
-    \brief Image decoder work item. Internal use only.
-    */
-	class KMeansEncoderReconstructWorkItem : public WorkItem {
-	public:
-		KMeansEncoder* _pEncoder;
-
-		int _cx, _cy;
-
-		KMeansEncoderReconstructWorkItem()
-			: _pEncoder(nullptr)
-		{}
-
-		void run(size_t threadIndex) override;
-	};
-
-    /*!
-    \brief Image learn work item. Internal use only.
-    */
-    class KMeansEncoderLearnWorkItem : public WorkItem {
-    public:
-        KMeansEncoder* _pEncoder;
-
-        int _cx, _cy;
-
-        float _alpha;
-
-        KMeansEncoderLearnWorkItem()
-            : _pEncoder(nullptr)
-        {}
-
-        void run(size_t threadIndex) override;
-    };
-	
     /*!
     \brief Encoders values to a columnar SDR through random transformation.
     */
@@ -79,7 +27,7 @@ namespace eogmaneo {
 
         std::vector<float> _weights;
 
-		void activate(int cx, int cy);
+		void activate(int cx, int cy, float* scratch);
 		void reconstruct(int cx, int cy);
         void learn(int cx, int cy, float alpha);
 
@@ -172,9 +120,5 @@ namespace eogmaneo {
         const std::vector<int> &getHiddenStates() const {
             return _hiddenStates;
         }
-		
-		friend class KMeansEncoderActivateWorkItem;
-		friend class KMeansEncoderReconstructWorkItem;
-        friend class KMeansEncoderLearnWorkItem;
     };
 }
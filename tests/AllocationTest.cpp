@@ -0,0 +1,122 @@
+// ----------------------------------------------------------------------------
+//  EOgmaNeo
+//  Copyright(c) 2017-2018 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of EOgmaNeo is licensed to you under the terms described
+//  in the EOGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Checks that Hierarchy::step does not allocate after the first step, with a counting operator new
+
+#include "Hierarchy.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+using namespace eogmaneo;
+
+namespace {
+    std::atomic<long> allocations(0);
+}
+
+void* operator new(size_t size) {
+    allocations++;
+
+    void* p = std::malloc(size != 0 ? size : 1);
+
+    if (p == nullptr)
+        throw std::bad_alloc();
+
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+    // Steps a three layer hierarchy (higher layers first update on later steps), returns the allocations after the first step
+    long stepAllocations(int numWorkers, SchedulingMode mode, bool incremental) {
+        ComputeSystem cs(numWorkers, 1234, mode);
+
+        std::vector<LayerDesc> layerDescs(3);
+
+        for (int l = 0; l < layerDescs.size(); l++) {
+            layerDescs[l]._width = 4;
+            layerDescs[l]._height = 4;
+            layerDescs[l]._columnSize = 16;
+            layerDescs[l]._ticksPerUpdate = 2;
+            layerDescs[l]._temporalHorizon = 2 + l;
+            layerDescs[l]._weightLayout = l == 1 ? _hiddenCellMinor : _hiddenCellMajor;
+        }
+
+        Hierarchy h;
+
+        h.create({ { 5, 5 }, { 3, 3 } }, { 12, 8 }, { true, true }, layerDescs, 1234);
+
+        for (int l = 0; l < h.getNumLayers(); l++)
+            h.getLayer(l)._incremental = incremental;
+
+        std::vector<std::vector<int> > inputs(2);
+
+        inputs[0].resize(25);
+        inputs[1].resize(9);
+
+        std::vector<int> topFeedBack(16, 3);
+        std::vector<int> noFeedBack;
+
+        long before = 0;
+
+        for (int t = 0; t < 40; t++) {
+            for (int i = 0; i < inputs[0].size(); i++)
+                inputs[0][i] = (t + i) % 12;
+
+            for (int i = 0; i < inputs[1].size(); i++)
+                inputs[1][i] = (t / 3 + i) % 8;
+
+            h.step(cs, inputs, t % 3 != 2, t % 5 < 2 ? topFeedBack : noFeedBack);
+
+            if (t == 0)
+                before = allocations;
+        }
+
+        return allocations - before;
+    }
+}
+
+int main() {
+    int failures = 0;
+
+    const int workers[] = { 1, 2, 4 };
+
+    for (int numWorkers : workers)
+        for (int mode = 0; mode < 2; mode++)
+            for (int incremental = 0; incremental < 2; incremental++) {
+                long count = stepAllocations(numWorkers, mode == 0 ? _sharedQueue : _workStealing, incremental != 0);
+
+                std::printf("%d workers, %s, %s: %ld allocations after the first step\n", numWorkers, mode == 0 ? "shared queue" : "work stealing", incremental ? "incremental" : "full", count);
+
+                if (count != 0)
+                    failures++;
+            }
+
+    return failures != 0 ? 1 : 0;
+}
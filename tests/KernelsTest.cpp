@@ -0,0 +1,298 @@
+// ----------------------------------------------------------------------------
+//  EOgmaNeo
+//  Copyright(c) 2017-2018 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of EOgmaNeo is licensed to you under the terms described
+//  in the EOGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Checks every entry of each kernel table this CPU supports against the scalar reference, bit for bit
+
+#include "Kernels.h"
+
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
+using namespace eogmaneo;
+
+namespace {
+    int failures = 0;
+
+    void check(bool ok, const Kernels &kernels, const char* what, int n) {
+        if (!ok) {
+            std::printf("FAIL %s %s (n = %d)\n", kernels._name, what, n);
+
+            failures++;
+        }
+    }
+
+    bool sameBits(const std::vector<float> &a, const std::vector<float> &b) {
+        return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(float)) == 0;
+    }
+
+    std::mt19937 rng(1234);
+
+    std::vector<float> randomFloats(int n) {
+        std::uniform_real_distribution<float> dist(-2.0f, 2.0f);
+
+        std::vector<float> x(n);
+
+        for (int i = 0; i < n; i++)
+            x[i] = dist(rng);
+
+        return x;
+    }
+
+    // Sizes around the SIMD widths and the specialized column sizes
+    const int sizes[] = { 1, 2, 3, 7, 8, 9, 13, 15, 16, 17, 24, 31, 32, 33, 48, 63, 64, 65, 100, 128, 129 };
+
+    void checkElementwise(const Kernels &kernels, const Kernels &reference) {
+        for (int n : sizes)
+            for (int stride = 1; stride <= 3; stride++) {
+                std::vector<float> src = randomFloats(n * stride);
+                std::vector<float> init = randomFloats(n);
+
+                std::vector<float> a = init, b = init;
+
+                kernels._accumulate(a.data(), src.data(), stride, n);
+                reference._accumulate(b.data(), src.data(), stride, n);
+
+                check(sameBits(a, b), kernels, "_accumulate", n);
+
+                a = b = init;
+
+                kernels._accumulateScaled(a.data(), src.data(), stride, 0.37f, n);
+                reference._accumulateScaled(b.data(), src.data(), stride, 0.37f, n);
+
+                check(sameBits(a, b), kernels, "_accumulateScaled", n);
+
+                a = b = init;
+
+                kernels._accumulateNegSquaredDistance(a.data(), src.data(), stride, 0.61f, n);
+                reference._accumulateNegSquaredDistance(b.data(), src.data(), stride, 0.61f, n);
+
+                check(sameBits(a, b), kernels, "_accumulateNegSquaredDistance", n);
+            }
+
+        for (int n : sizes) {
+            std::vector<float> activations = randomFloats(n);
+
+            std::vector<float> a(n), b(n);
+
+            for (int target = -1; target < n; target += n / 3 + 1) {
+                kernels._deltas(a.data(), activations.data(), target, 0.1f, n);
+                reference._deltas(b.data(), activations.data(), target, 0.1f, n);
+
+                check(sameBits(a, b), kernels, "_deltas", n);
+            }
+        }
+    }
+
+    void checkArgMax(const Kernels &kernels, const Kernels &reference) {
+        float nan = std::numeric_limits<float>::quiet_NaN();
+
+        for (int n : sizes) {
+            std::vector<std::vector<float> > cases;
+
+            cases.push_back(randomFloats(n));
+
+            // Ties, the first largest wins
+            cases.push_back(std::vector<float>(n, 1.0f));
+
+            std::vector<float> ties = randomFloats(n);
+
+            ties[n / 2] = ties[n - 1] = 5.0f;
+
+            cases.push_back(ties);
+
+            // Signed zeros compare equal
+            std::vector<float> zeros(n, -1.0f);
+
+            zeros[n - 1] = 0.0f;
+            zeros[n / 3] = -0.0f;
+
+            cases.push_back(zeros);
+
+            // NaNs are never larger, a leading NaN is never replaced
+            std::vector<float> nans = randomFloats(n);
+
+            nans[n / 2] = nan;
+
+            cases.push_back(nans);
+
+            nans[0] = nan;
+
+            cases.push_back(nans);
+
+            cases.push_back(std::vector<float>(n, nan));
+
+            std::vector<float> infinities = randomFloats(n);
+
+            infinities[n - 1] = -std::numeric_limits<float>::infinity();
+            infinities[n / 2] = std::numeric_limits<float>::infinity();
+
+            cases.push_back(infinities);
+
+            for (int c = 0; c < cases.size(); c++)
+                check(kernels._argMax(cases[c].data(), n) == reference._argMax(cases[c].data(), n), kernels, "_argMax", n);
+        }
+    }
+
+    void checkColumnKernels(const ColumnKernels &columnKernels, const Kernels &kernels, const ColumnKernels &reference, int n) {
+        // Cell strides of the hidden cell minor layout (1), a column (n) and the major layout's rows
+        const int strides[] = { 1, n, n * 5 + 3 };
+
+        for (int stride : strides) {
+            int rowSize = stride == 1 ? n * 9 : 9;
+
+            std::vector<float> src = randomFloats(rowSize + (n - 1) * stride);
+
+            for (int count = 0; count <= 9; count += 3) {
+                std::vector<int> offsets(count);
+
+                std::vector<float> scales = randomFloats(count);
+
+                for (int k = 0; k < count; k++)
+                    offsets[k] = static_cast<int>(rng() % (stride == 1 ? 9 : rowSize)) * (stride == 1 ? n : 1);
+
+                std::vector<float> init = randomFloats(n);
+
+                std::vector<float> a = init, b = init;
+
+                columnKernels._accumulateRows(a.data(), src.data(), offsets.data(), count, stride, n);
+                reference._accumulateRows(b.data(), src.data(), offsets.data(), count, stride, n);
+
+                check(sameBits(a, b), kernels, "_accumulateRows", n);
+
+                a = b = init;
+
+                columnKernels._accumulateRowsScaled(a.data(), src.data(), offsets.data(), scales.data(), count, stride, n);
+                reference._accumulateRowsScaled(b.data(), src.data(), offsets.data(), scales.data(), count, stride, n);
+
+                check(sameBits(a, b), kernels, "_accumulateRowsScaled", n);
+            }
+        }
+    }
+
+    void checkAllColumnKernels(const Kernels &kernels, const Kernels &reference) {
+        const ColumnKernels &generic = getColumnKernels(reference, 0);
+
+        // Every specialization at its own size
+        for (const ColumnKernels* columnKernels = kernels._columnKernels; ; columnKernels++) {
+            if (columnKernels->_columnSize != 0)
+                checkColumnKernels(*columnKernels, kernels, generic, columnKernels->_columnSize);
+            else {
+                for (int n : sizes)
+                    checkColumnKernels(*columnKernels, kernels, generic, n);
+
+                break;
+            }
+        }
+
+        // What the layer picks, specialized or not
+        for (int n : sizes)
+            checkColumnKernels(getColumnKernels(kernels, n), kernels, generic, n);
+    }
+
+    void checkQuantized(const Kernels &kernels, const Kernels &reference) {
+        for (int n : sizes) {
+            int rowStride = n + 3;
+            int numRows = 11;
+
+            std::vector<uint16_t> halves(numRows * rowStride);
+            std::vector<int8_t> bytes(numRows * rowStride);
+
+            std::vector<float> weights = randomFloats(numRows * rowStride);
+
+            for (int i = 0; i < weights.size(); i++) {
+                halves[i] = floatToHalf(weights[i]);
+                bytes[i] = static_cast<int8_t>(static_cast<int>(rng() % 255) - 127);
+            }
+
+            std::vector<float> steps = randomFloats(n);
+            std::vector<float> bases = randomFloats(n);
+
+            for (int count = 0; count <= 12; count += 4) {
+                std::vector<int> rows(count);
+
+                for (int k = 0; k < count; k++)
+                    rows[k] = static_cast<int>(rng() % numRows);
+
+                std::vector<float> scales = randomFloats(count);
+
+                std::vector<float> init = randomFloats(n);
+
+                for (int scaled = 0; scaled < 2; scaled++) {
+                    const float* rowScales = scaled ? scales.data() : nullptr;
+
+                    std::vector<float> a = init, b = init;
+
+                    kernels._accumulateRowsHalf(a.data(), halves.data(), rows.data(), rowScales, count, rowStride, n);
+                    reference._accumulateRowsHalf(b.data(), halves.data(), rows.data(), rowScales, count, rowStride, n);
+
+                    check(sameBits(a, b), kernels, "_accumulateRowsHalf", n);
+
+                    a = b = init;
+
+                    kernels._accumulateRowsInt8(a.data(), bytes.data(), steps.data(), bases.data(), rows.data(), rowScales, count, rowStride, n);
+                    reference._accumulateRowsInt8(b.data(), bytes.data(), steps.data(), bases.data(), rows.data(), rowScales, count, rowStride, n);
+
+                    check(sameBits(a, b), kernels, "_accumulateRowsInt8", n);
+                }
+            }
+        }
+    }
+
+    void checkCrc32c(const Kernels &kernels, const Kernels &reference) {
+        std::vector<unsigned char> data(1000);
+
+        for (int i = 0; i < data.size(); i++)
+            data[i] = static_cast<unsigned char>(rng());
+
+        // All lengths and alignments up to a few words, then longer runs
+        for (int start = 0; start < 9; start++)
+            for (int size = 0; start + size <= data.size(); size += size < 40 ? 1 : 97)
+                check(kernels._crc32c(0xffffffffu, data.data() + start, size) == reference._crc32c(0xffffffffu, data.data() + start, size), kernels, "_crc32c", size);
+
+        // Known answer, CRC-32C of "123456789"
+        const unsigned char digits[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+
+        check((kernels._crc32c(0xffffffffu, digits, sizeof(digits)) ^ 0xffffffffu) == 0xe3069283u, kernels, "_crc32c check value", sizeof(digits));
+    }
+}
+
+int main() {
+    const Kernels* reference = getKernels(_kernelScalar);
+
+    const KernelLevel levels[] = { _kernelScalar, _kernelAVX2, _kernelAVX512 };
+
+    for (KernelLevel level : levels) {
+        const Kernels* kernels = getKernels(level);
+
+        // Not compiled in or not supported by this CPU
+        if (kernels == nullptr) {
+            std::printf("skipped level %d\n", static_cast<int>(level));
+
+            continue;
+        }
+
+        checkElementwise(*kernels, *reference);
+        checkArgMax(*kernels, *reference);
+        checkAllColumnKernels(*kernels, *reference);
+        checkQuantized(*kernels, *reference);
+        checkCrc32c(*kernels, *reference);
+
+        std::printf("checked %s\n", kernels->_name);
+    }
+
+    if (failures != 0) {
+        std::printf("%d failures\n", failures);
+
+        return 1;
+    }
+
+    return 0;
+}